@@ -0,0 +1,79 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <sys/mman.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <linux/types.h>
+
+#include "memcpy_afu.h"
+#include "bufpool.h"
+
+/*
+ * Sets up count buffers of each size class up to max_size.  With
+ * BUFPOOL_MLOCK, the buffers are locked in memory, or left unlocked with
+ * a warning if the memlock limit is too low.
+ */
+int bufpool_init(struct bufpool *pool, size_t max_size, int count, int flags)
+{
+	size_t size;
+	char *buf;
+	int class, i;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->nclasses = bufpool_class(max_size) + 1;
+	if (pool->nclasses > BUFPOOL_MAX_CLASSES || count < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* Class c holds count buffers of 2^(c + BUFPOOL_MIN_SHIFT) bytes */
+	pool->len = (size_t)count * ((1UL << (pool->nclasses +
+					      BUFPOOL_MIN_SHIFT)) -
+				     (1UL << BUFPOOL_MIN_SHIFT));
+	pool->mem = memcpy_alloc(pool->len);
+	if (pool->mem == NULL)
+		return -1;
+
+	/* Fault everything in now */
+	memset(pool->mem, 0, pool->len);
+	if (flags & BUFPOOL_MLOCK) {
+		if (mlock(pool->mem, pool->len))
+			perror("Warning: mlock of the buffer pool");
+		else
+			pool->locked = 1;
+	}
+
+	buf = pool->mem;
+	for (class = 0; class < pool->nclasses; class++) {
+		size = 1UL << (class + BUFPOOL_MIN_SHIFT);
+		for (i = 0; i < count; i++, buf += size)
+			bufpool_put(pool, buf, size);
+	}
+	return 0;
+}
+
+void bufpool_free(struct bufpool *pool)
+{
+	if (pool->mem == NULL)
+		return;
+	if (pool->locked)
+		munlock(pool->mem, pool->len);
+	memcpy_free(pool->mem, pool->len);
+	memset(pool, 0, sizeof(*pool));
+}
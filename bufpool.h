@@ -0,0 +1,79 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BUFPOOL_H_
+#define _BUFPOOL_H_
+
+#include <stddef.h>
+
+/*
+ * Pool of copy buffers, for one thread: no locking.
+ *
+ * Buffers come in power of two size classes, from a cacheline up to the
+ * largest size asked for at init, each class with a fixed number of
+ * buffers carved out of a single memcpy_alloc() area.  The area is touched
+ * at init, and optionally locked, so that getting a buffer never faults.
+ * Each class keeps a free list linked through the first word of its free
+ * buffers, so get and put are O(1).
+ */
+#define BUFPOOL_MIN_SHIFT	7	/* 128 byte cacheline */
+#define BUFPOOL_MAX_CLASSES	24
+
+/* bufpool_init() flags */
+#define BUFPOOL_MLOCK		0x1
+
+struct bufpool {
+	char *mem;
+	size_t len;
+	int nclasses;
+	int locked;
+	void *free[BUFPOOL_MAX_CLASSES];
+};
+
+static inline int bufpool_class(size_t size)
+{
+	if (size <= (1UL << BUFPOOL_MIN_SHIFT))
+		return 0;
+	return 64 - __builtin_clzl(size - 1) - BUFPOOL_MIN_SHIFT;
+}
+
+/* A buffer of at least size bytes, NULL if its class is empty */
+static inline void *bufpool_get(struct bufpool *pool, size_t size)
+{
+	int class = bufpool_class(size);
+	void *buf;
+
+	if (class >= pool->nclasses)
+		return NULL;
+	buf = pool->free[class];
+	if (buf)
+		pool->free[class] = *(void **)buf;
+	return buf;
+}
+
+/* Gives back a buffer from bufpool_get() with the same size */
+static inline void bufpool_put(struct bufpool *pool, void *buf, size_t size)
+{
+	int class = bufpool_class(size);
+
+	*(void **)buf = pool->free[class];
+	pool->free[class] = buf;
+}
+
+int bufpool_init(struct bufpool *pool, size_t max_size, int count, int flags);
+void bufpool_free(struct bufpool *pool);
+
+#endif /* _BUFPOOL_H_ */
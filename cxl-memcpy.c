@@ -17,11 +17,15 @@
 #include <linux/pci.h>
 #include <linux/module.h>
 #include <linux/module.h>
-#include <linux/semaphore.h>
+#include <linux/mutex.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/file.h>
 #include <linux/delay.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include <linux/sched/mm.h>
 
 #include <asm/atomic.h>
@@ -43,30 +47,93 @@ uint cpu_memcopy;
 module_param_named(cpu_memcopy, cpu_memcopy, uint, 0600);
 MODULE_PARM_DESC(cpu_memcopy, "Use CPU to perform memcpy");
 
+uint poll_us;
+module_param_named(poll_us, poll_us, uint, 0600);
+MODULE_PARM_DESC(poll_us, "Spin this long for a copy before sleeping (us)");
+
+/* How long to wait for the end of job interrupt of a copy */
+#define COPY_TIMEOUT_MS 1000
+
 #define DEVICENAME "cxlmemcpy"
 #define CLASSNAME "cxltest"
 #define MINOR_MAX 1
 static int major_number;
 static atomic_t minor_number;
-static struct semaphore sem;
 static struct cdev *cdev;
 static dev_t dev_num;
 static struct pci_dev *memcpy_afu_dev;
 static struct class *cxltest_class;
 
-/* copy buffers.  This afu requires cachline alignment (ie 128 bytes) */
+/*
+ * copy buffers.  This afu requires cachline alignment (ie 128 bytes), which
+ * kmalloc() gives a buffer of this size: a power of two is aligned to itself.
+ */
 #define BUFFER_SIZE 1024
-static char write_buf[BUFFER_SIZE] __aligned(128);
-static char read_buf[BUFFER_SIZE] __aligned(128);
+
+/*
+ * Copies between user buffers: the AFU copies the cacheline aligned body,
+ * in work elements of at most COPY_MAX_LENGTH bytes, COPY_CHUNK of them
+ * per end of job interrupt.  COPY_MAX_SIZE bounds the pages pinned at once.
+ */
+#define COPY_ALIGN 128
+#define COPY_MAX_LENGTH (0xffff & ~(COPY_ALIGN - 1))
+#define COPY_CHUNK 256
+#define COPY_CHUNK_SIZE (COPY_CHUNK * COPY_MAX_LENGTH)
+#define COPY_MAX_SIZE (1UL << 30)
+
+/* A copy the AFU does, in work elements of at most COPY_MAX_LENGTH bytes */
+struct cxl_memcpy_range {
+	u64 dst;
+	u64 src;
+	size_t len;
+};
+
+static inline int cxl_memcpy_elements(size_t len)
+{
+	return DIV_ROUND_UP(len, COPY_MAX_LENGTH);
+}
 
 #define MEMCPY_QUEUE_ENTRIES 4095*2
 #define MEMCPY_QUEUE_SIZE (MEMCPY_QUEUE_ENTRIES * sizeof(struct memcpy_work_element))
-static struct memcpy_work_element cxl_memcpy_queue[MEMCPY_QUEUE_ENTRIES] __aligned(PAGE_SIZE);
+
+/* The AFU only sees the whole cachelines of the queue */
+#define MEMCPY_QUEUE_DEPTH (MEMCPY_QUEUE_SIZE / SMP_CACHE_BYTES)
+#define MEMCPY_QUEUE_LENGTH (MEMCPY_QUEUE_DEPTH * SMP_CACHE_BYTES / \
+			     sizeof(struct memcpy_work_element))
 
 struct cxl_memcpy_info {
-	bool afu_irq_done;
+	struct completion afu_irq_done;
 };
 
+/*
+ * Per open file state: an AFU context of its own, with its queue, end of
+ * job completion and copy buffers, so that the clients of the device copy
+ * in parallel.  The context is set up by the first copy and kept until
+ * close, so that a copy only appends work elements to the live queue.
+ * Files only used for the other ioctls never start one.  The copies
+ * through one file are serialized by its lock.
+ */
+struct cxl_memcpy_afu {
+	struct pci_dev *dev;
+	struct mutex lock;
+	struct cxl_context *ctx;
+	void __iomem *psa;
+	struct cxl_memcpy_info info;
+	struct memcpy_work_element *queue;	/* page aligned, vmalloc()ed */
+	int next;		/* next free slot of the queue */
+	u8 wrap;		/* wrap bit of the current pass over it */
+	char *write_buf;
+	char *read_buf;
+};
+
+/*
+ * The first context the module starts writes the AFU configuration, as
+ * the shared master context used to before its copies.  It stays in place
+ * for the later ones, since the driver never resets the AFU.
+ */
+static DEFINE_MUTEX(psa_init_lock);
+static bool psa_init_done;
+
 #define VPD_SIZE 4096 * 8
 
 static void cxl_memcpy_vpd_info(struct pci_dev *dev)
@@ -100,99 +167,145 @@ static irqreturn_t cxl_memcpy_irq_afu(int irq, void *data)
 {
 	struct cxl_memcpy_info *info = data;
 
-	smp_mb();
-	info->afu_irq_done = true;
+	complete(&info->afu_irq_done);
 
 	return IRQ_HANDLED;
 }
 
 static irqreturn_t cxl_memcpy_copy_error(int irq, void *data)
 {
-	printk("%s IRQ %i Copy error!\n", __func__, irq);
+	pr_err_ratelimited("%s IRQ %i Copy error!\n", __func__, irq);
 	return IRQ_HANDLED;
 }
 
 static irqreturn_t cxl_memcpy_afu_error(int irq, void *data)
 {
-	printk("%s IRQ %i AFU error!\n", __func__, irq);
+	pr_err_ratelimited("%s IRQ %i AFU error!\n", __func__, irq);
 	return IRQ_HANDLED;
 }
 
 /*
- * Setup the memcpy AFU queue.  This is memcpy AFU specific.  It needs
- * two entries, one to do the actual copy and a second the send the
- * interrupt.  The last entry is blank so the afu doesn't run off the
- * end of the queue.
+ * Setup the memcpy AFU queue.  This is memcpy AFU specific.  The queue
+ * starts empty: copies are appended as they come, see
+ * cxl_memcpy_queue_copy().
  */
-void cxl_memcpy_setup_queue(void)
-{
-	memset(cxl_memcpy_queue, 0, MEMCPY_QUEUE_SIZE);
-	/* first entry: Copy */
-	cxl_memcpy_queue[0].cmd = MEMCPY_WE_CMD(0, MEMCPY_WE_CMD_COPY);
-	cxl_memcpy_queue[0].status = 0;
-	cxl_memcpy_queue[0].length = cpu_to_be16(BUFFER_SIZE);
-	cxl_memcpy_queue[0].src = cpu_to_be64((u64)write_buf);
-	cxl_memcpy_queue[0].dst = cpu_to_be64((u64)read_buf);
-	/* second entry: generate IRQ */
-	cxl_memcpy_queue[1].cmd = MEMCPY_WE_CMD(1, MEMCPY_WE_CMD_IRQ);
-	cxl_memcpy_queue[1].status = 0;
-	cxl_memcpy_queue[1].length = cpu_to_be16(1);
-	cxl_memcpy_queue[1].src = 0;
-	cxl_memcpy_queue[1].dst = 0;
-	/* third entry: left empty */
+void cxl_memcpy_setup_queue(struct cxl_memcpy_afu *afu)
+{
+	memset(afu->queue, 0, MEMCPY_QUEUE_SIZE);
+	afu->next = 0;
+	afu->wrap = 0;
 
 	/* Make sure this hits memory before we start the AFU */
 	mb();
 }
 
+/* Takes the next slot of the queue */
+static struct memcpy_work_element *
+cxl_memcpy_next_slot(struct cxl_memcpy_afu *afu)
+{
+	struct memcpy_work_element *we = &afu->queue[afu->next];
+
+	if (++afu->next == MEMCPY_QUEUE_LENGTH) {
+		afu->next = 0;
+		afu->wrap ^= MEMCPY_WE_CMD_WRAP;
+	}
+	return we;
+}
+
 /*
- * Set the valid bit on the first entry in the queue, so that the
- * AFU starts its processing.
+ * Appends n copies, each in work elements of at most COPY_MAX_LENGTH bytes,
+ * and a single interrupt, to the live queue.  The AFU waits on the slot of
+ * the first copy: its valid bit is set last, once the others are in place.
+ * The AFU completes the copies and the interrupt before the next ones are
+ * queued, so the queue never fills.  The copy elements start at *first.
  */
-void cxl_memcpy_activate_queue(void)
+static void cxl_memcpy_queue_copy(struct cxl_memcpy_afu *afu,
+				  const struct cxl_memcpy_range *r, int n,
+				  int *first)
 {
-	cxl_memcpy_queue[0].cmd |= MEMCPY_WE_CMD_VALID;
+	struct memcpy_work_element *we;
+	int i, count = 0, slot;
+	u8 wrap, cmd, first_cmd = 0;
+	size_t off, len;
+
+	*first = afu->next;
+	wrap = afu->wrap;
+	for (i = 0; i < n; i++) {
+		for (off = 0; off < r[i].len; off += len, count++) {
+			len = min_t(size_t, r[i].len - off, COPY_MAX_LENGTH);
+			we = cxl_memcpy_next_slot(afu);
+			we->status = 0;
+			we->length = cpu_to_be16(len);
+			we->src = cpu_to_be64(r[i].src + off);
+			we->dst = cpu_to_be64(r[i].dst + off);
+		}
+	}
+	we = cxl_memcpy_next_slot(afu);
+	we->status = 0;
+	we->length = cpu_to_be16(1);
+	we->src = 0;
+	we->dst = 0;
+	wmb();
+
+	for (i = 0, slot = *first; i <= count; i++) {
+		cmd = MEMCPY_WE_CMD(1, i < count ? MEMCPY_WE_CMD_COPY :
+				    MEMCPY_WE_CMD_IRQ) | wrap;
+		if (i)
+			afu->queue[slot].cmd = cmd;
+		else
+			first_cmd = cmd;
+		if (++slot == MEMCPY_QUEUE_LENGTH) {
+			slot = 0;
+			wrap ^= MEMCPY_WE_CMD_WRAP;
+		}
+	}
+	wmb();
+	afu->queue[*first].cmd = first_cmd;
+
+	/* Make sure the AFU sees the copy before we wait on it */
+	mb();
 }
 
 /*
  * Start the afu context.  This is calling into the generic CXL driver code
  * (except for the contents of the WED).
  */
-int cxl_memcpy_start_context(struct cxl_context *ctx)
+int cxl_memcpy_start_context(struct cxl_memcpy_afu *afu)
 {
 	u64 wed;
 
-	wed = MEMCPY_WED(cxl_memcpy_queue,
-			 MEMCPY_QUEUE_SIZE/SMP_CACHE_BYTES);
-	return cxl_start_context(ctx, wed, NULL);
+	wed = MEMCPY_WED(afu->queue, MEMCPY_QUEUE_DEPTH);
+	return cxl_start_context(afu->ctx, wed, NULL);
 }
 
-/* use memcpy afu to copy write_buf[] to read_buf[] */
-static int memcpy_afu(struct pci_dev *dev)
+/*
+ * Sets up the AFU context of a file: IRQs, queue, PSA mapping and, for
+ * the first one, the AFU configuration.  The context is a slave one, so the
+ * PSA maps its own per-process registers.  The AFU isn't reset: that would
+ * stop the other contexts on it, such as those of user space tests.
+ * Called with the file's lock held.
+ */
+static int cxl_memcpy_afu_start(struct cxl_memcpy_afu *afu)
 {
+	struct pci_dev *dev = afu->dev;
 	struct cxl_context *ctx;
-	struct cxl_memcpy_info *info;
-	void __iomem *psa;
 	int rc = 0;
 
-	info = kzalloc(sizeof(struct cxl_memcpy_info), GFP_KERNEL);
-
-	/* Get default context.  Can do this or create a new one */
-	ctx = cxl_get_context(memcpy_afu_dev);
-	if (!ctx)
-		return -ENOMEM;
+	if (afu->ctx)
+		return 0;
 
-	rc = cxl_afu_reset(ctx);
-	if (rc)
-		goto err1;
+	ctx = cxl_dev_context_init(dev);
+	if (IS_ERR(ctx))
+		return PTR_ERR(ctx);
 
 	/* Allocate AFU generated interrupt handler */
 	rc = cxl_allocate_afu_irqs(ctx, 4);
 	if (rc)
 		goto err1;
+	init_completion(&afu->info.afu_irq_done);
 
 	/* Register AFU interrupt 1. */
-	rc = cxl_map_afu_irq(ctx, 1, cxl_memcpy_irq_afu, info, "afu1");
+	rc = cxl_map_afu_irq(ctx, 1, cxl_memcpy_irq_afu, &afu->info, "afu1");
 	if (!rc)
 		goto err2;
 	/* Register AFU interrupt 2 for errors. */
@@ -208,83 +321,232 @@ static int memcpy_afu(struct pci_dev *dev)
 	if (!rc)
 		goto err5;
 
-	/* Register for PSL errors.  TODO: implement this */
-	//cxl_register_error_irq(dev, flags??, callback function, private data);
-
-	cxl_set_master(ctx);
-
 	/* Setup memcpy AFU work queue */
-	cxl_memcpy_setup_queue();
-
-	/* Mark interrupt as incomplete */
-	info->afu_irq_done = false;
-	smp_mb();
+	afu->ctx = ctx;
+	cxl_memcpy_setup_queue(afu);
 
 	/* Start Context on AFU */
-	rc = cxl_memcpy_start_context(ctx);
+	rc = cxl_memcpy_start_context(afu);
 	if (rc) {
 		dev_err(&dev->dev, "Can't start context");
 		goto err6;
 	}
 
 	/* Map AFU MMIO/Problem space area */
-	psa = cxl_psa_map(ctx);
-	if (!psa)
+	afu->psa = cxl_psa_map(ctx);
+	if (!afu->psa) {
+		rc = -ENOMEM;
 		goto err7;
+	}
 
 	/* Write configuration info to the AFU PSA space */
-	out_be64(psa + 0, 0x8000000000000000ULL);
-
-	/* Flip valid bit on first job on the queue */
-	cxl_memcpy_activate_queue();
-
-	/*
-	 * Wait for interrupt to complete.  We'd never do it this way in
-	 * practice, this is just a demonstration that the AFU IRQ works.
-	 */
-	rc = 0;
-	while(!info->afu_irq_done && rc < 1000) {
-		msleep(1);
-		rc++;
+	mutex_lock(&psa_init_lock);
+	if (!psa_init_done) {
+		out_be64(afu->psa + 0, 0x8000000000000000ULL);
+		psa_init_done = true;
 	}
+	mutex_unlock(&psa_init_lock);
+	return 0;
 
-	if (!info->afu_irq_done)
-		printk("Didn't receive end of job interrupt\n");
-
-	rc = 0;
-
-	/* Copy is complete!  Lets tear things down again */
-	cxl_psa_unmap(psa);
 err7:
 	cxl_stop_context(ctx);
 err6:
+	afu->ctx = NULL;
 	cxl_unmap_afu_irq(ctx, 4, ctx);
 err5:
 	cxl_unmap_afu_irq(ctx, 3, ctx);
 err4:
 	cxl_unmap_afu_irq(ctx, 2, ctx);
 err3:
-	cxl_unmap_afu_irq(ctx, 1, info);
+	cxl_unmap_afu_irq(ctx, 1, &afu->info);
 err2:
 	cxl_free_afu_irqs(ctx);
+	rc = rc ? rc : -ENODEV;
 err1:
-	kfree(info);
+	cxl_release_context(ctx);
 	return rc;
 }
 
+/* Tears down what cxl_memcpy_afu_start() set up */
+static void cxl_memcpy_afu_stop(struct cxl_memcpy_afu *afu)
+{
+	struct cxl_context *ctx = afu->ctx;
+
+	if (!ctx)
+		return;
+	cxl_psa_unmap(afu->psa);
+	cxl_stop_context(ctx);
+	cxl_unmap_afu_irq(ctx, 4, ctx);
+	cxl_unmap_afu_irq(ctx, 3, ctx);
+	cxl_unmap_afu_irq(ctx, 2, ctx);
+	cxl_unmap_afu_irq(ctx, 1, &afu->info);
+	cxl_free_afu_irqs(ctx);
+	cxl_release_context(ctx);
+	afu->psa = NULL;
+	afu->ctx = NULL;
+}
+
+/*
+ * The AFU stops after sending an interrupt: once it has, restart it
+ * through the process control register, to poll the queue again.
+ */
+static int cxl_memcpy_afu_restart(struct cxl_memcpy_afu *afu)
+{
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		if (in_be64(afu->psa + MEMCPY_PS_REG_STATUS) &
+		    MEMCPY_PS_REG_STATUS_Stopped) {
+			out_be64(afu->psa + MEMCPY_PS_REG_PCTRL,
+				 MEMCPY_PS_REG_PCTRL_Restart);
+			return 0;
+		}
+		udelay(1);
+	}
+	return -ETIMEDOUT;
+}
+
+/*
+ * Spins up to poll_us for the end of job interrupt, so that a short copy
+ * doesn't pay for a sleep and wakeup.  The interrupt handler still runs,
+ * on whichever CPU: the completion is consumed here.
+ */
+static bool cxl_memcpy_poll_irq(struct completion *done)
+{
+	ktime_t end;
+
+	if (!poll_us)
+		return false;
+	end = ktime_add_us(ktime_get(), poll_us);
+	do {
+		if (try_wait_for_completion(done))
+			return true;
+		cpu_relax();
+	} while (ktime_before(ktime_get(), end));
+	return false;
+}
+
+/*
+ * Queues n copies of at most COPY_CHUNK work elements in all, waits for
+ * their interrupt and checks their status.  errs, if set, gets the error
+ * of each copy.
+ */
+static int cxl_memcpy_afu_run(struct cxl_memcpy_afu *afu,
+			      const struct cxl_memcpy_range *r, int n,
+			      int *errs)
+{
+	struct completion *done = &afu->info.afu_irq_done;
+	int i, j, err, rc = 0, slot;
+	u8 status;
+
+	cxl_memcpy_queue_copy(afu, r, n, &slot);
+
+	/* Sleep until the end of job interrupt, after an optional spin */
+	if (!cxl_memcpy_poll_irq(done) &&
+	    !wait_for_completion_timeout(done,
+					 msecs_to_jiffies(COPY_TIMEOUT_MS))) {
+		dev_err(&afu->dev->dev, "Didn't receive end of job interrupt\n");
+		goto err;
+	}
+	if (cxl_memcpy_afu_restart(afu)) {
+		dev_err(&afu->dev->dev, "AFU didn't stop after the interrupt\n");
+		goto err;
+	}
+
+	for (i = 0; i < n; i++) {
+		err = 0;
+		for (j = 0; j < cxl_memcpy_elements(r[i].len); j++) {
+			status = afu->queue[slot].status;
+			if (status != MEMCPY_WE_STAT_COMPLETE) {
+				dev_err_ratelimited(&afu->dev->dev,
+					"Copy work element status %#x\n",
+					status);
+				err = rc = -EIO;
+			}
+			if (++slot == MEMCPY_QUEUE_LENGTH)
+				slot = 0;
+		}
+		if (errs)
+			errs[i] = err;
+	}
+	return rc;
+
+err:
+	/* Start over from a new context on the next copy */
+	cxl_memcpy_afu_stop(afu);
+	for (i = 0; errs && i < n; i++)
+		errs[i] = -ETIMEDOUT;
+	return -ETIMEDOUT;
+}
+
+/*
+ * The cacheline aligned body of a copy, which the AFU does, after *head
+ * bytes.  The CPU copies the unaligned head and tail, or everything if
+ * src and dst can't be aligned together.
+ */
+static size_t cxl_memcpy_body(const void *dst, const void *src, size_t len,
+			      size_t *head)
+{
+	if (((unsigned long)src ^ (unsigned long)dst) & (COPY_ALIGN - 1)) {
+		*head = len;
+		return 0;
+	}
+	*head = min_t(size_t, -(unsigned long)src & (COPY_ALIGN - 1), len);
+	return (len - *head) & ~(COPY_ALIGN - 1);
+}
+
+/* The CPU part of a copy: all but the body */
+static void cxl_memcpy_cpu_part(void *dst, const void *src, size_t len,
+				size_t head, size_t body)
+{
+	memcpy(dst, src, head);
+	memcpy(dst + head + body, src + head + body, len - head - body);
+}
+
+/* use memcpy afu to copy len bytes from src to dst, kernel addresses */
+static int memcpy_afu(struct cxl_memcpy_afu *afu, void *dst, const void *src,
+		      size_t len)
+{
+	struct cxl_memcpy_range r;
+	size_t head, body, off;
+	int rc;
+
+	body = cxl_memcpy_body(dst, src, len, &head);
+	if (body) {
+		rc = cxl_memcpy_afu_start(afu);
+		if (rc)
+			return rc;
+	}
+	for (off = head; off < head + body; off += r.len) {
+		r.len = min_t(size_t, head + body - off, COPY_CHUNK_SIZE);
+		r.dst = (u64)dst + off;
+		r.src = (u64)src + off;
+		rc = cxl_memcpy_afu_run(afu, &r, 1, NULL);
+		if (rc)
+			return rc;
+	}
+	cxl_memcpy_cpu_part(dst, src, len, head, body);
+	return 0;
+}
+
 static ssize_t device_read(struct file *fp, char __user *buff, size_t length,
 			   loff_t *ppos)
 {
+	struct cxl_memcpy_afu *afu = fp->private_data;
 	int max_bytes;
 	int bytes_to_read;
 	int bytes_read;
 	int rc;
 
+	if (mutex_lock_interruptible(&afu->lock))
+		return -ERESTARTSYS;
 	if (cpu_memcopy)
-		memcpy(read_buf, write_buf, BUFFER_SIZE);
+		memcpy(afu->read_buf, afu->write_buf, BUFFER_SIZE);
 	else {
-		rc = memcpy_afu(memcpy_afu_dev);
+		rc = memcpy_afu(afu, afu->read_buf, afu->write_buf,
+				BUFFER_SIZE);
 		if (rc) {
+			mutex_unlock(&afu->lock);
 			return rc;
 		}
 	}
@@ -295,41 +557,70 @@ static ssize_t device_read(struct file *fp, char __user *buff, size_t length,
 	else
 		bytes_to_read = max_bytes;
 
-	bytes_read = bytes_to_read - copy_to_user(buff, read_buf + *ppos,
+	bytes_read = bytes_to_read - copy_to_user(buff, afu->read_buf + *ppos,
 						  bytes_to_read);
 	*ppos += bytes_read;
+	mutex_unlock(&afu->lock);
 	return bytes_read;
 }
 
 static ssize_t device_write(struct file *fp, const char __user  *buff,
 			    size_t length, loff_t *ppos)
 {
+	struct cxl_memcpy_afu *afu = fp->private_data;
 	int max_bytes;
 	int bytes_to_write;
 	int bytes_writen;
 
+	if (mutex_lock_interruptible(&afu->lock))
+		return -ERESTARTSYS;
 	max_bytes = BUFFER_SIZE - *ppos;
 	if(max_bytes > length)
 		bytes_to_write = length;
 	else
 		bytes_to_write = max_bytes;
-	bytes_writen = bytes_to_write - copy_from_user(write_buf + *ppos,
+	bytes_writen = bytes_to_write - copy_from_user(afu->write_buf + *ppos,
 						       buff, bytes_to_write);
 	*ppos += bytes_writen;
+	mutex_unlock(&afu->lock);
 	return bytes_writen;
 }
 
+static void cxl_memcpy_afu_free(struct cxl_memcpy_afu *afu)
+{
+	vfree(afu->queue);
+	kfree(afu->write_buf);
+	kfree(afu->read_buf);
+	kfree(afu);
+}
+
 static int device_open(struct inode *inode, struct file *file)
 {
-	if (down_interruptible(&sem) != 0) {
-		return -1;
+	struct cxl_memcpy_afu *afu;
+
+	afu = kzalloc(sizeof(*afu), GFP_KERNEL);
+	if (!afu)
+		return -ENOMEM;
+	afu->dev = memcpy_afu_dev;
+	mutex_init(&afu->lock);
+	afu->queue = vzalloc(MEMCPY_QUEUE_SIZE);
+	afu->write_buf = kzalloc(BUFFER_SIZE, GFP_KERNEL);
+	afu->read_buf = kzalloc(BUFFER_SIZE, GFP_KERNEL);
+	if (!afu->queue || !afu->write_buf || !afu->read_buf) {
+		cxl_memcpy_afu_free(afu);
+		return -ENOMEM;
 	}
-	file->private_data = memcpy_afu_dev;
+
+	file->private_data = afu;
 	return 0;
 }
 
-static int device_close(struct inode *inode, struct file *file) {
-	up(&sem);
+static int device_close(struct inode *inode, struct file *file)
+{
+	struct cxl_memcpy_afu *afu = file->private_data;
+
+	cxl_memcpy_afu_stop(afu);
+	cxl_memcpy_afu_free(afu);
 	return 0;
 }
 
@@ -399,17 +690,288 @@ static long device_ioctl_handle_fault(struct pci_dev *dev, __u64 __user *arg)
 	return rc;
 }
 
+/* A pinned user buffer, mapped contiguously in the kernel for the AFU */
+struct cxl_memcpy_ubuf {
+	struct page **pages;
+	int npages;
+	bool write;
+	void *vaddr;
+};
+
+static int cxl_memcpy_pin(struct cxl_memcpy_ubuf *buf, u64 addr, u64 size,
+			  bool write)
+{
+	void *map;
+	int n, rc;
+
+	buf->npages = ((addr + size - 1) >> PAGE_SHIFT) -
+		(addr >> PAGE_SHIFT) + 1;
+	buf->write = write;
+	buf->pages = kvmalloc_array(buf->npages, sizeof(*buf->pages),
+				    GFP_KERNEL);
+	if (!buf->pages)
+		return -ENOMEM;
+
+	n = get_user_pages_fast(addr & PAGE_MASK, buf->npages,
+				write ? FOLL_WRITE : 0, buf->pages);
+	if (n != buf->npages) {
+		rc = n < 0 ? n : -EFAULT;
+		goto err;
+	}
+	map = vmap(buf->pages, buf->npages, VM_MAP, PAGE_KERNEL);
+	if (!map) {
+		rc = -ENOMEM;
+		goto err;
+	}
+	buf->vaddr = map + offset_in_page(addr);
+	return 0;
+err:
+	while (n > 0)
+		put_page(buf->pages[--n]);
+	kvfree(buf->pages);
+	return rc;
+}
+
+static void cxl_memcpy_unpin(struct cxl_memcpy_ubuf *buf)
+{
+	int i;
+
+	vunmap((void *)((unsigned long)buf->vaddr & PAGE_MASK));
+	for (i = 0; i < buf->npages; i++) {
+		if (buf->write)
+			set_page_dirty_lock(buf->pages[i]);
+		put_page(buf->pages[i]);
+	}
+	kvfree(buf->pages);
+}
+
+/*
+ * Copies between two user buffers of the caller, with no bounce buffer:
+ * the pages are pinned and mapped in the kernel, where the AFU, through
+ * the kernel context, copies from one to the other.
+ */
+static long device_ioctl_copy(struct cxl_memcpy_afu *afu,
+			      struct cxl_memcpy_ioctl_copy __user *arg)
+{
+	struct cxl_memcpy_ioctl_copy copy;
+	struct cxl_memcpy_ubuf src, dst;
+	int rc;
+
+	if (copy_from_user(&copy, arg, sizeof(struct cxl_memcpy_ioctl_copy)))
+		return -EFAULT;
+	if (!copy.size)
+		return 0;
+	if (copy.size > COPY_MAX_SIZE || copy.src + copy.size < copy.src ||
+	    copy.dst + copy.size < copy.dst)
+		return -EINVAL;
+
+	rc = cxl_memcpy_pin(&src, copy.src, copy.size, false);
+	if (rc)
+		return rc;
+	rc = cxl_memcpy_pin(&dst, copy.dst, copy.size, true);
+	if (rc)
+		goto out;
+
+	if (cpu_memcopy)
+		memcpy(dst.vaddr, src.vaddr, copy.size);
+	else if (mutex_lock_interruptible(&afu->lock))
+		rc = -ERESTARTSYS;
+	else {
+		rc = memcpy_afu(afu, dst.vaddr, src.vaddr, copy.size);
+		mutex_unlock(&afu->lock);
+	}
+
+	cxl_memcpy_unpin(&dst);
+out:
+	cxl_memcpy_unpin(&src);
+	return rc;
+}
+
+/* A copy of a batch: its pinned buffers and the AFU part of it */
+struct cxl_memcpy_batch_copy {
+	struct cxl_memcpy_ubuf src, dst;
+	bool pinned;
+	size_t head, body;
+};
+
+/*
+ * Runs the AFU parts of the copies of a batch.  They are queued back to
+ * back, in runs of at most COPY_CHUNK work elements, each with a single
+ * trailing interrupt: a batch of small copies waits for one interrupt.
+ * A copy whose body spans several ranges gets the first error of them.
+ */
+static int cxl_memcpy_batch_afu(struct cxl_memcpy_afu *afu,
+				struct cxl_memcpy_ioctl_desc *descs,
+				struct cxl_memcpy_batch_copy *copies, int count)
+{
+	struct cxl_memcpy_range *r;
+	int *owner, *errs;
+	int i, j, k, n = 0, elements, rc = 0;
+	size_t off, len;
+
+	for (i = 0; i < count; i++)
+		if (copies[i].pinned)
+			n += DIV_ROUND_UP(copies[i].body, COPY_CHUNK_SIZE);
+	if (!n)
+		return 0;
+
+	r = kvmalloc_array(n, sizeof(*r), GFP_KERNEL);
+	owner = kvmalloc_array(n, sizeof(*owner), GFP_KERNEL);
+	errs = kvmalloc_array(n, sizeof(*errs), GFP_KERNEL);
+	if (!r || !owner || !errs) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	for (i = 0, k = 0; i < count; i++) {
+		if (!copies[i].pinned)
+			continue;
+		for (off = copies[i].head;
+		     off < copies[i].head + copies[i].body; off += len, k++) {
+			len = min_t(size_t, copies[i].head + copies[i].body -
+				    off, COPY_CHUNK_SIZE);
+			r[k].dst = (u64)copies[i].dst.vaddr + off;
+			r[k].src = (u64)copies[i].src.vaddr + off;
+			r[k].len = len;
+			owner[k] = i;
+		}
+	}
+
+	for (i = 0; i < n; i = j) {
+		elements = 0;
+		for (j = i; j < n; j++) {
+			elements += cxl_memcpy_elements(r[j].len);
+			if (elements > COPY_CHUNK)
+				break;
+		}
+		/* On the first run, or after one timed out */
+		rc = cxl_memcpy_afu_start(afu);
+		if (rc)
+			goto out;
+		cxl_memcpy_afu_run(afu, r + i, j - i, errs + i);
+		for (k = i; k < j; k++)
+			if (!descs[owner[k]].status)
+				descs[owner[k]].status = errs[k];
+	}
+out:
+	kvfree(errs);
+	kvfree(owner);
+	kvfree(r);
+	return rc;
+}
+
+/*
+ * Copies a batch of descriptors between user buffers of the caller, as
+ * device_ioctl_copy() does one.  Each descriptor gets the status of its
+ * copy: the ioctl itself only fails if the batch can't be run.
+ */
+static long device_ioctl_copy_batch(struct cxl_memcpy_afu *afu,
+				    struct cxl_memcpy_ioctl_batch __user *arg)
+{
+	struct cxl_memcpy_ioctl_batch batch;
+	struct cxl_memcpy_ioctl_desc *descs, *d;
+	struct cxl_memcpy_batch_copy *copies, *c;
+	u64 total = 0;
+	int i, rc;
+
+	if (copy_from_user(&batch, arg, sizeof(struct cxl_memcpy_ioctl_batch)))
+		return -EFAULT;
+	if (batch.flags || batch.count > CXL_MEMCPY_BATCH_MAX)
+		return -EINVAL;
+	if (!batch.count)
+		return 0;
+
+	descs = kvmalloc_array(batch.count, sizeof(*descs), GFP_KERNEL);
+	copies = kvcalloc(batch.count, sizeof(*copies), GFP_KERNEL);
+	if (!descs || !copies) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(descs, u64_to_user_ptr(batch.descs),
+			   batch.count * sizeof(*descs))) {
+		rc = -EFAULT;
+		goto out;
+	}
+	for (i = 0; i < batch.count; i++) {
+		d = &descs[i];
+		total += d->size;
+		if (d->size > COPY_MAX_SIZE || total > COPY_MAX_SIZE ||
+		    d->src + d->size < d->src || d->dst + d->size < d->dst) {
+			rc = -EINVAL;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < batch.count; i++) {
+		d = &descs[i];
+		c = &copies[i];
+		d->status = 0;
+		if (!d->size)
+			continue;
+		d->status = cxl_memcpy_pin(&c->src, d->src, d->size, false);
+		if (d->status)
+			continue;
+		d->status = cxl_memcpy_pin(&c->dst, d->dst, d->size, true);
+		if (d->status) {
+			cxl_memcpy_unpin(&c->src);
+			continue;
+		}
+		c->pinned = true;
+		if (cpu_memcopy)
+			c->head = d->size;
+		else
+			c->body = cxl_memcpy_body(c->dst.vaddr, c->src.vaddr,
+						  d->size, &c->head);
+	}
+
+	if (mutex_lock_interruptible(&afu->lock)) {
+		rc = -ERESTARTSYS;
+		goto unpin;
+	}
+	rc = cxl_memcpy_batch_afu(afu, descs, copies, batch.count);
+	mutex_unlock(&afu->lock);
+	if (rc)
+		goto unpin;
+
+	for (i = 0; i < batch.count; i++) {
+		c = &copies[i];
+		if (c->pinned && !descs[i].status)
+			cxl_memcpy_cpu_part(c->dst.vaddr, c->src.vaddr,
+					    descs[i].size, c->head, c->body);
+	}
+	if (copy_to_user(u64_to_user_ptr(batch.descs), descs,
+			 batch.count * sizeof(*descs)))
+		rc = -EFAULT;
+unpin:
+	for (i = 0; i < batch.count; i++) {
+		if (copies[i].pinned) {
+			cxl_memcpy_unpin(&copies[i].dst);
+			cxl_memcpy_unpin(&copies[i].src);
+		}
+	}
+out:
+	kvfree(copies);
+	kvfree(descs);
+	return rc;
+}
+
 static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
-	struct pci_dev *dev = file->private_data;
+	struct cxl_memcpy_afu *afu = file->private_data;
 
 	pr_devel("device_ioctl\n");
 	switch (cmd) {
 	case CXL_MEMCPY_IOCTL_GET_FD:
-		return device_ioctl_get_fd(dev,
+		return device_ioctl_get_fd(afu->dev,
 				(struct cxl_memcpy_ioctl_get_fd __user *)arg);
 	case CXL_MEMCPY_IOCTL_HANDLE_FAULT:
-		return device_ioctl_handle_fault(dev, (__u64 __user *)arg);
+		return device_ioctl_handle_fault(afu->dev,
+						 (__u64 __user *)arg);
+	case CXL_MEMCPY_IOCTL_COPY:
+		return device_ioctl_copy(afu,
+				(struct cxl_memcpy_ioctl_copy __user *)arg);
+	case CXL_MEMCPY_IOCTL_COPY_BATCH:
+		return device_ioctl_copy_batch(afu,
+				(struct cxl_memcpy_ioctl_batch __user *)arg);
 	}
 	return -EINVAL;
 }
@@ -462,7 +1024,6 @@ static int cxl_memcpy_probe(struct pci_dev *dev, const struct pci_device_id *id)
 		goto err2;
 
 	afu = cxl_pci_to_afu(dev);
-	sema_init(&sem, 1);
 	memcpy_afu_dev = dev;
 
 	cxl_memcpy_vpd_info(dev);
@@ -24,6 +24,10 @@
 #define CXL_MEMCPY_MAGIC 0xC9
 #define CXL_MEMCPY_IOCTL_GET_FD		_IOW(CXL_MEMCPY_MAGIC, 0x00, int)
 #define CXL_MEMCPY_IOCTL_HANDLE_FAULT	_IOW(CXL_MEMCPY_MAGIC, 0x01, int)
+#define CXL_MEMCPY_IOCTL_COPY		_IOW(CXL_MEMCPY_MAGIC, 0x02, \
+					     struct cxl_memcpy_ioctl_copy)
+#define CXL_MEMCPY_IOCTL_COPY_BATCH	_IOWR(CXL_MEMCPY_MAGIC, 0x03, \
+					      struct cxl_memcpy_ioctl_batch)
 
 #define CXL_MEMCPY_IOCTL_GET_FD_MASTER	0x0000000000000001UL
 #define CXL_MEMCPY_IOCTL_GET_FD_ALL	0x0000000000000001UL
@@ -38,4 +42,31 @@ struct cxl_memcpy_ioctl_handle_fault {
 	__u64 size;
 };
 
+/* Copy size bytes between user buffers, at most 1GB */
+struct cxl_memcpy_ioctl_copy {
+	__u64 src;
+	__u64 dst;
+	__u64 size;
+};
+
+/*
+ * Copies of a batch, at most CXL_MEMCPY_BATCH_MAX of them and 1GB in all.
+ * descs points to count descriptors, whose status the driver sets: 0 once
+ * the copy is done, else a negative errno.
+ */
+#define CXL_MEMCPY_BATCH_MAX	1024
+
+struct cxl_memcpy_ioctl_desc {
+	__u64 src;
+	__u64 dst;
+	__u64 size;
+	__s64 status;
+};
+
+struct cxl_memcpy_ioctl_batch {
+	__u64 descs;
+	__u32 count;
+	__u32 flags;	/* must be 0 */
+};
+
 #endif
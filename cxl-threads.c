@@ -37,7 +37,24 @@
  *  -j: Join the spawned thread to exit (default)
  *  -d: Detach from the child threads and die (dead-state)
  *  -m: Use malloced memory instead of static memory for src/dst buffer
+ *  -M: Where -m buffers come from: a per-thread pool of pre-faulted
+ *      buffers (pool, default), the same locked in memory (mlock), or an
+ *      allocation and free per copy (churn).  Implies -m.
  *  -s: Size of the copy buffer used.
+ *  -b: Number of copies queued per afu_memcpy call with a single barrier.
+ *  -L: Serialize work element submission with a mutex (default lock-free).
+ *  -p: Give each copy thread its own slave context and work queue.
+ *  -W: How afu_memcpy waits for completion: sleep (default), spin,
+ *      yield, backoff, irq or adaptive.  Per-copy latency percentiles
+ *      and the CPU time spent waiting are reported.
+ *  -e: Seconds to wait for the AFU to signal completion (default 120).
+ *  -S: Run the submission scaling benchmark: 1 to 64 threads, mutex,
+ *      lock-free and per-thread context submission, reporting copies
+ *      per second.
+ *  -H: Back the work queues and -m pools with base (default), thp,
+ *      huge or hugetlbfs pages of the given size (2M, 16M, 1G, ...).
+ *  -N: Place the copy threads and their memory: local (to the card's
+ *      NUMA node), interleave (over the nodes) or a CPU list.
  */
 
 #include <unistd.h>
@@ -57,7 +74,18 @@
 #include <getopt.h>
 #include <sys/stat.h>
 #include <syscall.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sched.h>
+#include <time.h>
 #include "memcpy_afu.h"
+#include "timebase.h"
+#include "results.h"
+#include "placement.h"
+#include "bufpool.h"
+#include "pattern.h"
+#include "verify.h"
+#include "latency.h"
 
 #define ARRAY_SIZE(__arr__)  (sizeof(__arr__)/sizeof(__arr__)[0])
 
@@ -66,8 +94,13 @@
 
 #define MAX_BUFFER_SIZE  1024
 
+/* afu_memcpy batches can use the whole queue */
+#define MEMCPY_BATCH_MAX \
+	(QUEUE_SIZE * CACHELINESIZE / sizeof(struct memcpy_work_element))
+
 /* holds the path to  slave context to be used */
 char arg_master_context[PATH_MAX] = MEMCPY_MASTER_CONTEXT;
+int card_index;
 
 /* is psa setup done a separate thread */
 int setup_on_thread = 1;
@@ -79,11 +112,82 @@ int num_threads = 2;
 int num_loops = 1;
 
 /* use dynamically allocated memory */
-int use_malloc = 1;
+int use_malloc = 0;
+
+/*
+ * Where -m buffers come from: a per-thread pool of pre-faulted buffers,
+ * the same locked in memory, or aligned_alloc() and free() for each copy
+ */
+enum {
+	BUF_POOL,
+	BUF_MLOCK,
+	BUF_CHURN,
+} buf_mode = BUF_POOL;
+
+static const char * const buf_mode_names[] = {
+	[BUF_POOL] = "pool",
+	[BUF_MLOCK] = "mlock",
+	[BUF_CHURN] = "churn",
+};
+
+/* Buffers per size class of a thread's pool */
+#define BUFPOOL_COUNT	4
 
 /* Buffer size to use */
 size_t szbuffer = 128;
 
+/* source buffer data, one stream per thread and loop */
+static struct pattern pattern;
+
+/* number of work elements queued together by afu_memcpy */
+int batch_size = 1;
+
+/* claim work queue slots with an atomic increment rather than a mutex */
+int lockfree_submit = 1;
+
+/* each copy thread opens its own slave context */
+int per_thread_ctx = 0;
+
+/* how afu_memcpy waits for the copies to complete */
+enum wait_policy {
+	WAIT_SLEEP,		/* poll every poll_time */
+	WAIT_SPIN,		/* poll with a cpu relax hint */
+	WAIT_YIELD,		/* spin WAIT_SPIN_LOOPS times, then yield */
+	WAIT_BACKOFF,		/* sleep, doubling up to WAIT_BACKOFF_MAX_NS */
+	WAIT_IRQ,		/* sleep until the IRQ work element fires */
+	WAIT_ADAPTIVE,		/* pick one from the average latency */
+} wait_policy = WAIT_SLEEP;
+
+static const char * const wait_policy_names[] = {
+	"sleep", "spin", "yield", "backoff", "irq", "adaptive"
+};
+
+/* seconds to wait for the AFU to complete a memcpy */
+#define COMPLETION_TIMEOUT	120
+static int completion_timeout = COMPLETION_TIMEOUT;
+
+#define WAIT_SPIN_LOOPS		1000
+#define WAIT_BACKOFF_MAX_NS	256000
+#define WAIT_IRQ_NUM		1
+
+/* WAIT_ADAPTIVE thresholds on the average completion latency */
+#define ADAPT_SPIN_NS		2000
+#define ADAPT_YIELD_NS		50000
+#define ADAPT_IRQ_NS		500000
+
+/* Completion latency and waiting cost of the calling thread */
+struct wait_stats {
+	struct lat_hist hist;	/* timebase ticks */
+	unsigned long cpu_ns;	/* thread CPU time spent waiting */
+	__s64 avg;		/* moving average, drives WAIT_ADAPTIVE */
+	__u64 status_errors[RESULTS_STATUS_BITS];
+};
+static __thread struct wait_stats wstats;
+
+/* All threads' samples, merged when they report */
+static struct wait_stats total_wstats;
+static pthread_mutex_t mtx_stats = PTHREAD_MUTEX_INITIALIZER;
+
 /* main thread state after spawing the child threads*/
 enum {
 	EXIT_JOIN,
@@ -91,21 +195,41 @@ enum {
 	EXIT_ZOMBIE
 } exit_after_spawn = EXIT_JOIN;
 
-/* afu work element queue */
-struct memcpy_weq weq;
+/* afu slave context and its work element queue */
+struct afu_slave_ctx {
+	struct cxl_afu_h *afu_h;
+	struct memcpy_weq weq;
+};
+
+/* Master context, slave contexts are opened from it */
+struct cxl_afu_h *afu_master;
 
-/* Per process slave context */
-struct cxl_afu_h *afu_h;
+/* Per process slave context, shared by the copy threads */
+struct afu_slave_ctx shared_ctx;
+
+/* Slave context used by the calling thread */
+static __thread struct afu_slave_ctx *thread_ctx = &shared_ctx;
+
+/* Copies done by all threads, and the longest copy time of a thread */
+static unsigned long total_copies;
+static __u64 total_ticks;
+
+/* Copy threads start copying together, once all are set up */
+static pthread_barrier_t thread_barrier;
 
 /* Ask afu to perform a strcpy operation and wait for the operation to finish */
 static int afu_memcpy(char *dst, char *src, size_t size);
 
 /* Sets up per process problem state area */
-static int setup_afu_slave_psa(struct cxl_afu_h *afu);
+static int setup_afu_slave_psa(struct cxl_afu_h *afu, struct afu_slave_ctx *ctx);
 static void *setup_afu_slave_psa_proc(void *afu);
 
-/* protects the work queue from concurrent modifications*/
+/*
+ * serializes work queue submission when lockfree_submit is not set, the
+ * submitters sleep on cond_memcpy until their queue slots are released
+ */
 static pthread_mutex_t mtx_memcpy = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_memcpy = PTHREAD_COND_INITIALIZER;
 
 /* amount of time used for each poll iteration */
 static const struct timespec poll_time = {
@@ -113,10 +237,23 @@ static const struct timespec poll_time = {
 	.tv_nsec = 1000 /* 1 usec interval */
 };
 
+#define CACHELINESIZE	128
+#define QUEUE_SIZE	2
+
 /* Array to pthread handles */
-#define MAX_NUM_THREADS 32
+#define MAX_NUM_THREADS 64
 pthread_t arr_threads[MAX_NUM_THREADS];
 
+/* What each copy thread is started with */
+struct thread_arg {
+	int index;		/* among the threads of the run or -S point */
+	int loops;
+};
+static struct thread_arg thread_args[MAX_NUM_THREADS];
+
+/* Thread counts of the scaling benchmark */
+static const int bench_threads[] = { 1, 2, 4, 8, 16, 32, 64 };
+
 void dumpbuffer(char *bfr, size_t size)
 {
 	size_t count;
@@ -129,36 +266,228 @@ void dumpbuffer(char *bfr, size_t size)
 	printf("\n");
 }
 
+/*
+ * Reports the bad lines of a copy, and dumps the first of them.  The
+ * source is reproduced from the pattern seed and stream.
+ */
+static int verify_thread_copy(int thindex, int index, __u64 stream,
+			      char *srcbuffer, char *dstbuffer)
+{
+	struct verify_result res;
+	char prefix[32];
+	size_t line, len;
+
+	if (!verify_buffers(&res, dstbuffer, srcbuffer, szbuffer))
+		return 0;
+	printf("THREAD[%d]: Copy Loop index %d .. ERROR[rc=1], source stream"
+	       " %#llx\n", thindex, index, (unsigned long long)stream);
+	snprintf(prefix, sizeof(prefix), "THREAD[%d]: ", thindex);
+	verify_print(prefix, &res);
+	line = res.first & ~(VERIFY_LINE - 1);
+	len = szbuffer - line < VERIFY_LINE ? szbuffer - line : VERIFY_LINE;
+	printf("THREAD[%d]: SrcBuffer = %p, line at %zu\n", thindex,
+	       srcbuffer, line);
+	dumpbuffer(srcbuffer + line, len);
+	printf("THREAD[%d]: DstBuffer = %p, line at %zu\n", thindex,
+	       dstbuffer, line);
+	dumpbuffer(dstbuffer + line, len);
+	verify_free(&res);
+	return 1;
+}
+
+/*
+ * Pins the calling copy thread and binds its memory, as set with -N, by
+ * its index among the threads.  Returns -1 if that fails.
+ */
+static int thread_place(int index, int verbose)
+{
+	int cpu, node;
+
+	if (placement_apply(index, &cpu, &node)) {
+		printf("THREAD[%ld]: Unable to place the thread\n",
+		       syscall(SYS_gettid));
+		return -1;
+	}
+	if (verbose && cpu >= 0)
+		printf("THREAD[%ld]: Placed on cpu %d node %d\n",
+		       syscall(SYS_gettid), cpu, node);
+	return 0;
+}
+
+/* Opens a private slave context for the calling thread */
+static int thread_ctx_open(void)
+{
+	struct afu_slave_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL)
+		return 1;
+	thread_ctx = ctx;
+	return setup_afu_slave_psa(afu_master, ctx);
+}
+
+static void thread_ctx_close(void)
+{
+	struct afu_slave_ctx *ctx = thread_ctx;
+
+	if (ctx == &shared_ctx)
+		return;
+	thread_ctx = &shared_ctx;
+	if (ctx->afu_h)
+		cxl_afu_free(ctx->afu_h);
+	memcpy_free_weq(&ctx->weq);
+	free(ctx);
+}
+
+static void print_rate(const char *prefix, unsigned long copies, __u64 ticks)
+{
+	double t = tb_to_us(ticks);
+
+	printf("%s%lu copies in %.0f uS (%.0f copies/s, %.2f MB/s)\n", prefix,
+	       copies, t, t ? copies * 1000000.0 / t : 0,
+	       t ? (double)copies * szbuffer * batch_size / t : 0);
+}
+
+static unsigned long clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void wait_stats_init(struct wait_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	lat_hist_init(&st->hist);
+}
+
+static void print_wait_stats(const char *prefix, struct wait_stats *st)
+{
+	if (st->hist.count == 0)
+		return;
+	printf("%s%s wait: latency p50 %.1f uS p99 %.1f uS,"
+	       " cpu %.2f uS per memcpy\n", prefix,
+	       wait_policy_names[wait_policy],
+	       tb_to_us(lat_hist_percentile(&st->hist, 50)),
+	       tb_to_us(lat_hist_percentile(&st->hist, 99)),
+	       st->cpu_ns / 1000.0 / st->hist.count);
+}
+
+/* Structured results record for some copies and their wait statistics */
+static void emit_results(const char *scope, long id, unsigned long copies,
+			 __u64 ticks, struct wait_stats *st, int error)
+{
+	struct results_metrics m = {
+		.scope = scope,
+		.id = id,
+		.ops = copies,
+		.bytes = copies * szbuffer * batch_size,
+		.time_us = tb_to_us(ticks),
+		.ns_per_unit = tb_to_ns(1),
+		.error = error,
+	};
+
+	if (st) {
+		m.hist = &st->hist;
+		memcpy(m.status_errors, st->status_errors,
+		       sizeof(m.status_errors));
+	}
+	results_emit(&m);
+}
+
+/*
+ * Per-thread throughput over the ticks spent copying and latency,
+ * accounted into the aggregate, also when a copy failed with error.
+ */
+static void report_thread_rate(int thindex, int copies, __u64 ticks,
+			       int error)
+{
+	char prefix[32];
+	int i;
+
+	__atomic_fetch_add(&total_copies, copies, __ATOMIC_RELAXED);
+	snprintf(prefix, sizeof(prefix), "THREAD[%d]: ", thindex);
+	print_rate(prefix, copies, ticks);
+	emit_results("thread", thindex, copies, ticks, &wstats, error);
+
+	pthread_mutex_lock(&mtx_stats);
+	if (ticks > total_ticks)
+		total_ticks = ticks;
+	lat_hist_merge(&total_wstats.hist, &wstats.hist);
+	total_wstats.cpu_ns += wstats.cpu_ns;
+	for (i = 0; i < RESULTS_STATUS_BITS; i++)
+		total_wstats.status_errors[i] += wstats.status_errors[i];
+	pthread_mutex_unlock(&mtx_stats);
+	print_wait_stats(prefix, &wstats);
+	wait_stats_init(&wstats);
+}
+
+static char *get_buffer(struct bufpool *pool)
+{
+	if (buf_mode == BUF_CHURN)
+		return aligned_alloc(128, szbuffer);
+	return bufpool_get(pool, szbuffer);
+}
+
+static void put_buffer(struct bufpool *pool, char *buffer)
+{
+	if (buffer == NULL)
+		return;
+	if (buf_mode == BUF_CHURN)
+		free(buffer);
+	else
+		bufpool_put(pool, buffer, szbuffer);
+}
+
 void *afu_slave_threadproc_dynamic(void *arg)
 {
-	int thindex, index;
+	int thindex, index, copies = 0;
 	uintptr_t rc = 0;
 	char *srcbuffer = NULL, *dstbuffer = NULL;
-	int fd_random;
-	int loops = (uintptr_t)arg;
+	struct bufpool pool = { .mem = NULL };
+	struct thread_arg *targ = arg;
+	int loops = targ->loops;
+	__u64 start, ticks = 0, stream;
 
 	/* get the task_struct pid */
 	thindex = syscall(SYS_gettid);
-
-	fd_random = open("/dev/urandom", O_RDONLY);
-	if (fd_random < 0) {
-		perror("Unable to open random source /dev/urandom");
-		rc = 1;
-		goto out;
-	}
+	wait_stats_init(&wstats);
 
 	printf("THREAD[%d]: Starting with loop count %d\n", thindex, loops);
+	if (thread_place(targ->index, 1))
+		rc = 1;
 	if (exit_after_spawn) {
 		printf("THREAD[%d]: Sleeping for some time\n", thindex);
 		sleep(5);
 	}
 
+	if (!rc && per_thread_ctx && thread_ctx_open()) {
+		printf("THREAD[%d]: Unable to set up slave context\n",
+		       thindex);
+		rc = 1;
+	}
+
+	/* Fault the pool in before the clock starts */
+	if (!rc && buf_mode != BUF_CHURN &&
+	    bufpool_init(&pool, MAX_BUFFER_SIZE, BUFPOOL_COUNT,
+			 buf_mode == BUF_MLOCK ? BUFPOOL_MLOCK : 0)) {
+		printf("THREAD[%d]: Unable to set up the buffer pool\n",
+		       thindex);
+		rc = 1;
+	}
+	if (rc)
+		loops = 0;
+
 	/* All set now perform memcpy using a poll loop */
+	pthread_barrier_wait(&thread_barrier);
 	for (index = 0; index < loops; ++index) {
 		int ret;
 
-		srcbuffer = aligned_alloc(128, szbuffer);
-		dstbuffer = aligned_alloc(128, szbuffer);
+		start = tb_now();
+		srcbuffer = get_buffer(&pool);
+		dstbuffer = get_buffer(&pool);
+		ticks += tb_now() - start;
 
 		if ((srcbuffer == NULL) || (dstbuffer == NULL)) {
 		  printf("THREAD[%d]: Copy Loop index %d .. "
@@ -166,147 +495,246 @@ void *afu_slave_threadproc_dynamic(void *arg)
 		  goto loopend;
 		}
 
+		/* untimed source preparation */
+		stream = ((__u64)targ->index << 32) | index;
 		bzero(dstbuffer, szbuffer);
-		ret = read(fd_random, srcbuffer, szbuffer);
-		if (ret < szbuffer) {
-			rc = errno;
-			printf("THREAD[%d]: Copy Loop index %d .. "
-			       "Unable to populate srcbuffer Error=%d\n", thindex,
-			       index, (int)rc);
-			goto loopend;
-		}
+		pattern_fill(&pattern, srcbuffer, szbuffer, stream);
 
+		start = tb_now();
 		ret = afu_memcpy(dstbuffer, srcbuffer, szbuffer);
+		ticks += tb_now() - start;
 		if (ret) {
 			rc = ret;
 			perror("Unable to perform memcpy");
-			goto out;
+			break;
 		}
 
-		/* compare the strings */
-		ret = memcmp(srcbuffer, dstbuffer, szbuffer);
+		/* compare the buffers, a cache line at a time, untimed */
+		ret = verify_thread_copy(thindex, index, stream, srcbuffer,
+					 dstbuffer);
 		if (ret) {
-			size_t mindex;
 			rc = ret;
-			printf("THREAD[%d]: Copy Loop index %d .. "
-			       "ERROR[rc=%lu]\n", thindex, index, rc);
-			for (mindex = 0; mindex < szbuffer; ++mindex)
-				if (srcbuffer[mindex] != dstbuffer[mindex]) {
-					printf("THREAD[%d]: Mismatch at index=%lu %x!=%x\n",
-					       thindex, mindex, srcbuffer[mindex],
-						dstbuffer[mindex]);
-					break;
-				}
-			printf("THREAD[%d]: SrcBuffer = %p\n", thindex, srcbuffer);
-			dumpbuffer(srcbuffer, szbuffer);
-			printf("THREAD[%d]: DstBuffer = %p\n", thindex, dstbuffer);
-			dumpbuffer(dstbuffer, szbuffer);
 		} else {
 			printf("THREAD[%d]: Copy Loop index %d..OK\n",
 			       thindex, index);
+			copies++;
 		}
 loopend:
-		free(srcbuffer); srcbuffer = NULL;
-		free(dstbuffer); dstbuffer = NULL;
+		put_buffer(&pool, srcbuffer); srcbuffer = NULL;
+		put_buffer(&pool, dstbuffer); dstbuffer = NULL;
 	}
+	report_thread_rate(thindex, copies, ticks, rc);
 
-out:
-	free(srcbuffer);
-	free(dstbuffer);
-
-	if (fd_random >= 0)
-		close(fd_random);
+	thread_ctx_close();
+	put_buffer(&pool, srcbuffer);
+	put_buffer(&pool, dstbuffer);
+	bufpool_free(&pool);
 	return ((void *)rc);
 }
 
 void *afu_slave_threadproc_static(void *arg)
 {
-	int thindex, index;
+	int thindex, index, copies = 0;
 	uintptr_t rc = 0;
-	int fd_random;
-	int loops = (uintptr_t)arg;
+	struct thread_arg *targ = arg;
+	int loops = targ->loops;
+	__u64 start, ticks = 0, stream;
 	char srcbuffer[MAX_BUFFER_SIZE] __attribute__((aligned (128)));
 	char dstbuffer[MAX_BUFFER_SIZE] __attribute__((aligned (128)));
 
 	/* get the task_struct pid */
 	thindex = syscall(SYS_gettid);
-
-	fd_random = open("/dev/urandom", O_RDONLY);
-	if (fd_random < 0) {
-		perror("Unable to open random source /dev/urandom");
-		rc = 1;
-		goto out;
-	}
+	wait_stats_init(&wstats);
 
 	printf("THREAD[%d]: Starting with loop count %d\n", thindex, loops);
+	if (thread_place(targ->index, 1))
+		rc = 1;
 	if (exit_after_spawn) {
 		printf("THREAD[%d]: Sleeping for some time\n", thindex);
 		sleep(5);
 	}
 
+	if (!rc && per_thread_ctx && thread_ctx_open()) {
+		printf("THREAD[%d]: Unable to set up slave context\n",
+		       thindex);
+		rc = 1;
+	}
+	if (rc)
+		loops = 0;
+
 	/* All set now perform memcpy using a poll loop */
+	pthread_barrier_wait(&thread_barrier);
 	for (index = 0; index < loops; ++index) {
 		int ret;
 
+		/* untimed source preparation */
+		stream = ((__u64)targ->index << 32) | index;
 		bzero(dstbuffer, szbuffer);
-		ret = read(fd_random, srcbuffer, szbuffer);
-		if (ret < szbuffer) {
-			rc = errno;
-			printf("THREAD[%d]: Copy Loop index %d .. "
-			       "Unable to populate srcbuffer Error=%d\n", thindex,
-			       index, (int)rc);
-			continue;
-		}
+		pattern_fill(&pattern, srcbuffer, szbuffer, stream);
 
+		start = tb_now();
 		ret = afu_memcpy(dstbuffer, srcbuffer, szbuffer);
+		ticks += tb_now() - start;
 		if (ret) {
 			rc = ret;
 			perror("Unable to perform memcpy");
-			goto out;
+			break;
 		}
 
-		/* compare the strings */
-		ret = memcmp(srcbuffer, dstbuffer, szbuffer);
+		/* compare the buffers, a cache line at a time, untimed */
+		ret = verify_thread_copy(thindex, index, stream, srcbuffer,
+					 dstbuffer);
 		if (ret) {
-			size_t mindex;
 			rc = ret;
-			printf("THREAD[%d]: Copy Loop index %d .. "
-			       "ERROR[rc=%lu]\n", thindex, index, rc);
-			for (mindex = 0; mindex < szbuffer; ++mindex)
-				if (srcbuffer[mindex] != dstbuffer[mindex]) {
-					printf("THREAD[%d]: Mismatch at index=%lu %x!=%x\n",
-					       thindex, mindex, srcbuffer[mindex],
-						dstbuffer[mindex]);
-					break;
-				}
-			printf("THREAD[%d]: SrcBuffer = %p\n", thindex, srcbuffer);
-			dumpbuffer(srcbuffer, szbuffer);
-			printf("THREAD[%d]: DstBuffer = %p\n", thindex, dstbuffer);
-			dumpbuffer(dstbuffer, szbuffer);
 		} else {
 			printf("THREAD[%d]: Copy Loop index %d..OK\n",
 			       thindex, index);
+			copies++;
 		}
 	}
+	report_thread_rate(thindex, copies, ticks, rc);
 
-out:
-	if (fd_random >= 0)
-		close(fd_random);
+	thread_ctx_close();
+	return ((void *)rc);
+}
+
+
+/* Copy threads of the benchmark start together, once set up */
+static pthread_barrier_t bench_barrier;
+
+/* Copy loop of the scaling benchmark: only errors are reported */
+void *afu_slave_threadproc_bench(void *arg)
+{
+	int index;
+	uintptr_t rc = 0;
+	struct thread_arg *targ = arg;
+	int loops = targ->loops;
+	char srcbuffer[MAX_BUFFER_SIZE] __attribute__((aligned (128)));
+	char dstbuffer[MAX_BUFFER_SIZE] __attribute__((aligned (128)));
+
+	if (thread_place(targ->index, 0))
+		rc = 1;
+	wait_stats_init(&wstats);
+	for (index = 0; index < szbuffer; ++index)
+		srcbuffer[index] = index + syscall(SYS_gettid);
+
+	if (!rc && per_thread_ctx && thread_ctx_open()) {
+		printf("THREAD[%ld]: Unable to set up slave context\n",
+		       syscall(SYS_gettid));
+		rc = 1;
+	}
+	if (rc)
+		loops = 0;
+	pthread_barrier_wait(&bench_barrier);
+
+	for (index = 0; index < loops; ++index) {
+		bzero(dstbuffer, szbuffer);
+		rc = afu_memcpy(dstbuffer, srcbuffer, szbuffer);
+		if (rc) {
+			printf("THREAD[%ld]: Copy Loop index %d .. "
+			       "ERROR[status=%#lx]\n", syscall(SYS_gettid),
+			       index, rc);
+			break;
+		}
+		if (memcmp(srcbuffer, dstbuffer, szbuffer)) {
+			printf("THREAD[%ld]: Copy Loop index %d .. "
+			       "ERROR[memcmp]\n", syscall(SYS_gettid), index);
+			rc = 1;
+			break;
+		}
+	}
+	thread_ctx_close();
 	return ((void *)rc);
 }
 
+/*
+ * Runs num_loops copies on each of 1 to MAX_NUM_THREADS threads, sharing
+ * the work queue with mutex and with lock-free submission, then each with
+ * its own slave context.  Context setup is not timed.
+ */
+static void emit_bench_results(const char *params, int copies, __u64 ticks)
+{
+	struct results_metrics m = {
+		.scope = "bench",
+		.params = params,
+		.ops = copies / batch_size,
+		.bytes = (__u64)copies * szbuffer,
+		.time_us = tb_to_us(ticks),
+	};
+
+	results_emit(&m);
+}
+
+static int run_scaling_bench(void)
+{
+	static const char * const mode_names[] = {
+		"mutex", "lock-free", "per-thread"
+	};
+	__u64 start, end;
+	void *ret;
+	int mode, i, index, threads, copies, rc = 0;
+	char params[48];
+	double t;
+
+	printf("BENCH: %-10s %7s %9s %11s %12s\n", "submit", "threads",
+	       "copies", "time(uS)", "copies/s");
+	for (mode = 0; mode < ARRAY_SIZE(mode_names); mode++) {
+		lockfree_submit = mode != 0;
+		per_thread_ctx = mode == 2;
+		for (i = 0; i < ARRAY_SIZE(bench_threads); i++) {
+			threads = bench_threads[i];
+			pthread_barrier_init(&bench_barrier, NULL, threads + 1);
+			for (index = 0; index < threads; ++index) {
+				thread_args[index].index = index;
+				thread_args[index].loops = num_loops;
+				rc = pthread_create(arr_threads + index, NULL,
+						    afu_slave_threadproc_bench,
+						    &thread_args[index]);
+				if (rc) {
+					warnx("[ERROR] Unable to create thread"
+					      " index %d: %s\n", index,
+					      strerror(rc));
+					exit(1);
+				}
+			}
+			pthread_barrier_wait(&bench_barrier);
+			start = tb_now();
+			for (index = 0; index < threads; ++index) {
+				pthread_join(arr_threads[index], &ret);
+				if (ret != NULL)
+					rc = 1;
+			}
+			end = tb_now();
+			t = tb_to_us(end - start);
+			pthread_barrier_destroy(&bench_barrier);
+			if (rc)
+				return rc;
+
+			copies = threads * num_loops * batch_size;
+			printf("BENCH: %-10s %7d %9d %11.0f %12.0f\n",
+			       mode_names[mode], threads, copies, t,
+			       t ? copies * 1000000.0 / t : 0);
+			snprintf(params, sizeof(params),
+				 "submit=%s;threads=%d", mode_names[mode],
+				 threads);
+			emit_bench_results(params, copies, end - start);
+		}
+	}
+	return 0;
+}
 
 /* Code entry point */
 int main(int argc, char *argv[])
 {
-	struct cxl_afu_h *afu = NULL;
 	void *ret = NULL;
-	int rc = 1, index, c;
+	int rc = 1, index, c, cpu, node;
 	pthread_t th_setup;
 	int delay = 0;
+	int scaling_bench = 0;
 	void *(*threadproc)(void *) = afu_slave_threadproc_static;
+	char *results = NULL, *pattern_spec = "random";
 
-	while ((c = getopt(argc, argv, "n:tc:hl:zjdms:")) > 0) {
+	while ((c = getopt(argc, argv, "n:tc:hl:zjdmM:s:b:LpSW:e:F:H:N:D:")) > 0) {
 		switch (c) {
 		case 's':
 			szbuffer = atol(optarg);
@@ -320,6 +748,19 @@ int main(int argc, char *argv[])
 			use_malloc = 1;
 			threadproc = afu_slave_threadproc_dynamic;
 			break;
+		case 'M': /* where dynamic memory comes from */
+			for (index = 0; index < ARRAY_SIZE(buf_mode_names);
+			     index++)
+				if (!strcmp(optarg, buf_mode_names[index]))
+					break;
+			if (index == ARRAY_SIZE(buf_mode_names)) {
+				warnx("[ERROR] Invalid memory mode %s", optarg);
+				goto out;
+			}
+			buf_mode = index;
+			use_malloc = 1;
+			threadproc = afu_slave_threadproc_dynamic;
+			break;
 		case 'n': /* number of slave thread */
 			num_threads = atoi(optarg);
 			if (num_threads <= 0 ||
@@ -333,6 +774,56 @@ int main(int argc, char *argv[])
 		case 'l': /* number of loops */
 			num_loops = atoi(optarg);
 			break;
+		case 'L': /* mutex protected submission */
+			lockfree_submit = 0;
+			break;
+		case 'p': /* one slave context per copy thread */
+			per_thread_ctx = 1;
+			break;
+		case 'S': /* submission scaling benchmark */
+			scaling_bench = 1;
+			break;
+		case 'W': /* completion wait policy */
+			for (index = 0; index < ARRAY_SIZE(wait_policy_names);
+			     index++)
+				if (!strcmp(optarg, wait_policy_names[index]))
+					break;
+			if (index == ARRAY_SIZE(wait_policy_names)) {
+				warnx("[ERROR] Invalid wait policy %s", optarg);
+				goto out;
+			}
+			wait_policy = index;
+			break;
+		case 'e': /* completion timeout */
+			completion_timeout = atoi(optarg);
+			break;
+		case 'F': /* structured results file */
+			results = optarg;
+			break;
+		case 'N': /* placement policy */
+			if (placement_parse(optarg)) {
+				warnx("[ERROR] Invalid placement %s", optarg);
+				goto out;
+			}
+			break;
+		case 'D': /* source data pattern */
+			pattern_spec = optarg;
+			break;
+		case 'H': /* backing pages */
+			if (memcpy_set_pages(optarg)) {
+				warnx("[ERROR] Invalid pages %s", optarg);
+				goto out;
+			}
+			break;
+		case 'b': /* work elements per submission */
+			batch_size = atoi(optarg);
+			if (batch_size <= 0 || batch_size > MEMCPY_BATCH_MAX) {
+				warnx("[ERROR] Invalid batch size %d."
+				      " Max supported=%lu", batch_size,
+				      MEMCPY_BATCH_MAX);
+				goto out;
+			}
+			break;
 		case 't': /* setup slave psa on a separate thread */
 			setup_on_thread = 0;
 			break;
@@ -351,9 +842,10 @@ int main(int argc, char *argv[])
 				warnx("Missing Argument for card index");
 				return 1;
 			}
+			card_index = atoi(optarg);
 			snprintf(arg_master_context,
 				 sizeof(arg_master_context),
-				 "/dev/cxl/afu%d.0m", atoi(optarg));
+				 "/dev/cxl/afu%d.0m", card_index);
 			arg_master_context[sizeof(arg_master_context) - 1] = 0;
 			break;
 		case '?':
@@ -375,38 +867,133 @@ int main(int argc, char *argv[])
 				" (dead-state)\n");
 			fprintf(stderr, "-m: Use malloced memory instead of static"
 				" memory for src/dst buffer\n");
+			fprintf(stderr, "-M: Get -m buffers from a pre-faulted"
+				" per-thread pool (pool, default),\n"
+				"    the same locked in memory (mlock), or"
+				" allocate and free them per copy\n"
+				"    (churn).\n");
 			fprintf(stderr, "-s: Size of the copy buffer used.\n");
+			fprintf(stderr, "-b: Number of copies queued with a"
+				" single barrier per memcpy (default 1).\n");
+			fprintf(stderr, "-L: Serialize submission with a mutex"
+				" instead of claiming queue slots atomically.\n");
+			fprintf(stderr, "-p: Give each copy thread its own slave"
+				" context and work queue.\n");
+			fprintf(stderr, "-S: Run the submission scaling benchmark"
+				" (1 to %d threads, mutex, lock-free and\n"
+				"    per-thread contexts).\n", MAX_NUM_THREADS);
+			fprintf(stderr, "-W: Completion wait policy: sleep"
+				" (default), spin, yield, backoff, irq or\n"
+				"    adaptive.\n");
+			fprintf(stderr, "-e: Seconds to wait for the AFU to"
+				" signal completion (default %d).\n",
+				COMPLETION_TIMEOUT);
+			fprintf(stderr, "-F: Also write the results to this"
+				" file, as CSV for a .csv suffix,\n"
+				"    else JSON lines (- for stdout).\n");
+			fprintf(stderr, "-H: Back the work queues and -m pools"
+				" with base (default), thp, huge or\n"
+				"    hugetlbfs pages of a size such as 2M, 16M"
+				" or 1G.\n");
+			fprintf(stderr, "-N: Place the copy threads and their"
+				" memory: local (to the card's NUMA\n"
+				"    node), interleave (over the nodes) or a"
+				" CPU list such as 0-3,8.\n");
+			fprintf(stderr, "-D: Fill the source buffers with"
+				" random[:seed] (default), address[:seed]\n"
+				"    or const:<word> data.\n");
 			return ((c == 'h') ? 0 : 1);
 		}
 	}
 
+	/* The interrupt is only delivered to the thread's own context */
+	if (wait_policy == WAIT_IRQ) {
+		if (scaling_bench) {
+			warnx("[ERROR] irq wait needs per-thread contexts,"
+			      " not supported with -S");
+			goto out;
+		}
+		per_thread_ctx = 1;
+	}
+	/* leave room for the IRQ work element */
+	if ((wait_policy == WAIT_IRQ || wait_policy == WAIT_ADAPTIVE) &&
+	    batch_size == MEMCPY_BATCH_MAX) {
+		warnx("[ERROR] Batch size must be below %lu with %s wait",
+		      MEMCPY_BATCH_MAX, wait_policy_names[wait_policy]);
+		goto out;
+	}
+
+	wait_stats_init(&total_wstats);
+	if (pattern_parse(&pattern, pattern_spec)) {
+		warnx("[ERROR] Invalid pattern %s", pattern_spec);
+		goto out;
+	}
+	if (placement_init(card_index))
+		goto out;
+	if (results) {
+		if (results_open(results, "cxl-threads"))
+			goto out;
+		results_config("threads", "%d", num_threads);
+		results_config("loops", "%d", num_loops);
+		results_config("size", "%lu", szbuffer);
+		results_config("memory", "%s", use_malloc ?
+			       buf_mode_names[buf_mode] : "static");
+		results_config("pages", "%s", memcpy_pages_name());
+		results_config("placement", "%s", placement_name());
+		results_config("pattern", "%s", pattern_type(&pattern));
+		results_config("batch", "%d", batch_size);
+		results_config("submit", "%s", per_thread_ctx ? "per-thread" :
+			       lockfree_submit ? "lock-free" : "mutex");
+		results_config("wait", "%s", wait_policy_names[wait_policy]);
+		results_config("completion_timeout", "%d", completion_timeout);
+		results_config("scaling_bench", "%d", scaling_bench);
+		results_run(card_index);
+	}
+
 	printf("INFO: Will use buffer size=%lu\n", szbuffer);
-	printf("INFO: Will use %s memory\n", use_malloc ? "malloced" : "static");
+	printf("INFO: Will use %s memory\n", use_malloc ?
+	       buf_mode_names[buf_mode] : "static");
+	printf("INFO: Will use %s pages\n", memcpy_pages_name());
+	printf("INFO: Will use placement %s\n", placement_name());
+	printf("INFO: Will use pattern %s\n", pattern_name(&pattern));
+	printf("INFO: Will queue %d work element(s) per memcpy\n", batch_size);
+	printf("INFO: Will use %s submission\n",
+	       per_thread_ctx ? "per-thread context" :
+	       lockfree_submit ? "lock-free" : "mutex");
+	printf("INFO: Will use %s completion wait\n",
+	       wait_policy_names[wait_policy]);
 
 	/* Lookup if we have an afu configured */
 	printf("INFO: Opening Master context %s..", arg_master_context);
 
-	afu = cxl_afu_open_dev(arg_master_context);
-	if (afu == NULL) {
+	afu_master = cxl_afu_open_dev(arg_master_context);
+	if (afu_master == NULL) {
 		printf("ERROR\n");
 		goto out;
 	} else {
 		printf("done\n");
 	}
 
+	/* The shared context, and the threads until placed, go with thread 0 */
+	if (placement_apply(0, &cpu, &node))
+		goto out;
+
 	/* ********************* Setup Phase ******************* */
 	/* Setup the slave afu context */
-	if (setup_on_thread) {
+	if (per_thread_ctx && !scaling_bench) {
+		printf("INFO: Each thread sets up its own slave psa area\n");
+		rc = 0;
+	} else if (setup_on_thread) {
 		printf("INFO: Set up slave psa area on a separate thread..");
 		rc = pthread_create(&th_setup, NULL, &setup_afu_slave_psa_proc,
-				    (void *)afu);
+				    (void *)afu_master);
 		if (!rc) {
 			pthread_join(th_setup, &ret);
 			rc = (uintptr_t)(ret);
 		}
 	} else {
 		printf("INFO: Setting up slave psa area on a main thread..");
-		rc = setup_afu_slave_psa(afu);
+		rc = setup_afu_slave_psa(afu_master, &shared_ctx);
 	}
 
 	/* check for error */
@@ -414,15 +1001,24 @@ int main(int argc, char *argv[])
 		perror("Unable to setup slave psa");
 		goto out;
 	}
-	printf("done\n");
+	if (!per_thread_ctx || scaling_bench)
+		printf("done\n");
 
 	/* *************** Computation Phase ***************** */
+	if (scaling_bench) {
+		printf("INFO: Running scaling benchmark, %d loops per thread\n",
+		       num_loops);
+		rc = run_scaling_bench();
+		goto out;
+	}
+
 	printf("INFO: Creating %d slave threads\n", num_threads);
 	if (num_loops > 0)
 		printf("INFO: Number of loops per thread = %d\n", num_loops);
 	else
 		printf("INFO: Duration between exit of each = %d\n", num_loops);
 
+	pthread_barrier_init(&thread_barrier, NULL, num_threads);
 	for (index = 0; index < num_threads; ++index) {
 		/*
 		 * if num_loops is nagtive we need to dynamically
@@ -431,9 +1027,10 @@ int main(int argc, char *argv[])
 		delay = (num_loops > 0) ? num_loops :
 			-((index + 1) * num_loops);
 
+		thread_args[index].index = index;
+		thread_args[index].loops = delay;
 		rc = pthread_create(arr_threads + index, NULL,
-				    threadproc,
-				    (void *)((uintptr_t) delay));
+				    threadproc, &thread_args[index]);
 		if (rc) {
 			warnx("[ERROR] Unable to create thread index %d: %s\n",
 			      index, strerror(rc));
@@ -462,57 +1059,220 @@ int main(int argc, char *argv[])
 				rc = ((uintptr_t)ret);
 			}
 		}
+		pthread_barrier_destroy(&thread_barrier);
+		print_rate("INFO: Aggregate: ", total_copies, total_ticks);
+		emit_results("aggregate", 0, total_copies, total_ticks,
+			     &total_wstats, rc);
+		print_wait_stats("INFO: Aggregate: ", &total_wstats);
 	}
 
 out:
 	/* ********** Deinitialization Phase ************ */
-	if (afu_h)
-		cxl_afu_free(afu_h);
-	if (afu)
-		cxl_afu_free(afu);
+	if (shared_ctx.afu_h)
+		cxl_afu_free(shared_ctx.afu_h);
+	if (afu_master)
+		cxl_afu_free(afu_master);
 
+	results_close(rc);
 	return rc;
 }
 
 
+/*
+ * Polls the status of a work element as policy says, and returns -1 once
+ * the deadline passes.  If done is not NULL, it gets the completion time:
+ * between the last poll that found the element pending and the first one
+ * that did not, which leaves out the polling or sleeping granularity of
+ * the policy itself.
+ */
+static int wait_poll(struct memcpy_work_element *we, enum wait_policy policy,
+		     __u64 deadline, __u64 *done)
+{
+	struct timespec ts = poll_time, rem;
+	__u64 now, pending = done ? *done : 0;
+	int loops = 0;
+
+	for (;;) {
+		now = tb_now();
+		if (__atomic_load_n(&we->status, __ATOMIC_ACQUIRE))
+			break;
+		if ((__s64)(now - deadline) > 0) {
+			warnx("Timeout polling for completion");
+			return -1;
+		}
+		pending = now;
+		switch (policy) {
+		case WAIT_SPIN:
+			cpu_relax();
+			break;
+		case WAIT_YIELD:
+			/* spin, then yield */
+			if (++loops >= WAIT_SPIN_LOOPS)
+				sched_yield();
+			else
+				cpu_relax();
+			break;
+		case WAIT_BACKOFF:
+			/* sleep, doubling the sleep time each time */
+			nanosleep(&ts, &rem);
+			if (ts.tv_nsec < WAIT_BACKOFF_MAX_NS)
+				ts.tv_nsec *= 2;
+			break;
+		default:
+			nanosleep(&poll_time, &rem);
+			break;
+		}
+	}
+	if (done)
+		*done = pending + (now - pending) / 2;
+	return 0;
+}
+
+/*
+ * Sleeps on the context file descriptor until the AFU raises the interrupt
+ * queued after the copies, then restarts the AFU, which stops after each
+ * interrupt.  done gets the time of the interrupt.
+ */
+static int wait_irq(struct afu_slave_ctx *ctx, __u64 deadline, __u64 *done)
+{
+	struct cxl_event event;
+	struct timeval timeout = { .tv_sec = completion_timeout };
+	int fd = cxl_afu_fd(ctx->afu_h);
+	__u64 status;
+	fd_set set;
+
+	FD_ZERO(&set);
+	FD_SET(fd, &set);
+	if (select(fd + 1, &set, NULL, NULL, &timeout) <= 0) {
+		warnx("Timeout waiting for interrupt");
+		return -1;
+	}
+	*done = tb_now();
+	if (cxl_read_expected_event(ctx->afu_h, &event,
+				    CXL_EVENT_AFU_INTERRUPT, WAIT_IRQ_NUM)) {
+		warnx("Failed reading expected event");
+		return -1;
+	}
+	do {
+		if (cxl_mmio_read64(ctx->afu_h, MEMCPY_PS_REG_STATUS,
+				    &status) == -1)
+			return -1;
+		if (tb_expired(deadline)) {
+			warnx("Timeout waiting for the AFU to stop");
+			return -1;
+		}
+	} while (!(status & MEMCPY_PS_REG_STATUS_Stopped));
+	return cxl_mmio_write64(ctx->afu_h, MEMCPY_PS_REG_PCTRL,
+				MEMCPY_PS_REG_PCTRL_Restart);
+}
+
+/*
+ * Adaptive waiting: spin when copies come back within a few microseconds,
+ * spin then yield up to ADAPT_YIELD_NS, and beyond that sleep, on the
+ * interrupt when the thread owns its context.
+ */
+static enum wait_policy adaptive_wait_policy(void)
+{
+	if (wstats.avg < (__s64)tb_from_ns(ADAPT_SPIN_NS))
+		return WAIT_SPIN;
+	if (wstats.avg < (__s64)tb_from_ns(ADAPT_YIELD_NS))
+		return WAIT_YIELD;
+	if (wstats.avg >= (__s64)tb_from_ns(ADAPT_IRQ_NS) &&
+	    thread_ctx != &shared_ctx)
+		return WAIT_IRQ;
+	return WAIT_BACKOFF;
+}
+
 /* Ask afu to perform a strcpy operation and wait for the operation to finish */
 int afu_memcpy(char *dst, char *src, size_t size)
 {
+	struct afu_slave_ctx *ctx = thread_ctx;
+	struct memcpy_weq *weq = &ctx->weq;
 	struct memcpy_work_element memcpy_we, *queued_we;
-	int ret = 0;
-	struct timespec rem;
+	struct memcpy_work_element batch_we[MEMCPY_BATCH_MAX];
+	enum wait_policy policy = wait_policy;
+	unsigned long cpu_ns;
+	__u64 start, lat, deadline, done;
+	int ret = 0, i, count = batch_size;
+	__u64 ticket;
+
+	if (policy == WAIT_ADAPTIVE)
+		policy = adaptive_wait_policy();
 
 	/* Setup a work element in the queue */
+	memset(&memcpy_we, 0, sizeof(memcpy_we));
 	memcpy_we.cmd = MEMCPY_WE_CMD(0, MEMCPY_WE_CMD_COPY);
 	memcpy_we.status = 0;
 	memcpy_we.length = htobe16((uint16_t)size);
 	memcpy_we.src = htobe64((uintptr_t)src);
 	memcpy_we.dst = htobe64((uintptr_t)dst);
+	for (i = 0; i < batch_size; i++)
+		batch_we[i] = memcpy_we;
+	if (policy == WAIT_IRQ) {
+		memset(&batch_we[count], 0, sizeof(batch_we[count]));
+		batch_we[count].cmd = MEMCPY_WE_CMD(0, MEMCPY_WE_CMD_IRQ);
+		batch_we[count].length = htobe16(WAIT_IRQ_NUM);
+		count++;
+	}
 
-retry:
-	ret = pthread_mutex_lock(&mtx_memcpy);
-	if (ret) {
-		sleep(1);
-		goto retry;
+	start = tb_now();
+
+	/* the copies complete in order: wait for the last one */
+	if (lockfree_submit) {
+		ticket = memcpy_claim_we(weq, count);
+		memcpy_post_we(weq, ticket, batch_we, count);
+	} else {
+		pthread_mutex_lock(&mtx_memcpy);
+		ticket = weq->tickets;
+		weq->tickets += count;
+		while (!memcpy_post_ready(weq, ticket, count))
+			pthread_cond_wait(&cond_memcpy, &mtx_memcpy);
+		memcpy_post_we(weq, ticket, batch_we, count);
+		pthread_mutex_unlock(&mtx_memcpy);
+	}
+	queued_we = weq->queue +
+		(ticket + batch_size - 1) % (weq->last - weq->queue + 1);
+
+	cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	deadline = tb_deadline(completion_timeout * 1000000ULL);
+	done = start;
+	if (policy == WAIT_IRQ) {
+		ret = wait_irq(ctx, deadline, &done);
+		/* the copies are complete by now */
+		if (ret == 0)
+			ret = wait_poll(queued_we, WAIT_SPIN, deadline, NULL);
+	} else {
+		ret = wait_poll(queued_we, policy, deadline, &done);
+	}
+	cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_ns;
+	lat = tb_now() - start;
+
+	if (ret == 0)
+		ret = queued_we->status;
+	/* Even after a timeout, or the queue wedges once its slots leak */
+	if (lockfree_submit) {
+		memcpy_release_we(weq, ticket, count);
+	} else {
+		pthread_mutex_lock(&mtx_memcpy);
+		memcpy_release_we(weq, ticket, count);
+		pthread_cond_broadcast(&cond_memcpy);
+		pthread_mutex_unlock(&mtx_memcpy);
 	}
-	queued_we = memcpy_add_we(&weq, memcpy_we);
-	queued_we->cmd |= MEMCPY_WE_CMD_VALID;
-	pthread_mutex_unlock(&mtx_memcpy);
 
-	/* We poll the status of the work element */
-	while (queued_we->status == 0)
-		nanosleep(&poll_time, &rem);
+	if (ret > 0 && ret != MEMCPY_WE_STAT_COMPLETE)
+		results_count_status(wstats.status_errors, ret);
+	wstats.cpu_ns += cpu_ns;
+	if (ret > 0)
+		wstats.avg += ((__s64)(done - start) - wstats.avg) / 8;
+	lat_hist_record(&wstats.hist, lat);
 
-	ret = queued_we->status;
 	return ret == MEMCPY_WE_STAT_COMPLETE ? 0 : ret;
 }
 
-#define CACHELINESIZE	128
-#define QUEUE_SIZE	2
-
 void *setup_afu_slave_psa_proc(void *afu)
 {
-	uintptr_t ret = setup_afu_slave_psa((struct cxl_afu_h *)afu);
+	uintptr_t ret = setup_afu_slave_psa((struct cxl_afu_h *)afu,
+					    &shared_ctx);
 
 	return (void *)(ret);
 }
@@ -521,48 +1281,51 @@ void *setup_afu_slave_psa_proc(void *afu)
  * Sets up the afu per process context. This allocates the work
  * element queue and validates if the process element is valid.
  */
-int setup_afu_slave_psa(struct cxl_afu_h *afu)
+int setup_afu_slave_psa(struct cxl_afu_h *afu, struct afu_slave_ctx *ctx)
 {
 
 	int ret;
 	__u64 wed, process_handle_memcpy, process_handle_ioctl;
 
 	/* Get handle to Per Process PSA context */
-	afu_h = cxl_afu_open_h(afu, CXL_VIEW_SLAVE);
-	if (afu_h == NULL) {
+	ctx->afu_h = cxl_afu_open_h(afu, CXL_VIEW_SLAVE);
+	if (ctx->afu_h == NULL) {
 		perror("Unable to open AFU Slave cxl device");
 		return 1;
 	}
 
 	/* initialize the work queue */
-	memcpy_init_weq(&weq, QUEUE_SIZE * CACHELINESIZE);
+	if (memcpy_init_weq(&ctx->weq, QUEUE_SIZE * CACHELINESIZE)) {
+		perror("Unable to allocate the work element queue");
+		return 1;
+	}
 
 	/* Point the work element descriptor (wed) at the weq */
-	wed = MEMCPY_WED(weq.queue, QUEUE_SIZE);
+	wed = MEMCPY_WED(ctx->weq.queue, QUEUE_SIZE);
 
 	/* attach the wed to the context */
-	ret = cxl_afu_attach(afu_h, wed);
+	ret = cxl_afu_attach(ctx->afu_h, wed);
 	if (ret) {
 		perror("Unable to attach the slave cxl context");
 		return 1;
 	}
 
 	/* Map the per process psa to an application vma */
-	ret = cxl_mmio_map(afu_h, CXL_MMIO_BIG_ENDIAN);
-	if (cxl_mmio_map(afu_h, CXL_MMIO_BIG_ENDIAN) == -1) {
+	ret = cxl_mmio_map(ctx->afu_h, CXL_MMIO_BIG_ENDIAN);
+	if (cxl_mmio_map(ctx->afu_h, CXL_MMIO_BIG_ENDIAN) == -1) {
 		perror("Unable to map problem state registers");
 		return 1;
 	}
 
 	/* Fetch the process element from kernel */
-	process_handle_ioctl = cxl_afu_get_process_element(afu_h);
+	process_handle_ioctl = cxl_afu_get_process_element(ctx->afu_h);
 	if (process_handle_ioctl < 0) {
 		perror("process_handle_ioctl");
 		return 1;
 	}
 
 	/* read the process element handle from the PPSA */
-	if (cxl_mmio_read64(afu_h, MEMCPY_PS_REG_PH,
+	if (cxl_mmio_read64(ctx->afu_h, MEMCPY_PS_REG_PH,
 			    &process_handle_memcpy) == -1) {
 		perror("Unable to read mmaped space");
 		return 1;
@@ -579,7 +1342,7 @@ int setup_afu_slave_psa(struct cxl_afu_h *afu)
 	assert(process_handle_memcpy == process_handle_ioctl);
 
 	/* restart the slice */
-	cxl_mmio_write64(afu_h, MEMCPY_PS_REG_PCTRL,
+	cxl_mmio_write64(ctx->afu_h, MEMCPY_PS_REG_PCTRL,
 			 0x8000000000000000ULL);
 
 	return 0;
@@ -0,0 +1,101 @@
+#!/bin/bash
+#
+# Copyright 2019 International Business Machines
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# cxl_hugepage_tests.sh
+#
+# Copies a large buffer with memcpy_afu_ctx -L, with the queue and buffers
+# backed by each page size in turn, and reports the AFU translation faults
+# (cxl_pte_miss) and the throughput of each.
+# These tests assume that user is root and memcpy afu is programmed.
+# These tests also require the tool perf. Reserve hugetlbfs pages first,
+# e.g. echo 256 >/proc/sys/vm/nr_hugepages, or they fall back to
+# transparent huge pages.
+
+function usage
+{
+	echo 'cxl_hugepage_tests.sh [-c <card_num>] [-s <size>] [<pages>...]' >&2
+	echo '	<pages>: base, thp, huge or a hugetlbfs page size' >&2
+	echo '	(default: base thp and each hugetlbfs page size)' >&2
+	exit 2
+}
+
+# Parse arguments
+#
+card=0 # default
+size=64M
+while (( $# > 0 ))
+do
+	case $1 in
+	(-c)	card=$2; shift 2;;
+	(-s)	size=$2; shift 2;;
+	(-*)	usage;;
+	(*)	break;;
+	esac
+done
+pages=("$@")
+if (( ${#pages[@]} == 0 ))
+then
+	pages=(base thp)
+	for dir in /sys/kernel/mm/hugepages/hugepages-*kB
+	do
+		[[ -d $dir ]] || continue
+		kb=${dir##*hugepages-}
+		kb=${kb%kB}
+		if (( kb >= 1048576 ))
+		then
+			pages+=($((kb / 1048576))G)
+		else
+			pages+=($((kb / 1024))M)
+		fi
+	done
+fi
+
+if [[ ! -d /sys/class/cxl/card$card ]]
+then
+	echo cxl_hugepage_tests.sh: card$card: no such capi card
+	exit 2
+fi
+
+export PATH=.:$PATH # give priority to local perf version
+
+if ! perf stat -a -e cxl:cxl_pte_miss true 2>/dev/null
+then
+	echo 'perf: cannot count cxl:cxl_pte_miss' >&2
+	echo Please run 'KERNELDIR=<linux build tree> make perf' >&2
+	exit 3
+fi
+
+# Run the tests
+#
+printf '%-12s %12s %10s\n' pages pte_miss GB/s
+rc=0
+for p in "${pages[@]}"
+do
+	out=$(perf stat -a -x, -e cxl:cxl_pte_miss -o /dev/fd/3 \
+		memcpy_afu_ctx -c $card -H $p -L $size -l 10 3>&1 2>/dev/null)
+	if (( $? != 0 ))
+	then
+		echo "memcpy_afu_ctx -H $p fails" >&2
+		rc=1
+		continue
+	fi
+	used=$(sed -n 's/^# Pages: //p' <<<"$out")
+	miss=$(grep cxl:cxl_pte_miss <<<"$out" | cut -d, -f1)
+	rate=$(sed -n 's/.*(\([0-9.]*\) GB\/s).*/\1/p' <<<"$out")
+	printf '%-12s %12s %10s\n' "${used:-$p}" "$miss" "$rate"
+done
+exit $rc
@@ -0,0 +1,104 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "latency.h"
+
+void lat_hist_init(struct lat_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = ~0ULL;
+}
+
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src)
+{
+	int i;
+
+	for (i = 0; i < LAT_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* Lowest and highest values recorded in a bucket */
+static __u64 lat_hist_low(int index)
+{
+	int group = index / LAT_HIST_SUB_COUNT;
+	__u64 sub = index % LAT_HIST_SUB_COUNT;
+
+	if (group == 0)
+		return sub;
+	return (LAT_HIST_SUB_COUNT + sub) << (group - 1);
+}
+
+static __u64 lat_hist_high(int index)
+{
+	int group = index / LAT_HIST_SUB_COUNT;
+
+	if (group <= 1)
+		return lat_hist_low(index);
+	return lat_hist_low(index) + (1ULL << (group - 1)) - 1;
+}
+
+/*
+ * Value below which percent of the recorded values fall, reported as the
+ * highest value of its bucket and clamped to the recorded min and max.
+ */
+__u64 lat_hist_percentile(const struct lat_hist *h, double percent)
+{
+	__u64 rank, seen = 0, value;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	rank = (__u64)(percent / 100 * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < LAT_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	value = lat_hist_high(i);
+	if (value < h->min)
+		value = h->min;
+	if (value > h->max)
+		value = h->max;
+	return value;
+}
+
+void lat_hist_print(const struct lat_hist *h, const char *prefix,
+		    double ns_per_unit)
+{
+	double us = ns_per_unit / 1000;
+
+	if (h->count == 0)
+		return;
+	printf("%slatency uS: min %0.2f p50 %0.2f p90 %0.2f p99 %0.2f"
+	       " p99.9 %0.2f max %0.2f (%llu ops)\n", prefix,
+	       h->min * us,
+	       lat_hist_percentile(h, 50) * us,
+	       lat_hist_percentile(h, 90) * us,
+	       lat_hist_percentile(h, 99) * us,
+	       lat_hist_percentile(h, 99.9) * us,
+	       h->max * us, (unsigned long long)h->count);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <linux/types.h>
+
+/*
+ * Log-linear latency histogram, in the style of HdrHistogram.
+ *
+ * Values below 2^LAT_HIST_SUB_BITS have a bucket each.  Above, each power
+ * of two range is split into 2^LAT_HIST_SUB_BITS buckets, which bounds
+ * the relative error of a recorded value to 2^-LAT_HIST_SUB_BITS (3%).
+ * Values are in any unit, typically timebase ticks; the scale to
+ * nanoseconds is only applied when printing.
+ *
+ * A histogram is a plain fixed size structure, so that forked processes
+ * can fill histograms in a shared mapping for their parent to merge.
+ */
+#define LAT_HIST_SUB_BITS	5
+#define LAT_HIST_SUB_COUNT	(1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_BUCKETS	((65 - LAT_HIST_SUB_BITS) * LAT_HIST_SUB_COUNT)
+
+struct lat_hist {
+	__u64 count;
+	__u64 min;
+	__u64 max;
+	__u64 sum;
+	__u64 buckets[LAT_HIST_BUCKETS];
+};
+
+static inline int lat_hist_index(__u64 value)
+{
+	int msb;
+
+	if (value < LAT_HIST_SUB_COUNT)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	return (msb - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB_COUNT +
+		(value >> (msb - LAT_HIST_SUB_BITS)) - LAT_HIST_SUB_COUNT;
+}
+
+static inline void lat_hist_record(struct lat_hist *h, __u64 value)
+{
+	h->buckets[lat_hist_index(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+}
+
+void lat_hist_init(struct lat_hist *h);
+void lat_hist_merge(struct lat_hist *dst, const struct lat_hist *src);
+__u64 lat_hist_percentile(const struct lat_hist *h, double percent);
+void lat_hist_print(const struct lat_hist *h, const char *prefix,
+		    double ns_per_unit);
+
+#endif /* _LATENCY_H_ */
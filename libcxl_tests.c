@@ -14,9 +14,12 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -26,6 +29,7 @@
 
 #include <libcxl.h>
 #include "memcpy_afu.h"
+#include "results.h"
 
 #define CACHELINESIZE   128
 
@@ -525,6 +529,12 @@ void wr_afu_attr(struct cxl_afu_h *afu, int attached)
 	return;
 }
 
+/* The tests exit() on the first failure, record its status then */
+static void results_exit(int status, void *arg)
+{
+	results_close(status);
+}
+
 int main(int argc, char *argv[])
 {
 	struct cxl_adapter_h *adapter_h;
@@ -532,10 +542,28 @@ int main(int argc, char *argv[])
 	struct cxl_afu_h *afu_h;
 	struct cxl_afu_h *afu_m;
 	struct cxl_afu_h *afu_s;
-	int afu_fd;
+	int afu_fd, c;
 	char *name;
 	long mode;
 
+	while ((c = getopt(argc, argv, "F:h")) != -1) {
+		switch (c) {
+		case 'F':
+			if (results_open(optarg, "libcxl_tests"))
+				exit(1);
+			results_run(0);
+			on_exit(results_exit, NULL);
+			break;
+		default:
+			fprintf(stderr, "Usage: libcxl_tests [-F <file>]\n");
+			fprintf(stderr, "\t-F <file>\tAlso write the result to"
+				" this file, as CSV\n"
+				"\t\t\tfor a .csv suffix, else JSON lines"
+				" (- for stdout).\n");
+			exit(c == 'h' ? 0 : 2);
+		}
+	}
+
 	/* Check if we are running in radix mode */
 	if (set_isRadix())
 		exit(1);
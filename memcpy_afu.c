@@ -39,8 +39,12 @@
 #include <endian.h>
 #include <time.h>
 #include <getopt.h>
+#include <sched.h>
+#include <ctype.h>
+#include <errno.h>
 
 #include "memcpy_afu.h"
+#include "timebase.h"
 
 /* master mmap size (hex)
    slave mmap size (hex)
@@ -55,35 +59,920 @@
 
 /* Generic library functions for the memcpy test AFU */
 
-void memcpy_init_weq(struct memcpy_weq *weq, size_t queue_size)
+/*
+ * Backing pages of the queue and buffers, see memcpy_set_pages().  The
+ * first access of the AFU to each page costs a translation fault, so
+ * larger pages mean fewer of them.
+ */
+static struct {
+	int type;		/* MEMCPY_PAGES_* */
+	size_t size;		/* 0 until set up */
+	int hugetlb_flags;	/* MAP_HUGE_* size encoding, 0 for default */
+	int warned;
+	char name[32];
+} pages;
+
+/* Value of a "<key>: <n> kB" line of /proc/meminfo, in bytes, 0 if none */
+static size_t meminfo_kb(const char *key)
+{
+	size_t len = strlen(key), val = 0;
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (f == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (!strncmp(line, key, len) && line[len] == ':') {
+			val = strtoull(line + len + 1, NULL, 10) * 1024;
+			break;
+		}
+	fclose(f);
+	return val;
+}
+
+static int thp_enabled(void)
+{
+	char mode[64] = "";
+	FILE *f;
+
+	f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (f == NULL)
+		return 0;
+	if (!fgets(mode, sizeof(mode), f))
+		mode[0] = '\0';
+	fclose(f);
+	return !strstr(mode, "[never]");
+}
+
+static size_t thp_size(void)
+{
+	unsigned long long size = 0;
+	FILE *f;
+
+	f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (f) {
+		if (fscanf(f, "%llu", &size) != 1)
+			size = 0;
+		fclose(f);
+	}
+	return size ? size : 2 * 1024 * 1024;
+}
+
+static void set_pages_name(void)
 {
-	weq->queue = aligned_alloc(getpagesize(), queue_size);
+	static const char * const names[] = {
+		[MEMCPY_PAGES_BASE] = "base",
+		[MEMCPY_PAGES_THP] = "thp",
+		[MEMCPY_PAGES_HUGETLB] = "hugetlb",
+	};
+
+	if (pages.size >= 1024 * 1024)
+		snprintf(pages.name, sizeof(pages.name), "%s %zuM",
+			 names[pages.type], pages.size >> 20);
+	else
+		snprintf(pages.name, sizeof(pages.name), "%s %zuK",
+			 names[pages.type], pages.size >> 10);
+}
+
+/* Maps size bytes, aligned on and rounded up to pages of the given type */
+static void *map_pages(int type, size_t page_size, size_t size)
+{
+	size_t len = (size + page_size - 1) & ~(page_size - 1);
+	char *p, *aligned;
+
+	switch (type) {
+	case MEMCPY_PAGES_HUGETLB:
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+			 pages.hugetlb_flags, -1, 0);
+		return p == MAP_FAILED ? NULL : p;
+	case MEMCPY_PAGES_THP:
+		/* Over-allocate to align, then trim */
+		p = mmap(NULL, len + page_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+		aligned = (char *)(((uintptr_t)p + page_size - 1) &
+				   ~(page_size - 1));
+		if (aligned > p)
+			munmap(p, aligned - p);
+		munmap(aligned + len, p + page_size - aligned);
+		if (madvise(aligned, len, MADV_HUGEPAGE)) {
+			munmap(aligned, len);
+			return NULL;
+		}
+		return aligned;
+	default:
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return p == MAP_FAILED ? NULL : p;
+	}
+}
+
+/*
+ * Parses a byte count with an optional K, M or G suffix, in either case,
+ * and points *end past it for the caller to check what follows.  Negative
+ * counts and counts that overflow return 0 with *end left at str.
+ */
+size_t memcpy_parse_size(const char *str, char **end)
+{
+	unsigned long long size;
+	const char *p = str;
+	int shift = 0;
+
+	while (isspace((unsigned char)*p))
+		p++;
+	if (*p == '-')
+		goto invalid;
+	errno = 0;
+	size = strtoull(str, end, 0);
+	if (errno == ERANGE)
+		goto invalid;
+	switch (**end) {
+	case 'G':
+	case 'g':
+		shift += 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		shift += 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		shift += 10;
+		(*end)++;
+		break;
+	}
+	if (size > (SIZE_MAX >> shift))
+		goto invalid;
+	return size << shift;
+
+invalid:
+	*end = (char *)str;
+	return 0;
+}
+
+/*
+ * Selects the pages behind memcpy_alloc(): "base" (default), "thp" for
+ * transparent huge pages, "huge" for hugetlbfs pages of the default size
+ * or a hugetlbfs page size such as "2M", "16M" or "1G".  When the kernel
+ * cannot provide them, falls back to transparent huge pages then base
+ * pages, with a warning.  Returns -1 for an invalid spec.
+ */
+int memcpy_set_pages(const char *spec)
+{
+	unsigned long long size;
+	void *p;
+	char *end;
+
+	pages.hugetlb_flags = 0;
+	if (!strcmp(spec, "base")) {
+		pages.type = MEMCPY_PAGES_BASE;
+		pages.size = getpagesize();
+	} else if (!strcmp(spec, "thp")) {
+		pages.type = MEMCPY_PAGES_THP;
+		pages.size = thp_size();
+	} else if (!strcmp(spec, "huge")) {
+		pages.type = MEMCPY_PAGES_HUGETLB;
+		pages.size = meminfo_kb("Hugepagesize");
+	} else {
+		size = memcpy_parse_size(spec, &end);
+		if (*end || size < 4096 || (size & (size - 1)))
+			return -1;
+		pages.type = MEMCPY_PAGES_HUGETLB;
+		pages.size = size;
+		pages.hugetlb_flags = (__builtin_ctzll(size) & MAP_HUGE_MASK)
+			<< MAP_HUGE_SHIFT;
+	}
+
+	/* Try a page now, rather than fall back on every allocation */
+	if (pages.type == MEMCPY_PAGES_HUGETLB) {
+		p = pages.size ? map_pages(pages.type, pages.size, 1) : NULL;
+		if (p) {
+			munmap(p, pages.size);
+		} else {
+			fprintf(stderr, "Warning: no hugetlbfs %s pages,"
+				" using transparent huge pages\n", spec);
+			pages.type = MEMCPY_PAGES_THP;
+			pages.size = thp_size();
+			pages.hugetlb_flags = 0;
+		}
+	}
+	if (pages.type == MEMCPY_PAGES_THP) {
+		p = thp_enabled() ? map_pages(pages.type, pages.size, 1) : NULL;
+		if (p) {
+			munmap(p, pages.size);
+		} else {
+			fprintf(stderr, "Warning: no transparent huge pages,"
+				" using base pages\n");
+			pages.type = MEMCPY_PAGES_BASE;
+			pages.size = getpagesize();
+		}
+	}
+	set_pages_name();
+	return 0;
+}
+
+/* "<type> <page size>", e.g. "hugetlb 16M" */
+const char *memcpy_pages_name(void)
+{
+	if (!pages.size)
+		memcpy_set_pages("base");
+	return pages.name;
+}
+
+/*
+ * Page aligned memory of the memcpy_set_pages() type, to be released with
+ * memcpy_free() and the same size.
+ */
+void *memcpy_alloc(size_t size)
+{
+	void *p;
+
+	if (!pages.size)
+		memcpy_set_pages("base");
+	p = map_pages(pages.type, pages.size, size);
+	if (p == NULL && pages.type != MEMCPY_PAGES_BASE) {
+		/* Pool exhausted.  Same length, memcpy_free() needs no type */
+		if (!__atomic_exchange_n(&pages.warned, 1, __ATOMIC_RELAXED))
+			fprintf(stderr, "Warning: out of %s pages, using base"
+				" pages\n", pages.name);
+		p = map_pages(MEMCPY_PAGES_BASE, pages.size, size);
+	}
+	return p;
+}
+
+void memcpy_free(void *p, size_t size)
+{
+	if (p)
+		munmap(p, (size + pages.size - 1) & ~(pages.size - 1));
+}
+
+/* Returns -1 with errno set if the queue can't be allocated */
+int memcpy_init_weq(struct memcpy_weq *weq, size_t queue_size)
+{
+	int i;
+
+	weq->queue = memcpy_alloc(queue_size);
+	weq->turn = malloc(memcpy_queue_length(queue_size) *
+			   sizeof(*weq->turn));
+	if (weq->queue == NULL || weq->turn == NULL) {
+		memcpy_free(weq->queue, queue_size);
+		free(weq->turn);
+		weq->queue = NULL;
+		weq->turn = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
 	memset(weq->queue, 0, queue_size);
 	weq->next = weq->queue;
 	weq->last = weq->queue + memcpy_queue_length(queue_size) - 1;
 	weq->wrap = 0;
+	weq->head = weq->queue;
 	weq->count = 0;
+	weq->errors = 0;
+	weq->timeout_us = MEMCPY_WEQ_TIMEOUT_US;
+	weq->tickets = 0;
+	for (i = 0; i < memcpy_queue_length(queue_size); i++)
+		weq->turn[i] = i;
+	return 0;
+}
+
+void memcpy_free_weq(struct memcpy_weq *weq)
+{
+	memcpy_free(weq->queue, (weq->last - weq->queue + 1) *
+		    sizeof(*weq->queue));
+	free(weq->turn);
+	weq->queue = NULL;
+	weq->turn = NULL;
+}
+
+/* Everything but the cmd byte, which hands the element over to the AFU */
+static inline void memcpy_copy_we(struct memcpy_work_element *new_we,
+				  struct memcpy_work_element *we)
+{
+	new_we->length = we->length;
+	new_we->cmd_extra = we->cmd_extra;
+	new_we->atomic_op1 = we->atomic_op1;
+	new_we->src = we->src;
+	new_we->dst = we->dst;
+	new_we->status = we->status;
+}
+
+static inline void memcpy_advance_weq(struct memcpy_weq *weq)
+{
+	weq->next++;
+	if (weq->next > weq->last) {
+		weq->wrap ^= MEMCPY_WE_CMD_WRAP;
+		weq->next = weq->queue;
+	}
+}
+
+/* Deadline in timebase ticks, 0 for none */
+static __u64 memcpy_deadline(long timeout_us)
+{
+	if (timeout_us < 0)
+		return 0;
+	return tb_deadline(timeout_us) ? : 1;
+}
+
+static int memcpy_deadline_passed(__u64 deadline)
+{
+	return deadline && tb_expired(deadline);
+}
+
+/*
+ * Flow control for memcpy_add_we() and memcpy_add_we_batch().
+ *
+ * The elements between weq->head and weq->next are in flight.  The AFU
+ * completes them in order, so the head moves forward as long as the status
+ * of the element it points at is set.  A slot is only written again once
+ * its element has completed: the status of a completed element can be read
+ * until the slot is reserved again.  The error bits of the reaped status
+ * accumulate in weq->errors.
+ *
+ * This is not used by the multi-producer functions below, which track
+ * slots with weq->turn[]: a queue is fed through one interface only.
+ */
+
+/* Retires the completed elements at the head, returns the free slots */
+int memcpy_weq_reap(struct memcpy_weq *weq)
+{
+	__u8 status;
+
+	while (weq->count &&
+	       (status = __atomic_load_n(&weq->head->status,
+					 __ATOMIC_ACQUIRE))) {
+		weq->errors |= status & ~MEMCPY_WE_STAT_COMPLETE;
+		weq->head = (weq->head == weq->last) ? weq->queue :
+			weq->head + 1;
+		weq->count--;
+	}
+	return weq->last - weq->queue + 1 - weq->count;
+}
+
+static int memcpy_weq_wait(struct memcpy_weq *weq, int count, int flags,
+			   __u64 deadline)
+{
+	assert(count > 0 && count <= weq->last - weq->queue + 1);
+
+	while (memcpy_weq_reap(weq) < count) {
+		if (flags & MEMCPY_WEQ_NONBLOCK)
+			return -EAGAIN;
+		if (memcpy_deadline_passed(deadline))
+			return -ETIMEDOUT;
+		sched_yield();
+	}
+	return 0;
+}
+
+/*
+ * Makes sure that the next count slots are free, waiting up to
+ * weq->timeout_us for the AFU to complete elements if needed, and returns
+ * -ETIMEDOUT if it does not.  With MEMCPY_WEQ_NONBLOCK, returns -EAGAIN
+ * instead of waiting when the queue is too full.
+ */
+int memcpy_weq_reserve(struct memcpy_weq *weq, int count, int flags)
+{
+	if (memcpy_weq_reap(weq) >= count)
+		return 0;
+	return memcpy_weq_wait(weq, count, flags,
+			       memcpy_deadline(weq->timeout_us));
 }
 
 /*
  * Copies a work element into the queue, taking care to set the wrap bit correctly.
- * Returns a pointer to the element in the queue.
+ * Waits for a free slot if the queue is full.
+ * Returns a pointer to the element in the queue, or NULL with errno set to
+ * ETIMEDOUT if no slot frees up, see memcpy_weq_reserve().
  */
 struct memcpy_work_element *memcpy_add_we(struct memcpy_weq *weq, struct memcpy_work_element we)
 {
-	struct memcpy_work_element *new_we = weq->next;
+	struct memcpy_work_element *new_we;
 
-	new_we->length = we.length;
-	new_we->src = we.src;
-	new_we->dst = we.dst;
-	new_we->status = we.status;
+	if (memcpy_weq_reserve(weq, 1, 0)) {
+		errno = ETIMEDOUT;
+		return NULL;
+	}
+	new_we = weq->next;
+	memcpy_copy_we(new_we, &we);
 	mb();
 	new_we->cmd = (we.cmd & ~MEMCPY_WE_CMD_WRAP) | weq->wrap;
-	weq->next++;
-	if (weq->next > weq->last) {
-		weq->wrap ^= MEMCPY_WE_CMD_WRAP;
-		weq->next = weq->queue;
+	memcpy_advance_weq(weq);
+	weq->count++;
+
+	return new_we;
+}
+
+/*
+ * Copies count work elements into the queue and makes them all valid, with
+ * a single sync for the whole batch.  The batch may wrap around the end of
+ * the queue, each element gets the wrap bit of the pass it lands in.
+ *
+ * The valid bits of the second and following elements are set first, the
+ * one of the first element last: the AFU stops on the first element until
+ * the whole batch has been published, and then finds it complete.
+ *
+ * Waits for count free slots if the queue is too full.
+ * If queued is not NULL, it receives the position of each element in the
+ * queue.  Returns a pointer to the last element in the queue, whose
+ * completion means that the whole batch completed, or NULL with errno set
+ * to ETIMEDOUT if the slots don't free up, in which case nothing is queued.
+ */
+struct memcpy_work_element *memcpy_add_we_batch(struct memcpy_weq *weq,
+						struct memcpy_work_element *we,
+						int count,
+						struct memcpy_work_element **queued)
+{
+	struct memcpy_work_element *first_we, *new_we = NULL;
+	__u8 first_cmd = 0;
+	int i;
+
+	/* Never overrun the head of the batch */
+	assert(count > 0 && count <= weq->last - weq->queue);
+
+	if (memcpy_weq_reserve(weq, count, 0)) {
+		errno = ETIMEDOUT;
+		return NULL;
+	}
+	weq->count += count;
+	first_we = weq->next;
+	for (i = 0; i < count; i++) {
+		new_we = weq->next;
+		memcpy_copy_we(new_we, &we[i]);
+		new_we->cmd = (we[i].cmd & ~(MEMCPY_WE_CMD_VALID |
+					     MEMCPY_WE_CMD_WRAP)) | weq->wrap;
+		if (queued)
+			queued[i] = new_we;
+		if (i == 0)
+			first_cmd = new_we->cmd | MEMCPY_WE_CMD_VALID;
+		memcpy_advance_weq(weq);
+	}
+	mb();
+
+	for (i = 1, new_we = first_we; i < count; i++) {
+		new_we = (new_we == weq->last) ? weq->queue : new_we + 1;
+		new_we->cmd |= MEMCPY_WE_CMD_VALID;
+	}
+	wmb();
+	first_we->cmd = first_cmd;
+
+	return new_we;
+}
+
+/*
+ * Multi-producer submission.
+ *
+ * Producers claim consecutive tickets with an atomic increment of
+ * weq->tickets.  Ticket t uses slot (t % length) during pass (t / length)
+ * of the AFU over the queue, which gives the wrap bit of the element.
+ * Since the AFU executes the queue in order, producers may make their
+ * elements valid in any order: the AFU waits on the oldest one still being
+ * written.
+ *
+ * A slot can only be written again once the owner of its previous ticket
+ * has read the status and released it with memcpy_release_we().  This is
+ * tracked in weq->turn[], which holds the next ticket allowed in each slot.
+ */
+
+/* Claims count consecutive tickets, returns the first one */
+__u64 memcpy_claim_we(struct memcpy_weq *weq, int count)
+{
+	return __atomic_fetch_add(&weq->tickets, count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Whether the slots of count tickets are free, for callers which rather
+ * sleep than have memcpy_post_we() yield until they are.
+ */
+int memcpy_post_ready(struct memcpy_weq *weq, __u64 ticket, int count)
+{
+	__u64 length = weq->last - weq->queue + 1;
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (__atomic_load_n(&weq->turn[(ticket + i) % length],
+				    __ATOMIC_ACQUIRE) != ticket + i)
+			return 0;
+	return 1;
+}
+
+/*
+ * Waits for the slots of count tickets to be free, then copies the work
+ * elements into them and makes them valid, with a single sync, the same way
+ * as memcpy_add_we_batch().  Returns a pointer to the last element in the
+ * queue.
+ */
+struct memcpy_work_element *memcpy_post_we(struct memcpy_weq *weq,
+					   __u64 ticket,
+					   struct memcpy_work_element *we,
+					   int count)
+{
+	__u64 length = weq->last - weq->queue + 1;
+	struct memcpy_work_element *new_we = NULL;
+	__u8 wrap, first_cmd = 0;
+	int i;
+
+	assert(count > 0 && count <= length);
+
+	while (!memcpy_post_ready(weq, ticket, count))
+		sched_yield();
+
+	for (i = 0; i < count; i++) {
+		new_we = weq->queue + (ticket + i) % length;
+		wrap = (((ticket + i) / length) & 1) ? MEMCPY_WE_CMD_WRAP : 0;
+		memcpy_copy_we(new_we, &we[i]);
+		new_we->cmd = (we[i].cmd & ~(MEMCPY_WE_CMD_VALID |
+					     MEMCPY_WE_CMD_WRAP)) | wrap;
+		if (i == 0)
+			first_cmd = new_we->cmd | MEMCPY_WE_CMD_VALID;
 	}
+	mb();
+
+	for (i = 1; i < count; i++)
+		weq->queue[(ticket + i) % length].cmd |= MEMCPY_WE_CMD_VALID;
+	wmb();
+	weq->queue[ticket % length].cmd = first_cmd;
 
 	return new_we;
 }
+
+/* Hands the slots of completed tickets over to the next pass */
+void memcpy_release_we(struct memcpy_weq *weq, __u64 ticket, int count)
+{
+	__u64 length = weq->last - weq->queue + 1;
+	int i;
+
+	for (i = 0; i < count; i++)
+		__atomic_store_n(&weq->turn[(ticket + i) % length],
+				 ticket + i + length, __ATOMIC_RELEASE);
+}
+
+/*
+ * Splits a copy into the unaligned head, which it returns, and the
+ * cacheline aligned body the AFU copies.  Buffers that cannot be aligned
+ * together are all head.
+ */
+static size_t memcpy_copy_split(const void *dst, const void *src,
+				size_t size, size_t *body)
+{
+	size_t head;
+
+	if (((uintptr_t)src ^ (uintptr_t)dst) & (MEMCPY_COPY_ALIGN - 1)) {
+		*body = 0;
+		return size;
+	}
+	head = -(uintptr_t)src & (MEMCPY_COPY_ALIGN - 1);
+	if (head > size)
+		head = size;
+	*body = (size - head) & ~(MEMCPY_COPY_ALIGN - 1);
+	return head;
+}
+
+/* The bytes of a memcpy_copy() which the CPU rather than the AFU copies */
+size_t memcpy_copy_cpu_bytes(const void *dst, const void *src, size_t size)
+{
+	size_t body;
+
+	memcpy_copy_split(dst, src, size, &body);
+	return size - body;
+}
+
+/*
+ * Copies size bytes from src to dst, whatever their alignment.
+ *
+ * The cacheline aligned body is split into work elements of at most
+ * max_length bytes, queued as the queue drains, while the CPU copies the
+ * unaligned head and tail.  Buffers that cannot be aligned together are
+ * copied by the CPU.  Waits for the queue to drain, and returns the error
+ * status bits of the elements, 0 on success, or -ETIMEDOUT if the whole
+ * copy takes longer than timeout_us.  A negative timeout waits forever.
+ */
+int memcpy_copy(struct memcpy_weq *weq, void *dst, const void *src,
+		size_t size, size_t max_length, long timeout_us)
+{
+	__u64 deadline = memcpy_deadline(timeout_us);
+	struct memcpy_work_element we;
+	size_t head, body, off, len;
+
+	head = memcpy_copy_split(dst, src, size, &body);
+	max_length &= ~(MEMCPY_COPY_ALIGN - 1);
+	assert(max_length > 0 && max_length <= MEMCPY_WE_MAX_LENGTH);
+
+	weq->errors = 0;
+	memset(&we, 0, sizeof(we));
+	we.cmd = MEMCPY_WE_CMD(1, MEMCPY_WE_CMD_COPY);
+	for (off = head; off < head + body; off += len) {
+		len = head + body - off;
+		if (len > max_length)
+			len = max_length;
+		we.length = htobe16((__u16)len);
+		we.src = htobe64((uintptr_t)src + off);
+		we.dst = htobe64((uintptr_t)dst + off);
+		if (memcpy_weq_wait(weq, 1, 0, deadline))
+			return -ETIMEDOUT;
+		memcpy_add_we(weq, we);
+	}
+
+	memcpy(dst, src, head);
+	memcpy((char *)dst + head + body, (const char *)src + head + body,
+	       size - head - body);
+
+	if (memcpy_weq_wait(weq, weq->last - weq->queue + 1, 0, deadline))
+		return -ETIMEDOUT;
+	return weq->errors;
+}
+
+/* Work elements built on the stack per memcpy_add_we_batch() call */
+#define MEMCPY_SG_CHUNK	64
+
+/*
+ * Queues a scatter-gather copy: one copy work element per segment,
+ * followed by an interrupt work element if irq is not 0.  Segments must
+ * be cacheline aligned and at most MEMCPY_WE_MAX_LENGTH long.  They are
+ * made valid in chunks, with a single sync each.
+ *
+ * Returns the trailing element, whose completion means that all segments
+ * completed, or NULL with errno set if a segment is invalid, in which case
+ * nothing is queued, or if the queue does not drain, in which case the
+ * first chunks may be queued.
+ */
+struct memcpy_work_element *memcpy_add_we_sg(struct memcpy_weq *weq,
+					     const struct memcpy_iovec *iov,
+					     int iovcnt, int irq)
+{
+	struct memcpy_work_element we[MEMCPY_SG_CHUNK], *last = NULL;
+	int i, n = 0, chunk = weq->last - weq->queue;
+
+	if (chunk > MEMCPY_SG_CHUNK)
+		chunk = MEMCPY_SG_CHUNK;
+	if (iovcnt <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	for (i = 0; i < iovcnt; i++)
+		if (iov[i].len == 0 || iov[i].len > MEMCPY_WE_MAX_LENGTH ||
+		    (((uintptr_t)iov[i].src | (uintptr_t)iov[i].dst) &
+		     (MEMCPY_COPY_ALIGN - 1))) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+	weq->errors = 0;
+	memset(we, 0, sizeof(we));
+	for (i = 0; i <= iovcnt; i++) {
+		if (i < iovcnt) {
+			we[n].cmd = MEMCPY_WE_CMD(0, MEMCPY_WE_CMD_COPY);
+			we[n].length = htobe16((__u16)iov[i].len);
+			we[n].src = htobe64((uintptr_t)iov[i].src);
+			we[n].dst = htobe64((uintptr_t)iov[i].dst);
+			n++;
+		} else if (irq) {
+			we[n].cmd = MEMCPY_WE_CMD(0, MEMCPY_WE_CMD_IRQ);
+			we[n].length = htobe16((__u16)irq);
+			we[n].src = 0;
+			we[n].dst = 0;
+			n++;
+		}
+		if (n && (n == chunk || i == iovcnt)) {
+			last = memcpy_add_we_batch(weq, we, n, NULL);
+			if (last == NULL)
+				return NULL;
+			n = 0;
+		}
+	}
+	return last;
+}
+
+/*
+ * Spins until the trailing element of a scatter-gather copy completes, and
+ * returns the error status bits of all its elements, 0 on success, or
+ * -ETIMEDOUT.  A negative timeout waits forever.
+ */
+int memcpy_wait_sg(struct memcpy_weq *weq, struct memcpy_work_element *last,
+		   long timeout_us)
+{
+	__u64 deadline = memcpy_deadline(timeout_us);
+
+	while (!__atomic_load_n(&last->status, __ATOMIC_ACQUIRE)) {
+		if (memcpy_deadline_passed(deadline))
+			return -ETIMEDOUT;
+		cpu_relax();
+	}
+	memcpy_weq_reap(weq);
+	return weq->errors;
+}
+
+/*
+ * Asynchronous operations on a single producer queue.
+ *
+ * memcpy_async_copy(), memcpy_async_incr() and memcpy_async_cas() queue
+ * one work element and return a ticket, or -EAGAIN when all tickets are
+ * in use.  They wait for a free slot when the queue is full, and return
+ * -ETIMEDOUT if none frees up, see memcpy_weq_reserve().  Tickets come
+ * from a table allocated by memcpy_async_init(), nothing is allocated
+ * when queueing or waiting.
+ *
+ * Once an operation completed, memcpy_async_poll() or one of the wait
+ * functions returns its error status bits, 0 on success, and the ticket is
+ * freed.  Pending operations give -EINPROGRESS, or -ETIMEDOUT when waiting.
+ *
+ * The status of a completed element is saved in its ticket before the
+ * slot is reused, so tickets can be collected in any order.
+ */
+
+int memcpy_async_init(struct memcpy_async *as, struct memcpy_weq *weq,
+		      int nops)
+{
+	int i, length = weq->last - weq->queue + 1;
+
+	as->weq = weq;
+	as->nops = nops;
+	as->nfree = nops;
+	as->ops = calloc(nops, sizeof(*as->ops));
+	as->free = malloc(nops * sizeof(*as->free));
+	as->slot_owner = malloc(length * sizeof(*as->slot_owner));
+	if (!as->ops || !as->free || !as->slot_owner) {
+		memcpy_async_free(as);
+		return -ENOMEM;
+	}
+	for (i = 0; i < nops; i++)
+		as->free[i] = nops - 1 - i;
+	for (i = 0; i < length; i++)
+		as->slot_owner[i] = -1;
+	return 0;
+}
+
+void memcpy_async_free(struct memcpy_async *as)
+{
+	free(as->ops);
+	free(as->free);
+	free(as->slot_owner);
+	as->ops = NULL;
+	as->free = NULL;
+	as->slot_owner = NULL;
+}
+
+/* Saves the status of the operation owning a slot, which has completed */
+static void memcpy_async_save(struct memcpy_async *as, int slot)
+{
+	struct memcpy_async_op *op;
+
+	if (as->slot_owner[slot] < 0)
+		return;
+	op = &as->ops[as->slot_owner[slot]];
+	op->status = op->we->status;
+	op->we = NULL;
+	as->slot_owner[slot] = -1;
+}
+
+static int memcpy_async_submit(struct memcpy_async *as,
+			       struct memcpy_work_element *we)
+{
+	struct memcpy_weq *weq = as->weq;
+	int ticket, slot;
+
+	if (as->nfree == 0)
+		return -EAGAIN;
+	if (memcpy_weq_reserve(weq, 1, 0))
+		return -ETIMEDOUT;
+	ticket = as->free[--as->nfree];
+
+	slot = weq->next - weq->queue;
+	memcpy_async_save(as, slot);
+	as->slot_owner[slot] = ticket;
+	as->ops[ticket].busy = 1;
+	as->ops[ticket].status = 0;
+	as->ops[ticket].we = memcpy_add_we(weq, *we);
+	return ticket;
+}
+
+int memcpy_async_copy(struct memcpy_async *as, void *dst, const void *src,
+		      size_t len)
+{
+	struct memcpy_work_element we;
+
+	memset(&we, 0, sizeof(we));
+	we.cmd = MEMCPY_WE_CMD(1, MEMCPY_WE_CMD_COPY);
+	we.length = htobe16((__u16)len);
+	we.src = htobe64((uintptr_t)src);
+	we.dst = htobe64((uintptr_t)dst);
+	return memcpy_async_submit(as, &we);
+}
+
+/* Big endian increment of the len byte integer at src, stored at dst */
+int memcpy_async_incr(struct memcpy_async *as, void *dst, const void *src,
+		      size_t len)
+{
+	struct memcpy_work_element we;
+
+	memset(&we, 0, sizeof(we));
+	we.cmd = MEMCPY_WE_CMD(1, MEMCPY_WE_CMD_INCR);
+	we.length = htobe16((__u16)len);
+	we.src = htobe64((uintptr_t)src);
+	we.dst = htobe64((uintptr_t)dst);
+	return memcpy_async_submit(as, &we);
+}
+
+/*
+ * Compare and swap of the 8 bytes at dst, cmd_extra is one of
+ * MEMCPY_WE_CMD_EXTRA_CAS_*.
+ */
+int memcpy_async_cas(struct memcpy_async *as, void *dst, __u64 op1,
+		     __u64 op2, __u8 cmd_extra)
+{
+	struct memcpy_work_element we;
+
+	memset(&we, 0, sizeof(we));
+	we.cmd = MEMCPY_WE_CMD(1, MEMCPY_WE_CMD_ATOMIC);
+	we.length = htobe16(1);
+	we.cmd_extra = cmd_extra;
+	we.atomic_op1 = htobe64(op1);
+	we.src = htobe64(op2);
+	we.dst = htobe64((uintptr_t)dst);
+	return memcpy_async_submit(as, &we);
+}
+
+int memcpy_async_poll(struct memcpy_async *as, int ticket)
+{
+	struct memcpy_async_op *op = &as->ops[ticket];
+
+	assert(ticket >= 0 && ticket < as->nops && op->busy);
+	if (op->we) {
+		if (!__atomic_load_n(&op->we->status, __ATOMIC_ACQUIRE))
+			return -EINPROGRESS;
+		memcpy_async_save(as, op->we - as->weq->queue);
+	}
+	op->busy = 0;
+	as->free[as->nfree++] = ticket;
+	return op->status & ~MEMCPY_WE_STAT_COMPLETE;
+}
+
+/* A negative timeout waits forever */
+int memcpy_async_wait(struct memcpy_async *as, int ticket, long timeout_us)
+{
+	__u64 deadline = memcpy_deadline(timeout_us);
+	int ret;
+
+	while ((ret = memcpy_async_poll(as, ticket)) == -EINPROGRESS) {
+		if (memcpy_deadline_passed(deadline))
+			return -ETIMEDOUT;
+		cpu_relax();
+	}
+	return ret;
+}
+
+/*
+ * Waits for one of n tickets to complete, stores its position in *index
+ * and replaces it with -1 in the array.  Entries already -1 are skipped.
+ */
+int memcpy_async_wait_any(struct memcpy_async *as, int *tickets, int n,
+			  long timeout_us, int *index)
+{
+	__u64 deadline = memcpy_deadline(timeout_us);
+	int i, ret;
+
+	for (;;) {
+		for (i = 0; i < n; i++) {
+			if (tickets[i] < 0)
+				continue;
+			ret = memcpy_async_poll(as, tickets[i]);
+			if (ret != -EINPROGRESS) {
+				tickets[i] = -1;
+				*index = i;
+				return ret;
+			}
+		}
+		if (memcpy_deadline_passed(deadline))
+			return -ETIMEDOUT;
+		cpu_relax();
+	}
+}
+
+/*
+ * Waits for n tickets to complete, and returns their error status bits
+ * or'ed together.  Completed tickets are replaced with -1 in the array, so
+ * that the call can be repeated after a timeout.
+ */
+int memcpy_async_wait_all(struct memcpy_async *as, int *tickets, int n,
+			  long timeout_us)
+{
+	__u64 deadline = memcpy_deadline(timeout_us);
+	int i, ret, errors = 0;
+
+	/* the AFU completes in queue order: wait for each in turn */
+	for (i = 0; i < n; i++) {
+		if (tickets[i] < 0)
+			continue;
+		while ((ret = memcpy_async_poll(as, tickets[i])) ==
+		       -EINPROGRESS) {
+			if (memcpy_deadline_passed(deadline))
+				return -ETIMEDOUT;
+			cpu_relax();
+		}
+		tickets[i] = -1;
+		errors |= ret;
+	}
+	return errors;
+}
@@ -26,17 +26,132 @@ struct memcpy_weq {
 	struct memcpy_work_element *next;
 	struct memcpy_work_element *last;
 	int wrap;
-	int count;
+	/* Single producer flow control, see memcpy_weq_reserve() */
+	struct memcpy_work_element *head;	/* oldest element in flight */
+	int count;				/* elements in flight */
+	__u8 errors;				/* error status bits reaped */
+	long timeout_us;			/* memcpy_weq_reserve() wait */
+	/* Multi-producer submission, see memcpy_claim_we() */
+	__u64 tickets;
+	__u64 *turn;
 };
 
+#if defined(__powerpc__)
 #define mb()   __asm__ __volatile__ ("sync" : : : "memory")
+#define wmb()  __asm__ __volatile__ ("lwsync" : : : "memory")
+#else
+#define mb()   __sync_synchronize()
+#define wmb()  __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+/* Busy-wait hint: lowers the SMT thread priority for the spin on POWER */
+static inline void cpu_relax(void)
+{
+#if defined(__powerpc__)
+	__asm__ __volatile__ ("or 31,31,31; or 2,2,2" : : : "memory");
+#elif defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__ ("pause" : : : "memory");
+#else
+	__asm__ __volatile__ ("" : : : "memory");
+#endif
+}
 
 static inline int memcpy_queue_length(size_t queue_size)
 {
 	return queue_size/sizeof(struct memcpy_work_element);
 }
 
-void memcpy_init_weq(struct memcpy_weq *weq, size_t queue_size);
+/* Copies are done by whole cachelines, from and to aligned addresses */
+#define MEMCPY_COPY_ALIGN	128
+/* Largest copy length of a work element, in whole cachelines */
+#define MEMCPY_WE_MAX_LENGTH	(0xffff & ~(MEMCPY_COPY_ALIGN - 1))
+
+/*
+ * Asynchronous operations, see memcpy_async_init().  Tickets index a
+ * table allocated up front; slot_owner maps queue slots to the ticket
+ * whose element they hold.
+ */
+struct memcpy_async_op {
+	struct memcpy_work_element *we;	/* NULL once the status is saved */
+	__u8 status;
+	int busy;
+};
+
+struct memcpy_async {
+	struct memcpy_weq *weq;
+	struct memcpy_async_op *ops;
+	int *free;			/* stack of free tickets */
+	int nfree;
+	int nops;
+	int *slot_owner;
+};
+
+/* One segment of a scatter-gather copy, see memcpy_add_we_sg() */
+struct memcpy_iovec {
+	void *src;
+	void *dst;
+	size_t len;
+};
+
+/* memcpy_weq_reserve() flags */
+#define MEMCPY_WEQ_NONBLOCK	0x1
+
+/* Default weq->timeout_us, a negative timeout waits forever */
+#define MEMCPY_WEQ_TIMEOUT_US	(120 * 1000000L)
+
+/* memcpy_set_pages() types */
+#define MEMCPY_PAGES_BASE	0
+#define MEMCPY_PAGES_THP	1
+#define MEMCPY_PAGES_HUGETLB	2
+
+size_t memcpy_parse_size(const char *str, char **end);
+int memcpy_set_pages(const char *spec);
+const char *memcpy_pages_name(void);
+void *memcpy_alloc(size_t size);
+void memcpy_free(void *p, size_t size);
+
+int memcpy_init_weq(struct memcpy_weq *weq, size_t queue_size);
+void memcpy_free_weq(struct memcpy_weq *weq);
+int memcpy_weq_reap(struct memcpy_weq *weq);
+int memcpy_weq_reserve(struct memcpy_weq *weq, int count, int flags);
 struct memcpy_work_element *memcpy_add_we(struct memcpy_weq *weq, struct memcpy_work_element we);
+struct memcpy_work_element *memcpy_add_we_batch(struct memcpy_weq *weq,
+						struct memcpy_work_element *we,
+						int count,
+						struct memcpy_work_element **queued);
+
+__u64 memcpy_claim_we(struct memcpy_weq *weq, int count);
+int memcpy_post_ready(struct memcpy_weq *weq, __u64 ticket, int count);
+struct memcpy_work_element *memcpy_post_we(struct memcpy_weq *weq,
+					   __u64 ticket,
+					   struct memcpy_work_element *we,
+					   int count);
+void memcpy_release_we(struct memcpy_weq *weq, __u64 ticket, int count);
+
+int memcpy_copy(struct memcpy_weq *weq, void *dst, const void *src,
+		size_t size, size_t max_length, long timeout_us);
+size_t memcpy_copy_cpu_bytes(const void *dst, const void *src, size_t size);
+
+struct memcpy_work_element *memcpy_add_we_sg(struct memcpy_weq *weq,
+					     const struct memcpy_iovec *iov,
+					     int iovcnt, int irq);
+int memcpy_wait_sg(struct memcpy_weq *weq,
+		   struct memcpy_work_element *last, long timeout_us);
+
+int memcpy_async_init(struct memcpy_async *as, struct memcpy_weq *weq,
+		      int nops);
+void memcpy_async_free(struct memcpy_async *as);
+int memcpy_async_copy(struct memcpy_async *as, void *dst, const void *src,
+		      size_t len);
+int memcpy_async_incr(struct memcpy_async *as, void *dst, const void *src,
+		      size_t len);
+int memcpy_async_cas(struct memcpy_async *as, void *dst, __u64 op1,
+		     __u64 op2, __u8 cmd_extra);
+int memcpy_async_poll(struct memcpy_async *as, int ticket);
+int memcpy_async_wait(struct memcpy_async *as, int ticket, long timeout_us);
+int memcpy_async_wait_any(struct memcpy_async *as, int *tickets, int n,
+			  long timeout_us, int *index);
+int memcpy_async_wait_all(struct memcpy_async *as, int *tickets, int n,
+			  long timeout_us);
 
 #endif /* _MEMCPY_AFU_H_ */
@@ -0,0 +1,834 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Parameter sweep of the memcpy AFU: copy size x queue depth x processes x
+ * completion by polling or interrupt, one line of results per point.  The
+ * kernel mode copies through cxl-memcpy.ko instead, one ioctl per copy on
+ * a /dev/cxlmemcpy file of each process.
+ *
+ * The processes are forked and attached once, for the largest process
+ * count, and step through the points together: the ones beyond the process
+ * count of a point sit it out.  Buffers are allocated and touched once, for
+ * the largest size and depth.
+ */
+
+#define _DEFAULT_SOURCE
+#define _ISOC11_SOURCE
+#define _GNU_SOURCE
+
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <endian.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <libcxl.h>
+#include "cxl-memcpy.h"
+#include "memcpy_afu.h"
+#include "latency.h"
+#include "timebase.h"
+#include "results.h"
+#include "placement.h"
+
+#define CACHELINESIZE	128
+
+/* Queue sizes other than 512kB don't seem to work */
+#define QUEUE_SIZE	4095*CACHELINESIZE
+
+#define COMPLETION_TIMEOUT	120
+#define BENCH_IRQ		1
+#define BENCH_MAX_VALUES	16
+
+/* kernel cxl driver dedicates one context to the vPHB, we use another */
+#define BENCH_MAX_PROCS	(MEMCPY_AFUD_NUM_OF_PROCESSES-2)
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+enum bench_mode {
+	BENCH_POLL,
+	BENCH_IRQ_MODE,
+	BENCH_KERNEL,
+};
+
+static const char * const mode_names[] = {
+	[BENCH_POLL] = "poll",
+	[BENCH_IRQ_MODE] = "irq",
+	[BENCH_KERNEL] = "kernel",
+};
+
+struct bench_list {
+	size_t values[BENCH_MAX_VALUES];
+	int count;
+};
+
+struct bench_point {
+	size_t size;
+	int depth;
+	int procs;
+	enum bench_mode mode;
+};
+
+/* What each process reports for a point, in the shared mapping */
+struct bench_result {
+	struct lat_hist hist;
+	__u64 status_errors[RESULTS_STATUS_BITS];
+	__u64 start;
+	__u64 end;
+	int error;
+};
+
+struct bench_shared {
+	pthread_barrier_t barrier;
+	struct bench_point point;
+	int quit;
+	struct bench_result result[BENCH_MAX_PROCS];
+};
+
+/* One attached context, with buffers for the largest point */
+struct bench_worker {
+	struct cxl_afu_h *afu_h;
+	int kernel_fd;
+	struct memcpy_weq weq;
+	char *src;
+	char *dst;
+	size_t stride;
+	int *tickets;
+	__u64 *submit_tb;
+	struct memcpy_work_element *batch;
+	struct memcpy_work_element **queued;
+};
+
+static struct bench_list sizes, depths, procs, modes;
+static int card, loops = 1000, completion_timeout = COMPLETION_TIMEOUT;
+static long caia_major;
+
+static size_t list_max(struct bench_list *l)
+{
+	size_t max = 0;
+	int i;
+
+	for (i = 0; i < l->count; i++)
+		if (l->values[i] > max)
+			max = l->values[i];
+	return max;
+}
+
+static int mode_listed(enum bench_mode mode)
+{
+	int i;
+
+	for (i = 0; i < modes.count; i++)
+		if (modes.values[i] == mode)
+			return 1;
+	return 0;
+}
+
+/* Whether the processes need contexts of their own, for poll or irq */
+static int user_modes(void)
+{
+	return mode_listed(BENCH_POLL) || mode_listed(BENCH_IRQ_MODE);
+}
+
+/* Parses a comma separated list of sizes, or of mode names */
+static int parse_list(struct bench_list *l, const char *str, int is_mode)
+{
+	char *end;
+	int i;
+
+	for (l->count = 0; *str; str = end + (*end == ',')) {
+		if (l->count == BENCH_MAX_VALUES)
+			return -1;
+		if (is_mode) {
+			end = strchrnul(str, ',');
+			for (i = 0; i < ARRAY_SIZE(mode_names); i++)
+				if (!strncmp(str, mode_names[i], end - str) &&
+				    strlen(mode_names[i]) == end - str)
+					break;
+			if (i == ARRAY_SIZE(mode_names))
+				return -1;
+			l->values[l->count++] = i;
+		} else {
+			l->values[l->count] = memcpy_parse_size(str, &end);
+			if (end == str || (*end && *end != ',') ||
+			    !l->values[l->count])
+				return -1;
+			l->count++;
+		}
+	}
+	return l->count ? 0 : -1;
+}
+
+static int skip_process_element(int pe)
+{
+	/* MemCpy 2.0 AFU only serves DMA port 0 */
+	return caia_major == 2 && pe % 4 != 1;
+}
+
+static int get_caia_major(void)
+{
+	struct cxl_adapter_h *adapter;
+	long caia_minor;
+	int card_num = -1;
+
+	cxl_for_each_adapter(adapter) {
+		sscanf(cxl_adapter_dev_name(adapter), "card%d", &card_num);
+		if (card_num == card) {
+			if (cxl_get_caia_version(adapter, &caia_major,
+						 &caia_minor)) {
+				perror("cxl_get_caia_version");
+				return 1;
+			}
+			break;
+		}
+	}
+	if (card_num != card) {
+		fprintf(stderr, "/sys/class/cxl/card%d: no such cxl card\n",
+			card);
+		return 1;
+	}
+	return 0;
+}
+
+/* Have the AFU wait for work rather than stop on an invalid command */
+static int clear_stop_on_inv_cmd(void)
+{
+	struct cxl_afu_h *afu_master_h;
+	struct cxl_ioctl_start_work *work;
+	__u64 reg_data;
+	char *cxldev;
+	int rc = 1;
+
+	if (asprintf(&cxldev, "/dev/cxl/afu%d.0m", card) < 0) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	do {
+		afu_master_h = cxl_afu_open_dev(cxldev);
+		if (afu_master_h == NULL) {
+			fprintf(stderr, "Unable to open AFU Master cxl device %s: %d\n",
+				cxldev, errno);
+			free(cxldev);
+			return 1;
+		}
+	} while (skip_process_element(cxl_afu_get_process_element(afu_master_h)));
+
+	work = cxl_work_alloc();
+	if (work == NULL) {
+		perror("cxl_work_alloc");
+		goto err;
+	}
+	if (cxl_afu_attach_work(afu_master_h, work)) {
+		perror("cxl_afu_attach_work(master)");
+		goto err;
+	}
+	if (cxl_mmio_map(afu_master_h, CXL_MMIO_BIG_ENDIAN) == -1) {
+		perror("Unable to map AFU Master problem state registers");
+		goto err;
+	}
+	if (cxl_mmio_read64(afu_master_h, MEMCPY_AFU_PSA_REG_CFG, &reg_data) == -1 ||
+	    cxl_mmio_write64(afu_master_h, MEMCPY_AFU_PSA_REG_CFG,
+			     reg_data & ~MEMCPY_AFU_PSA_REG_CFG_Stop_on_Inv_Cmd) == -1) {
+		perror("mmio access to AFU PSA CFG REG");
+		goto err;
+	}
+	rc = 0;
+err:
+	cxl_afu_free(afu_master_h);
+	cxl_work_free(work);
+	free(cxldev);
+	return rc;
+}
+
+static int worker_open(struct bench_worker *w)
+{
+	struct cxl_ioctl_start_work *work;
+	/* Kernel points copy one buffer pair, whatever the depths */
+	size_t max_depth = user_modes() ? list_max(&depths) : 1;
+	char *cxldev;
+	int i, pe;
+
+	w->stride = (list_max(&sizes) + CACHELINESIZE - 1) &
+		~(CACHELINESIZE - 1);
+	w->src = memcpy_alloc(max_depth * w->stride);
+	w->dst = memcpy_alloc(max_depth * w->stride);
+	w->tickets = calloc(max_depth, sizeof(*w->tickets));
+	w->submit_tb = calloc(max_depth, sizeof(*w->submit_tb));
+	w->batch = calloc(max_depth + 1, sizeof(*w->batch));
+	w->queued = calloc(max_depth + 1, sizeof(*w->queued));
+	if (!w->src || !w->dst || !w->tickets || !w->submit_tb ||
+	    !w->batch || !w->queued) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	/* Fault the buffers in now, not during the first point */
+	for (i = 0; i < max_depth; i++)
+		memset(w->src + i * w->stride, (getpid() + i) & 0xff,
+		       w->stride);
+	memset(w->dst, 0, max_depth * w->stride);
+
+	if (mode_listed(BENCH_KERNEL)) {
+		w->kernel_fd = open("/dev/cxlmemcpy", O_RDWR | O_CLOEXEC);
+		if (w->kernel_fd < 0) {
+			perror("Unable to open /dev/cxlmemcpy device");
+			return 1;
+		}
+	}
+	if (!user_modes())
+		return 0;
+
+	if (asprintf(&cxldev, "/dev/cxl/afu%d.0s", card) < 0) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	do {
+		w->afu_h = cxl_afu_open_dev(cxldev);
+		if (w->afu_h == NULL) {
+			fprintf(stderr, "Unable to open cxl device %s: %d\n",
+				cxldev, errno);
+			free(cxldev);
+			return 1;
+		}
+		pe = cxl_afu_get_process_element(w->afu_h);
+	} while (skip_process_element(pe));
+	free(cxldev);
+
+	if (memcpy_init_weq(&w->weq, QUEUE_SIZE)) {
+		perror("Unable to allocate the work element queue");
+		return 1;
+	}
+	w->weq.timeout_us = completion_timeout * 1000000L;
+	work = cxl_work_alloc();
+	if (work == NULL) {
+		perror("cxl_work_alloc");
+		return 1;
+	}
+	if (cxl_work_set_wed(work, MEMCPY_WED(w->weq.queue,
+					      QUEUE_SIZE/CACHELINESIZE))) {
+		perror("cxl_work_set_wed");
+		cxl_work_free(work);
+		return 1;
+	}
+	if (cxl_afu_attach_work(w->afu_h, work)) {
+		perror("cxl_afu_attach_work(slave)");
+		cxl_work_free(work);
+		return 1;
+	}
+	cxl_work_free(work);
+	if (cxl_mmio_map(w->afu_h, CXL_MMIO_BIG_ENDIAN) == -1) {
+		perror("Unable to map problem state registers");
+		return 1;
+	}
+	return 0;
+}
+
+static char *buf(struct bench_worker *w, char *base, int k)
+{
+	return base + k * w->stride;
+}
+
+/*
+ * Polling: keeps pt->depth copies in flight and reaps them in order, the
+ * latency of a copy runs from queueing to its completion being seen.
+ */
+static int bench_poll(struct bench_worker *w, struct bench_point *pt,
+		      struct bench_result *r)
+{
+	struct memcpy_async as;
+	int issued = 0, reaped = 0, k, ret = 0;
+	__u64 tb;
+
+	if (memcpy_async_init(&as, &w->weq, pt->depth)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	while (reaped < loops) {
+		while (issued < loops && issued - reaped < pt->depth) {
+			k = issued % pt->depth;
+			w->submit_tb[k] = tb_now();
+			w->tickets[k] = memcpy_async_copy(&as, buf(w, w->dst, k),
+							  buf(w, w->src, k),
+							  pt->size);
+			if (w->tickets[k] < 0) {
+				fprintf(stderr, "Timeout waiting for a queue"
+					" slot on copy %d\n", issued);
+				memcpy_async_free(&as);
+				return 1;
+			}
+			issued++;
+		}
+		k = reaped % pt->depth;
+		ret = memcpy_async_wait(&as, w->tickets[k],
+					completion_timeout * 1000000L);
+		tb = tb_now();
+		if (ret) {
+			fprintf(stderr, "%s on copy %d\n", ret == -ETIMEDOUT ?
+				"Timeout polling for completion" :
+				"Error status", reaped);
+			if (ret > 0)
+				results_count_status(r->status_errors, ret);
+			break;
+		}
+		lat_hist_record(&r->hist, tb - w->submit_tb[k]);
+		reaped++;
+	}
+	memcpy_async_free(&as);
+	return ret ? 1 : 0;
+}
+
+/* Waits for the AFU interrupt, then restarts the AFU, which stops after it */
+static int bench_wait_irq(struct bench_worker *w)
+{
+	struct timeval timeout = { .tv_sec = completion_timeout };
+	struct cxl_event event;
+	int afu_fd = cxl_afu_fd(w->afu_h);
+	__u64 status, deadline;
+	fd_set set;
+
+	FD_ZERO(&set);
+	FD_SET(afu_fd, &set);
+	if (select(afu_fd + 1, &set, NULL, NULL, &timeout) <= 0) {
+		fprintf(stderr, "Timeout waiting for interrupt\n");
+		return 1;
+	}
+	if (cxl_read_expected_event(w->afu_h, &event,
+				    CXL_EVENT_AFU_INTERRUPT, BENCH_IRQ)) {
+		fprintf(stderr, "Failed reading expected event\n");
+		return 1;
+	}
+	deadline = tb_deadline(completion_timeout * 1000000ULL);
+	do {
+		if (cxl_mmio_read64(w->afu_h, MEMCPY_PS_REG_STATUS,
+				    &status) == -1) {
+			perror("cxl_mmio_read64");
+			return 1;
+		}
+		if (tb_expired(deadline)) {
+			fprintf(stderr, "Timeout waiting for the AFU to stop\n");
+			return 1;
+		}
+	} while (!(status & MEMCPY_PS_REG_STATUS_Stopped));
+	cxl_mmio_write64(w->afu_h, MEMCPY_PS_REG_PCTRL,
+			 MEMCPY_PS_REG_PCTRL_Restart);
+	return 0;
+}
+
+/*
+ * Interrupt: queues pt->depth copies and an interrupt at once, and sleeps
+ * until the interrupt.  All copies of a batch get the latency of the batch.
+ */
+static int bench_irq(struct bench_worker *w, struct bench_point *pt,
+		     struct bench_result *r)
+{
+	int done = 0, n, k;
+	__u64 tb, lat;
+
+	for (k = 0; k < pt->depth; k++) {
+		memset(&w->batch[k], 0, sizeof(w->batch[k]));
+		w->batch[k].cmd = MEMCPY_WE_CMD(0, MEMCPY_WE_CMD_COPY);
+		w->batch[k].length = htobe16((__u16)pt->size);
+		w->batch[k].src = htobe64((uintptr_t)buf(w, w->src, k));
+		w->batch[k].dst = htobe64((uintptr_t)buf(w, w->dst, k));
+	}
+	while (done < loops) {
+		n = loops - done < pt->depth ? loops - done : pt->depth;
+		memset(&w->batch[n], 0, sizeof(w->batch[n]));
+		w->batch[n].cmd = MEMCPY_WE_CMD(0, MEMCPY_WE_CMD_IRQ);
+		w->batch[n].length = htobe16(BENCH_IRQ);
+
+		tb = tb_now();
+		if (memcpy_add_we_batch(&w->weq, w->batch, n + 1,
+					w->queued) == NULL) {
+			perror("memcpy_add_we_batch");
+			return 1;
+		}
+		if (bench_wait_irq(w))
+			return 1;
+		lat = tb_now() - tb;
+		for (k = 0; k < n; k++) {
+			if (w->queued[k]->status != MEMCPY_WE_STAT_COMPLETE) {
+				fprintf(stderr, "Error status on copy %d\n",
+					done + k);
+				results_count_status(r->status_errors,
+						     w->queued[k]->status);
+				return 1;
+			}
+			lat_hist_record(&r->hist, lat);
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/*
+ * Kernel: each copy is an ioctl to cxl-memcpy.ko, which runs it on the
+ * context of the process' file and returns once it is done.  The copies
+ * are synchronous: there is no depth, the points have depth 1.
+ */
+static int bench_kernel(struct bench_worker *w, struct bench_point *pt,
+			struct bench_result *r)
+{
+	struct cxl_memcpy_ioctl_copy copy = {
+		.src = (uintptr_t)w->src,
+		.dst = (uintptr_t)w->dst,
+		.size = pt->size,
+	};
+	int i;
+	__u64 tb;
+
+	for (i = 0; i < loops; i++) {
+		tb = tb_now();
+		if (ioctl(w->kernel_fd, CXL_MEMCPY_IOCTL_COPY, &copy)) {
+			fprintf(stderr, "ioctl CXL_MEMCPY_IOCTL_COPY on copy"
+				" %d: %s\n", i, strerror(errno));
+			return 1;
+		}
+		lat_hist_record(&r->hist, tb_now() - tb);
+	}
+	return 0;
+}
+
+static int bench_run(struct bench_worker *w, struct bench_point *pt,
+		     struct bench_result *r)
+{
+	int k, n = loops < pt->depth ? loops : pt->depth;
+
+	r->start = tb_now();
+	if (pt->mode == BENCH_KERNEL)
+		r->error = bench_kernel(w, pt, r);
+	else if (pt->mode == BENCH_IRQ_MODE)
+		r->error = bench_irq(w, pt, r);
+	else
+		r->error = bench_poll(w, pt, r);
+	r->end = tb_now();
+
+	/* Each buffer pair in use holds the result of its last copy */
+	for (k = 0; !r->error && k < n; k++) {
+		if (memcmp(buf(w, w->dst, k), buf(w, w->src, k), pt->size)) {
+			fprintf(stderr, "Copy mismatch in buffer %d\n", k);
+			r->error = 1;
+		}
+		memset(buf(w, w->dst, k), 0, pt->size);
+	}
+	return r->error;
+}
+
+static void worker(struct bench_shared *sh, int index)
+{
+	struct bench_worker w;
+	struct bench_result *r = &sh->result[index];
+	int failed, cpu, node;
+
+	memset(&w, 0, sizeof(w));
+	w.kernel_fd = -1;
+	failed = r->error = placement_apply(index, &cpu, &node) ||
+		worker_open(&w);
+	pthread_barrier_wait(&sh->barrier);
+
+	for (;;) {
+		pthread_barrier_wait(&sh->barrier);
+		if (sh->quit)
+			break;
+		if (!failed && index < sh->point.procs)
+			failed = bench_run(&w, &sh->point, r);
+		pthread_barrier_wait(&sh->barrier);
+	}
+	if (w.afu_h)
+		cxl_afu_free(w.afu_h);
+	if (w.kernel_fd >= 0)
+		close(w.kernel_fd);
+	exit(failed);
+}
+
+static int bench_point(struct bench_shared *sh, struct bench_point *pt)
+{
+	struct results_metrics m = { .scope = "point" };
+	struct lat_hist total;
+	__u64 start = ~0ULL, end = 0;
+	char params[80];
+	double t;
+	int i, j;
+
+	sh->point = *pt;
+	for (i = 0; i < pt->procs; i++) {
+		lat_hist_init(&sh->result[i].hist);
+		memset(sh->result[i].status_errors, 0,
+		       sizeof(sh->result[i].status_errors));
+	}
+	pthread_barrier_wait(&sh->barrier);
+	pthread_barrier_wait(&sh->barrier);
+
+	lat_hist_init(&total);
+	for (i = 0; i < pt->procs; i++) {
+		for (j = 0; j < RESULTS_STATUS_BITS; j++)
+			m.status_errors[j] += sh->result[i].status_errors[j];
+		m.error |= sh->result[i].error;
+		lat_hist_merge(&total, &sh->result[i].hist);
+		if (sh->result[i].start < start)
+			start = sh->result[i].start;
+		if (sh->result[i].end > end)
+			end = sh->result[i].end;
+	}
+	t = tb_to_us(end - start);
+
+	snprintf(params, sizeof(params), "size=%zu;depth=%d;procs=%d;mode=%s",
+		 pt->size, pt->depth, pt->procs, mode_names[pt->mode]);
+	m.params = params;
+	m.ops = total.count;
+	m.bytes = total.count * pt->size;
+	m.time_us = t;
+	m.hist = &total;
+	m.ns_per_unit = tb_to_ns(1);
+	results_emit(&m);
+	if (m.error)
+		return 1;
+
+	printf("%8zu %6d %6d %5s %8llu %10.0f %9.2f %10.0f %8.2f %8.2f %8.2f\n",
+	       pt->size, pt->depth, pt->procs, mode_names[pt->mode],
+	       (unsigned long long)total.count, t,
+	       t ? total.count * pt->size / t : 0,
+	       t ? total.count * 1000000.0 / t : 0,
+	       tb_to_us(lat_hist_percentile(&total, 50)),
+	       tb_to_us(lat_hist_percentile(&total, 99)),
+	       tb_to_us(lat_hist_percentile(&total, 99.9)));
+	fflush(stdout);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: memcpy_afu_bench [options]\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "\t-c <card_num>\tUse this CAPI card (default 0).\n");
+	fprintf(stderr,
+		"\t-d <depths>\tCopies in flight per process (default 1,8,64).\n");
+	fprintf(stderr, "\t-e <timeout>\tEnd timeout.\n"
+			"\t\t\tSeconds to wait for the AFU to signal completion.\n");
+	fprintf(stderr,
+		"\t-F <file>\tAlso write the results to this file, as CSV\n"
+		"\t\t\tfor a .csv suffix, else JSON lines (- for stdout).\n");
+	fprintf(stderr, "\t-h\t\tDisplay this help text.\n");
+	fprintf(stderr,
+		"\t-H <pages>\tBack the queues and buffers with base (default),\n"
+		"\t\t\tthp, huge or hugetlbfs pages of a size such\n"
+		"\t\t\tas 2M, 16M or 1G.\n");
+	fprintf(stderr,
+		"\t-l <loops>\tCopies per process and point (default 1000).\n");
+	fprintf(stderr,
+		"\t-m <modes>\tWait for completion by poll and/or irq\n"
+		"\t\t\t(default poll,irq), or copy by ioctl through\n"
+		"\t\t\tcxl-memcpy.ko with kernel.\n");
+	fprintf(stderr,
+		"\t-N <policy>\tPlace the processes and their memory: local\n"
+		"\t\t\t(to the card's NUMA node), interleave (over\n"
+		"\t\t\tthe nodes) or a CPU list such as 0-3,8.\n");
+	fprintf(stderr,
+		"\t-p <procs>\tNumbers of processes (default 1,2,4).\n");
+	fprintf(stderr,
+		"\t-s <sizes>\tCopy sizes, with a K, M or G suffix\n"
+		"\t\t\t(default 128,1K,4K,32K, 128 for MemCpy 2.0 AFU).\n");
+	fprintf(stderr, "Lists are comma separated, each point of\n"
+			"sizes x depths x procs x modes is measured,\n"
+			"kernel ones at depth 1 only.\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_shared *sh;
+	pthread_barrierattr_t attr;
+	struct bench_point pt;
+	int c, i, j, npoints, max_procs, status, sizes_set = 0, rc = 0;
+	pid_t pids[BENCH_MAX_PROCS];
+	size_t max_size;
+	char *results = NULL;
+
+	parse_list(&sizes, "128,1K,4K,32K", 0);
+	parse_list(&depths, "1,8,64", 0);
+	parse_list(&procs, "1,2,4", 0);
+	parse_list(&modes, "poll,irq", 1);
+
+	while ((c = getopt(argc, argv, "c:d:e:F:hH:l:m:N:p:s:")) != -1) {
+		switch (c) {
+		case 'c':
+			card = atoi(optarg);
+			break;
+		case 'd':
+			if (parse_list(&depths, optarg, 0))
+				usage();
+			break;
+		case 'e':
+			completion_timeout = atoi(optarg);
+			break;
+		case 'F':
+			results = optarg;
+			break;
+		case 'H':
+			if (memcpy_set_pages(optarg))
+				usage();
+			break;
+		case 'N':
+			if (placement_parse(optarg))
+				usage();
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			if (loops < 1)
+				usage();
+			break;
+		case 'm':
+			if (parse_list(&modes, optarg, 1))
+				usage();
+			break;
+		case 'p':
+			if (parse_list(&procs, optarg, 0))
+				usage();
+			break;
+		case 's':
+			if (parse_list(&sizes, optarg, 0))
+				usage();
+			sizes_set = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argv[optind]) {
+		fprintf(stderr,
+			"Error: Unexpected argument '%s'\n", argv[optind]);
+		usage();
+	}
+
+	if (get_caia_major())
+		return 1;
+	max_size = caia_major == 2 ? 128 : MEMCPY_WE_MAX_LENGTH;
+	if (!user_modes())
+		max_size = 1UL << 30;	/* the module splits larger copies */
+	if (caia_major == 2 && !sizes_set)
+		parse_list(&sizes, "128", 0);	/* MemCpy AFU v2 restriction */
+	for (i = 0; i < sizes.count; i++) {
+		if (sizes.values[i] > max_size) {
+			fprintf(stderr, "Error: Copy size %zu above %zu\n",
+				sizes.values[i], max_size);
+			return 1;
+		}
+	}
+	/* The deepest batch and its interrupt must fit in the queue */
+	if (list_max(&depths) + 1 >= memcpy_queue_length(QUEUE_SIZE)) {
+		fprintf(stderr, "Error: Depths must be below %d\n",
+			memcpy_queue_length(QUEUE_SIZE) - 1);
+		return 1;
+	}
+	max_procs = list_max(&procs);
+	if (max_procs > BENCH_MAX_PROCS) {
+		fprintf(stderr, "Error: At most %d processes\n",
+			BENCH_MAX_PROCS);
+		return 1;
+	}
+	if (clear_stop_on_inv_cmd())
+		return 1;
+	if (placement_init(card))
+		return 1;
+	if (results) {
+		if (results_open(results, "memcpy_afu_bench"))
+			return 1;
+		results_config("loops", "%d", loops);
+		results_config("completion_timeout", "%d", completion_timeout);
+		results_config("pages", "%s", memcpy_pages_name());
+		results_config("placement", "%s", placement_name());
+		results_run(card);
+	}
+
+	sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sh == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&sh->barrier, &attr, max_procs + 1);
+	pthread_barrierattr_destroy(&attr);
+
+	printf("# card%d CAIA %ld, %d copies per process and point, %s pages\n",
+	       card, caia_major, loops, memcpy_pages_name());
+	printf("# Placement: %s\n", placement_name());
+	fflush(stdout);
+	for (i = 0; i < max_procs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			perror("fork");
+			/* The others wait on a barrier sized for all of them */
+			for (j = 0; j < i; j++)
+				kill(pids[j], SIGKILL);
+			for (j = 0; j < i; j++)
+				wait(NULL);
+			return 1;
+		}
+		if (!pids[i])
+			worker(sh, i);
+	}
+
+	/* Wait for all contexts to be attached */
+	pthread_barrier_wait(&sh->barrier);
+	for (i = 0; i < max_procs; i++)
+		rc |= sh->result[i].error;
+
+	printf("# %6s %6s %6s %5s %8s %10s %9s %10s %8s %8s %8s\n",
+	       "size", "depth", "procs", "mode", "copies", "time(uS)", "MB/s",
+	       "copies/s", "p50(uS)", "p99(uS)", "p999(uS)");
+	/* Sizes vary fastest, process counts slowest */
+	npoints = sizes.count * depths.count * modes.count * procs.count;
+	for (i = 0; !rc && i < npoints; i++) {
+		j = i;
+		pt.size = sizes.values[j % sizes.count];
+		j /= sizes.count;
+		pt.depth = depths.values[j % depths.count];
+		j /= depths.count;
+		pt.mode = modes.values[j % modes.count];
+		pt.procs = procs.values[j / modes.count];
+		/* Kernel copies are synchronous: once, at depth 1 */
+		if (pt.mode == BENCH_KERNEL) {
+			if (pt.depth != depths.values[0])
+				continue;
+			pt.depth = 1;
+		}
+		rc = bench_point(sh, &pt);
+	}
+
+	sh->quit = 1;
+	pthread_barrier_wait(&sh->barrier);
+	for (i = 0; i < max_procs; i++) {
+		wait(&status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			rc = 1;
+	}
+	if (rc)
+		printf("# Benchmark failed\n");
+	results_close(rc);
+	return rc;
+}
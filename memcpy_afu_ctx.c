@@ -31,6 +31,7 @@
 #include <poll.h>
 #include <endian.h>
 #include <getopt.h>
+#include <time.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/mman.h>
@@ -39,6 +40,12 @@
 #include <libcxl.h>
 #include "cxl-memcpy.h"
 #include "memcpy_afu.h"
+#include "latency.h"
+#include "timebase.h"
+#include "results.h"
+#include "placement.h"
+#include "pattern.h"
+#include "verify.h"
 
 #define CACHELINESIZE	128
 
@@ -50,6 +57,7 @@
 #define ERR_MEMCMP	0x4
 #define ERR_INCR	0x8
 #define ERR_ATOMIC_CAS	0x9
+#define ERR_WESTATUS	0x10	/* raw bits decoded by decode_we_status() */
 
 /* Default amount of time to wait (in seconds) for a test to complete */
 #define KILL_TIMEOUT	5
@@ -68,6 +76,12 @@ struct memcpy_test_args {
 	int processes;
 	int loops;
 	int buflen;
+	int batch;
+	int window;
+	int segments;
+	size_t large_size;
+	int src_offset;
+	int dst_offset;
 	int irq;
 	int irq_count;
 	int stop_flag;
@@ -75,11 +89,25 @@ struct memcpy_test_args {
 	int increment_flag;
 	int atomic_cas_flag;
 	int kernel_flag;
+	int zero_copy_flag;
 	int prefault_flag;
 	int realloc_flag;
 	int card;
 	int completion_timeout;
 	long int caia_major;
+	struct pattern pattern;	/* source data, one stream per buffer */
+	int index;		/* of this process, keys its streams */
+	struct lat_hist *hist;	/* latency of each loop of this process */
+	__u64 *status_errors;	/* work elements failed, per status bit */
+};
+
+/* What each process reports to its parent, in a shared mapping */
+struct proc_stats {
+	struct lat_hist hist;
+	__u64 status_errors[RESULTS_STATUS_BITS];
+	__u64 start;
+	__u64 end;
+	pid_t pid;
 };
 
 static int skip_process_element(struct memcpy_test_args *args, int pe)
@@ -163,35 +191,6 @@ err:
 	return rc;
 }
 
-#define CFG_TB_TICKS_PER_SEC 0x38
-
-__u64 read_tb_ticks_per_sec()
-{
-	int fd;
-	__u64 tb_ticks_per_sec;
-
-	if ((fd = open("/proc/powerpc/systemcfg", O_RDONLY)) == -1) {
-		perror("Unable to open /proc/powerpc/systemcfg");
-		exit(1);
-	}
-	if (lseek(fd, CFG_TB_TICKS_PER_SEC, SEEK_SET) == -1) {
-		perror("lseek");
-		exit(1);
-	}
-	if (read(fd, &tb_ticks_per_sec, sizeof(tb_ticks_per_sec)) == -1) {
-		perror("read");
-		exit(1);
-	}
-	close(fd);
-	return tb_ticks_per_sec;
-}
-
-#define SPRN_TBRL 0x10C
-#define mftb() ({ \
-	unsigned long rval; \
-	asm volatile("mfspr %0,%1" : "=r" (rval) : "i" (SPRN_TBRL)); rval; \
-	})
-
 int test_afu_timebase(struct cxl_afu_h *afu_h, int count, __u64 ticks_per_sec)
 {
 	int i, j;
@@ -218,7 +217,7 @@ int test_afu_timebase(struct cxl_afu_h *afu_h, int count, __u64 ticks_per_sec)
 		} while (!afu_tb);
 
 		/* Read the core timebase, compare */
-		delta = mftb() - afu_tb;
+		delta = tb_now() - afu_tb;
 		if (delta < 0)
 			delta = -delta;
 		delta = (delta * 1000000) / ticks_per_sec;
@@ -232,7 +231,8 @@ int test_afu_timebase(struct cxl_afu_h *afu_h, int count, __u64 ticks_per_sec)
 	return 0;
 }
 
-static void decode_we_status(int ret) {
+static void decode_we_status(struct memcpy_test_args *args, int ret) {
+	results_count_status(args->status_errors, ret);
 	if (ret & MEMCPY_WE_STAT_TRANS_FAULT)
 		fprintf(stderr, "Error: Translation Fault \"Continue\"\n");
 	if (ret & MEMCPY_WE_STAT_AERROR)
@@ -249,83 +249,501 @@ static void decode_we_status(int ret) {
 		fprintf(stderr, "Error: Undefined Cmd or CAS_INV response\n");
 }
 
+/* ERR_MEMCMP, with a summary of the bad lines, if dst differs from src */
+static int verify_copy(const char *dst, const char *src, size_t size)
+{
+	struct verify_result res;
+
+	if (!verify_buffers(&res, dst, src, size))
+		return 0;
+	verify_print("# ", &res);
+	verify_free(&res);
+	return ERR_MEMCMP;
+}
+
+/*
+ * Waits for the AFU interrupt raised by an interrupt work element, then
+ * restarts the AFU, which stops after the interrupt.
+ */
+static int wait_afu_irq(struct cxl_afu_h *afu_h, int irq, int loop, int pe)
+{
+	struct cxl_event event;
+	struct timeval timeout;
+	int afu_fd = cxl_afu_fd(afu_h), ret = 0;
+	__u64 status;
+	fd_set set;
+
+	FD_ZERO(&set);
+	FD_SET(afu_fd, &set);
+	/* Set timeout to 1 second */
+	timeout.tv_sec = 1;
+	timeout.tv_usec = 0;
+	if (select(afu_fd+1, &set, NULL, NULL, &timeout) <= 0) {
+		printf("#\tTimeout waiting for interrupt! loop: %i pe: %i\n", loop, pe);
+		ret |= ERR_IRQTIMEOUT;
+	} else {
+		if (cxl_read_expected_event(afu_h, &event,
+					    CXL_EVENT_AFU_INTERRUPT, irq)) {
+			printf("# Failed reading expected event\n");
+			ret |= ERR_EVENTFAIL;
+		}
+	}
+	do {
+		/* Make sure AFU is waiting on restart */
+		cxl_mmio_read64(afu_h, MEMCPY_PS_REG_STATUS, &status);
+	} while (!(status & MEMCPY_PS_REG_STATUS_Stopped));
+	/* do restart */
+	cxl_mmio_write64(afu_h, MEMCPY_PS_REG_PCTRL,
+			 MEMCPY_PS_REG_PCTRL_Restart);
+	return ret;
+}
+
+/*
+ * One copy through cxl-memcpy.ko: write() to and read() back from its
+ * bounce buffer, or with -Z an ioctl copying between our own buffers.
+ */
+static int kernel_copy(int fd, char *src, char *dst, size_t size,
+		       struct memcpy_test_args *args)
+{
+	struct cxl_memcpy_ioctl_copy copy = {
+		.src = (uintptr_t)src,
+		.dst = (uintptr_t)dst,
+		.size = size,
+	};
+	int n;
+
+	if (args->zero_copy_flag) {
+		if (ioctl(fd, CXL_MEMCPY_IOCTL_COPY, &copy)) {
+			perror("ioctl CXL_MEMCPY_IOCTL_COPY");
+			return 1;
+		}
+		return 0;
+	}
+	if (lseek(fd, 0, SEEK_SET)) {
+		perror("lseek");
+		return 1;
+	}
+	n = write(fd, src, size);
+	if (n != size) {
+		perror("can't write buffer");
+		return 1;
+	}
+	if (lseek(fd, 0, SEEK_SET)) {
+		perror("lseek");
+		return 1;
+	}
+	n = read(fd, dst, size);
+	if (n != size) {
+		perror("can't read buffer");
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * With -K -Z -b, batch copies between distinct buffers in a single
+ * ioctl, which sets the status of each.
+ */
+static int kernel_copy_batch(int fd, struct cxl_memcpy_ioctl_desc *descs,
+			     int n)
+{
+	struct cxl_memcpy_ioctl_batch batch = {
+		.descs = (uintptr_t)descs,
+		.count = n,
+	};
+	int k, ret = 0;
+
+	if (ioctl(fd, CXL_MEMCPY_IOCTL_COPY_BATCH, &batch)) {
+		perror("ioctl CXL_MEMCPY_IOCTL_COPY_BATCH");
+		return 1;
+	}
+	for (k = 0; k < n; k++) {
+		if (descs[k].status) {
+			fprintf(stderr, "Copy %d of the batch: %s\n", k,
+				strerror(-descs[k].status));
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
 int test_afu_memcpy_kernel(char *src, char *dst, size_t size, int count,
 		    struct memcpy_test_args *args)
 {
-	pid_t pid;
-	int fd, i, n, ret = 0, t;
-	struct timeval start, end;
+	struct cxl_memcpy_ioctl_desc *descs = NULL;
+	int n = args->batch;
+	size_t stride = size;
+	int fd, i, k, ret = 0;
+	__u64 start, tb;
+	double t;
 
-	pid = getpid();
         fd = open("/dev/cxlmemcpy", O_RDWR | O_CLOEXEC);
         if (fd < 0) {
                 perror("Unable to open /dev/cxlmemcpy device");
                 return 1;
         }
 
-	/* Initialise source buffer with unique(ish) per-process value */
-	for (i = 0; i < size; i++)
-		*(src + i) = pid & 0xff;
-
-	gettimeofday(&start, NULL);
-
-	for (i = 0; i < count; i++) {
-		if (lseek(fd, 0, SEEK_SET)) {
-			perror("lseek");
+	/* A batch copies between buffers of its own, cacheline apart */
+	if (n > 1) {
+		stride = (size + CACHELINESIZE - 1) & ~(CACHELINESIZE - 1);
+		src = memcpy_alloc(n * stride);
+		dst = memcpy_alloc(n * stride);
+		descs = calloc(n, sizeof(*descs));
+		if (src == NULL || dst == NULL || descs == NULL) {
+			fprintf(stderr, "Out of memory\n");
 			ret = 1;
 			goto err;
 		}
-		n = write(fd, src, size);
-		if (n != size) {
-			perror("can't write buffer");
-			ret = 1;
-			goto err;
-		}
-		if (lseek(fd, 0, SEEK_SET)) {
-			perror("lseek");
-			ret = 1;
-			goto err;
+		memset(dst, 0, n * stride);
+		for (k = 0; k < n; k++) {
+			descs[k].src = (uintptr_t)(src + k * stride);
+			descs[k].dst = (uintptr_t)(dst + k * stride);
+			descs[k].size = size;
 		}
-		n = read(fd, dst, size);
-		if (n != size) {
-			perror("can't read buffer");
-			ret = 1;
+	}
+
+	/* Initialise source buffers with this process' pattern streams */
+	if (n > 1)
+		for (k = 0; k < n; k++)
+			pattern_fill(&args->pattern, src + k * stride, size,
+				     ((__u64)args->index << 32) | k);
+	else
+		pattern_fill(&args->pattern, src, size, args->index);
+
+	start = tb_now();
+
+	for (i = 0; i < count; i++) {
+		tb = tb_now();
+		if (n > 1)
+			ret = kernel_copy_batch(fd, descs, n);
+		else
+			ret = kernel_copy(fd, src, dst, size, args);
+		if (ret)
 			goto err;
+		lat_hist_record(args->hist, tb_now() - tb);
+		for (k = 0; k < n; k++) {
+			ret |= verify_copy(dst + k * stride, src + k * stride,
+					   size);
+			memset(dst + k * stride, 0, size);
 		}
-		ret |= memcmp(dst, src, size) == 0 ? 0 : ERR_MEMCMP;
 		if (ret) {
 			printf("Error on loop %d\n", i);
 			break;
 		}
-		memset(dst, 0, size);
 	}
 
-	gettimeofday(&end, NULL);
-	t = (end.tv_sec - start.tv_sec)*1000000 + end.tv_usec - start.tv_usec;
-	printf("%d loops in %d uS (%0.2f uS per loop)\n", count, t, ((float) t)/count);
+	t = tb_to_us(tb_now() - start);
+	printf("%d loops in %0.0f uS (%0.2f uS per loop)\n", count, t, t/count);
+	if (n > 1)
+		printf("# %d copies in batches of %d (%0.2f uS per copy)\n",
+		       count * n, n, t / (count * n));
+	lat_hist_print(args->hist, "# ", tb_to_ns(1));
 err:
+	if (n > 1) {
+		memcpy_free(src, n * stride);
+		memcpy_free(dst, n * stride);
+		free(descs);
+	}
 	close(fd);
 	return ret;
 }
 
+/*
+ * Keeps up to args->window copies in flight, each between its own pair of
+ * buffers, and reaps them in order.  Reports the throughput and the latency
+ * of each copy, from queueing to completion being seen.  The clock stops
+ * while a reaped copy is verified.
+ */
+static int test_afu_memcpy_window(struct memcpy_weq *weq, size_t size,
+				  int count, struct memcpy_test_args *args)
+{
+	struct memcpy_async as;
+	__u64 *submit_tb, tb, start, verify_ticks = 0;
+	size_t stride = (size + CACHELINESIZE - 1) & ~(CACHELINESIZE - 1);
+	int depth = args->window;
+	int issued = 0, reaped = 0, k, ret = 0;
+	int *tickets;
+	char *src, *dst;
+	double t;
+
+	if (memcpy_async_init(&as, weq, depth)) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	src = memcpy_alloc(depth * stride);
+	dst = memcpy_alloc(depth * stride);
+	tickets = calloc(depth, sizeof(*tickets));
+	submit_tb = calloc(depth, sizeof(*submit_tb));
+	if (!src || !dst || !tickets || !submit_tb) {
+		fprintf(stderr, "Out of memory\n");
+		ret = 1;
+		goto out;
+	}
+	for (k = 0; k < depth; k++)
+		pattern_fill(&args->pattern, src + k * stride, size,
+			     ((__u64)args->index << 32) | k);
+	memset(dst, 0, depth * stride);
+
+	start = tb_now();
+	while (reaped < count) {
+		/* Fill the window, buffer pair k is free once reaped */
+		while (issued < count && issued - reaped < depth) {
+			k = issued % depth;
+			submit_tb[k] = tb_now();
+			tickets[k] = memcpy_async_copy(&as, dst + k * stride,
+						       src + k * stride, size);
+			if (tickets[k] < 0) {
+				printf("# Timeout waiting for a queue slot\n");
+				ret = 1;
+				goto out;
+			}
+			issued++;
+		}
+
+		/* Reap the oldest copy */
+		k = reaped % depth;
+		ret = memcpy_async_wait(&as, tickets[k],
+					args->completion_timeout * 1000000L);
+		tb = tb_now();
+		if (ret == -ETIMEDOUT) {
+			printf("# Timeout polling for completion\n");
+			ret = 1;
+			goto out;
+		}
+		if (ret) {
+			decode_we_status(args, ret);
+			printf("# Error on loop %d\n", reaped);
+			ret = ERR_WESTATUS;
+			goto out;
+		}
+		lat_hist_record(args->hist, tb - submit_tb[k]);
+		ret = verify_copy(dst + k * stride, src + k * stride, size);
+		if (ret) {
+			printf("# Error on loop %d\n", reaped);
+			goto out;
+		}
+		memset(dst + k * stride, 0, size);
+		verify_ticks += tb_now() - tb;
+		reaped++;
+	}
+	t = tb_to_us(tb_now() - start - verify_ticks);
+
+	printf("# %d copies of %zu bytes, window %d, in %0.0f uS (%0.3f GB/s)\n",
+	       count, size, depth, t, t ? ((double)count * size) / t / 1000 : 0);
+	lat_hist_print(args->hist, "# ", tb_to_ns(1));
+out:
+	memcpy_free(src, depth * stride);
+	memcpy_free(dst, depth * stride);
+	free(tickets);
+	free(submit_tb);
+	memcpy_async_free(&as);
+	return ret;
+}
+
+/*
+ * Copies args->large_size bytes, from and to the given offsets in page
+ * aligned buffers, with memcpy_copy().  The CPU copies the unaligned head
+ * and tail while the AFU copies the body.
+ */
+static int test_afu_memcpy_large(struct memcpy_weq *weq, int count,
+				 struct memcpy_test_args *args)
+{
+	size_t size = args->large_size, max_length, map_len, cpu_bytes;
+	char *src_map, *dst_map, *src, *dst;
+	__u64 tb, lat, ticks = 0;
+	int n, ret = 0;
+	double t;
+
+	max_length = (args->caia_major == 2) ? CACHELINESIZE :
+		MEMCPY_WE_MAX_LENGTH;
+	map_len = size + getpagesize();
+	src_map = memcpy_alloc(map_len);
+	dst_map = memcpy_alloc(map_len);
+	if (!src_map || !dst_map) {
+		fprintf(stderr, "mmap failed for %zu byte buffers\n", map_len);
+		ret = 1;
+		goto out;
+	}
+	src = src_map + args->src_offset;
+	dst = dst_map + args->dst_offset;
+	pattern_fill(&args->pattern, src, size, args->index);
+
+	for (n = 0; n < count; n++) {
+		memset(dst, 0, size);
+		tb = tb_now();
+		ret = memcpy_copy(weq, dst, src, size, max_length,
+				  args->completion_timeout * 1000000L);
+		lat = tb_now() - tb;
+		lat_hist_record(args->hist, lat);
+		ticks += lat;
+		if (ret == -ETIMEDOUT) {
+			printf("# Timeout polling for completion\n");
+			ret = 1;
+			goto out;
+		}
+		if (ret) {
+			decode_we_status(args, ret);
+			printf("# Error on loop %d\n", n);
+			ret = ERR_WESTATUS;
+			goto out;
+		}
+		ret = verify_copy(dst, src, size);
+		if (ret) {
+			printf("# Error on loop %d\n", n);
+			goto out;
+		}
+	}
+
+	t = tb_to_us(ticks);
+	printf("# %d copies of %zu bytes (src+%d dst+%d) in %0.0f uS"
+	       " (%0.3f GB/s)\n", count, size, args->src_offset,
+	       args->dst_offset, t, t ? ((double)count * size) / t / 1000 : 0);
+	printf("# Work elements of up to %zu bytes\n", max_length);
+	cpu_bytes = memcpy_copy_cpu_bytes(dst, src, size);
+	if (cpu_bytes == size)
+		printf("# src and dst not cacheline aligned together: all"
+		       " copied by the CPU, not the AFU\n");
+	else
+		printf("# %zu bytes per copy by the CPU (unaligned head and"
+		       " tail)\n", cpu_bytes);
+	lat_hist_print(args->hist, "# ", tb_to_ns(1));
+out:
+	memcpy_free(src_map, map_len);
+	memcpy_free(dst_map, map_len);
+	return ret;
+}
+
+/*
+ * Waits for the last element of a scatter-gather copy.  A timeout returns
+ * 1 and an error status, decoded here, ERR_WESTATUS.
+ */
+static int wait_sg(struct memcpy_weq *weq, struct memcpy_work_element *last,
+		   struct memcpy_test_args *args)
+{
+	int status;
+
+	status = memcpy_wait_sg(weq, last,
+				args->completion_timeout * 1000000L);
+	if (status == -ETIMEDOUT) {
+		printf("# Timeout polling for completion\n");
+		return 1;
+	}
+	if (status) {
+		decode_we_status(args, status);
+		return ERR_WESTATUS;
+	}
+	return 0;
+}
+
+/*
+ * Copies args->segments discontiguous segments of size bytes per request,
+ * as one scatter-gather request, then as one copy per segment, each
+ * waited for.  Reports the time per request of both.
+ */
+static int test_afu_memcpy_sg(struct cxl_afu_h *afu_h, struct memcpy_weq *weq,
+			      size_t size, int count,
+			      struct memcpy_test_args *args, int pe)
+{
+	struct memcpy_work_element memcpy_we, *last;
+	struct memcpy_iovec *iov;
+	/* leave a cacheline between segments */
+	size_t stride = ((size + CACHELINESIZE - 1) & ~(CACHELINESIZE - 1)) +
+		CACHELINESIZE;
+	int nseg = args->segments, i, k, ret = 0;
+	__u64 tb, tb_sg = 0, tb_one = 0;
+	char *src, *dst;
+
+	src = memcpy_alloc(nseg * stride);
+	dst = memcpy_alloc(nseg * stride);
+	iov = calloc(nseg, sizeof(*iov));
+	if (!src || !dst || !iov) {
+		fprintf(stderr, "Out of memory\n");
+		ret = 1;
+		goto out;
+	}
+	for (k = 0; k < nseg; k++) {
+		pattern_fill(&args->pattern, src + k * stride, size,
+			     ((__u64)args->index << 32) | k);
+		iov[k].src = src + k * stride;
+		iov[k].dst = dst + k * stride;
+		iov[k].len = size;
+	}
+
+	memset(&memcpy_we, 0, sizeof(memcpy_we));
+	memcpy_we.cmd = MEMCPY_WE_CMD(1, MEMCPY_WE_CMD_COPY);
+	memcpy_we.length = htobe16((uint16_t)size);
+
+	for (i = 0; i < count && !ret; i++) {
+		memset(dst, 0, nseg * stride);
+		tb = tb_now();
+		last = memcpy_add_we_sg(weq, iov, nseg, args->irq);
+		if (last == NULL) {
+			perror("memcpy_add_we_sg");
+			ret = 1;
+			break;
+		}
+		if (args->irq)
+			ret = wait_afu_irq(afu_h, args->irq, i, pe);
+		if (!ret)
+			ret = wait_sg(weq, last, args);
+		lat_hist_record(args->hist, tb_now() - tb);
+		tb_sg += tb_now() - tb;
+		for (k = 0; k < nseg && !ret; k++)
+			ret = verify_copy(iov[k].dst, iov[k].src, size);
+
+		memset(dst, 0, nseg * stride);
+		tb = tb_now();
+		for (k = 0; k < nseg && !ret; k++) {
+			memcpy_we.src = htobe64((uintptr_t)iov[k].src);
+			memcpy_we.dst = htobe64((uintptr_t)iov[k].dst);
+			last = memcpy_add_we(weq, memcpy_we);
+			if (last == NULL) {
+				perror("memcpy_add_we");
+				ret = 1;
+				break;
+			}
+			ret = wait_sg(weq, last, args);
+		}
+		tb_one += tb_now() - tb;
+		for (k = 0; k < nseg && !ret; k++)
+			ret = verify_copy(iov[k].dst, iov[k].src, size);
+		if (ret)
+			printf("# Error on loop %d\n", i);
+	}
+	if (ret)
+		goto out;
+
+	printf("# %d requests of %d segments of %zu bytes\n", count, nseg,
+	       size);
+	printf("# scatter-gather: %0.2f uS per request\n",
+	       tb_to_us(tb_sg) / count);
+	printf("# one by one:     %0.2f uS per request\n",
+	       tb_to_us(tb_one) / count);
+	lat_hist_print(args->hist, "# scatter-gather ", tb_to_ns(1));
+out:
+	memcpy_free(src, nseg * stride);
+	memcpy_free(dst, nseg * stride);
+	free(iov);
+	return ret;
+}
+
 int test_afu_memcpy(char *src, char *dst, size_t size, int count,
 		    struct memcpy_test_args *args)
 {
 	struct cxl_afu_h *afu_h;
 	struct cxl_ioctl_start_work *work;
-	__u64 wed, status, process_handle_memcpy;
+	__u64 wed, process_handle_memcpy, tb;
 
 	int process_handle_ioctl;
 	pid_t pid;
-	int afu_fd, fd = 0, i, ret = 0, t;
+	int fd = 0, i, j, n, ret = 0;
 	struct memcpy_weq weq;
 	struct memcpy_work_element memcpy_we, irq_we, *queued_we;
-	struct memcpy_work_element increment_we, atomic_cas_we;
-	struct cxl_event event;
-	struct timeval timeout;
-	struct timeval start, end, temp;
+	struct memcpy_work_element increment_we, atomic_cas_we, *we;
+	struct memcpy_work_element *batch_we = NULL, **batch_queued = NULL;
+	__u64 start, deadline;
 	struct cxl_memcpy_ioctl_handle_fault bufd;
-	fd_set set;
+	double t;
 	char *cxldev;
 
 	pid = getpid();
@@ -345,14 +763,23 @@ int test_afu_memcpy(char *src, char *dst, size_t size, int count,
 		process_handle_ioctl = cxl_afu_get_process_element(afu_h);
 	} while (skip_process_element(args, process_handle_ioctl));
 
-	afu_fd = cxl_afu_fd(afu_h);
-	memcpy_init_weq(&weq, QUEUE_SIZE);
+	if (memcpy_init_weq(&weq, QUEUE_SIZE)) {
+		perror("Unable to allocate the work element queue");
+		ret = 1;
+		goto err2;
+	}
+	weq.timeout_us = args->completion_timeout * 1000000L;
 
 	/* Point the work element descriptor (wed) at the weq */
 	wed = MEMCPY_WED(weq.queue, QUEUE_SIZE/CACHELINESIZE);
 	printf("# WED = 0x%llx for PID = %d via PE = %d\n",
                (unsigned long long)wed, pid, process_handle_ioctl);
 
+	memset(&atomic_cas_we, 0, sizeof(atomic_cas_we));
+	memset(&increment_we, 0, sizeof(increment_we));
+	memset(&memcpy_we, 0, sizeof(memcpy_we));
+	memset(&irq_we, 0, sizeof(irq_we));
+
 	/* Setup the atomic compare and swap work element */
 	atomic_cas_we.cmd = MEMCPY_WE_CMD(0, MEMCPY_WE_CMD_ATOMIC);
 	atomic_cas_we.status = 0;
@@ -416,7 +843,7 @@ int test_afu_memcpy(char *src, char *dst, size_t size, int count,
 		goto err2;
 	}
 	if (args->timebase_flag)
-		return test_afu_timebase(afu_h, count, read_tb_ticks_per_sec());
+		return test_afu_timebase(afu_h, count, tb_ticks_per_sec());
 
 	if (cxl_mmio_read64(afu_h, MEMCPY_PS_REG_PH, &process_handle_memcpy) == -1) {
 		perror("Unable to read mmaped space");
@@ -433,19 +860,41 @@ int test_afu_memcpy(char *src, char *dst, size_t size, int count,
 	}
 	assert(process_handle_memcpy == process_handle_ioctl);
 
-	/* Initialise source buffer with unique(ish) per-process value */
+	/* Initialise source buffer with this process' pattern stream */
 	if (args->atomic_cas_flag) {
 		memset(dst, 0, size);
 	} else if (args->increment_flag) {
 		*(pid_t *)src = htobe32(pid - 1);
 	} else {
-		for (i = 0; i < size; i++)
-			*(src + i) = pid & 0xff;
+		pattern_fill(&args->pattern, src, size, args->index);
 	}
 
-	FD_ZERO(&set);
-	FD_SET(afu_fd, &set);
-	gettimeofday(&start, NULL);
+	if (args->window) {
+		ret = test_afu_memcpy_window(&weq, size, count, args);
+		goto err2;
+	}
+	if (args->large_size) {
+		ret = test_afu_memcpy_large(&weq, count, args);
+		goto err2;
+	}
+	if (args->segments) {
+		ret = test_afu_memcpy_sg(afu_h, &weq, size, count, args,
+					 process_handle_ioctl);
+		goto err2;
+	}
+
+	/* Room for the batch and its trailing interrupt work element */
+	if (args->batch > 1) {
+		batch_we = calloc(args->batch + 1, sizeof(*batch_we));
+		batch_queued = calloc(args->batch + 1, sizeof(*batch_queued));
+		if (batch_we == NULL || batch_queued == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			ret = 1;
+			goto err2;
+		}
+	}
+
+	start = tb_now();
 	if (args->prefault_flag) {
 		fd = open("/dev/cxlmemcpy", O_RDWR | O_CLOEXEC);
 		if (fd < 0)
@@ -463,15 +912,36 @@ int test_afu_memcpy(char *src, char *dst, size_t size, int count,
 				perror("ioctl CXL_MEMCPY_IOCTL_HANDLE_FAULT");
 		}
 		if (args->atomic_cas_flag) {
-			queued_we = memcpy_add_we(&weq, atomic_cas_we);
+			we = &atomic_cas_we;
 		} else if (args->increment_flag) {
 			*(pid_t *)src = htobe32(be32toh(*(pid_t *)src) + 1);
-			queued_we = memcpy_add_we(&weq, increment_we);
+			we = &increment_we;
 		} else
-			queued_we = memcpy_add_we(&weq, memcpy_we);
-		if (args->irq)
-			memcpy_add_we(&weq, irq_we);
-		queued_we->cmd |= MEMCPY_WE_CMD_VALID;
+			we = &memcpy_we;
+		tb = tb_now();
+		if (args->batch > 1) {
+			/* Same operation batch times, made valid at once */
+			for (n = 0; n < args->batch; n++)
+				batch_we[n] = *we;
+			if (args->irq)
+				batch_we[n++] = irq_we;
+			if (memcpy_add_we_batch(&weq, batch_we, n,
+						batch_queued) == NULL) {
+				perror("memcpy_add_we_batch");
+				ret = 1;
+				break;
+			}
+			queued_we = batch_queued[args->batch - 1];
+		} else {
+			queued_we = memcpy_add_we(&weq, *we);
+			if (queued_we == NULL ||
+			    (args->irq && memcpy_add_we(&weq, irq_we) == NULL)) {
+				perror("memcpy_add_we");
+				ret = 1;
+				break;
+			}
+			queued_we->cmd |= MEMCPY_WE_CMD_VALID;
+		}
 
 		/* If stop flag set, need to restart this CTX in the MCP AFU */
 		if (args->stop_flag)
@@ -481,48 +951,29 @@ int test_afu_memcpy(char *src, char *dst, size_t size, int count,
 				goto err2;
 			}
 
-		if (args->irq) {
-			/* Set timeout to 1 second */
-			timeout.tv_sec = 1;
-			timeout.tv_usec = 0;
-			if (select(afu_fd+1, &set, NULL, NULL, &timeout) <= 0) {
-				printf("#\tTimeout waiting for interrupt! loop: %i pe: %i\n", i, process_handle_ioctl);
-				ret |= ERR_IRQTIMEOUT;
-			} else {
-				if (cxl_read_expected_event(afu_h, &event,
-							    CXL_EVENT_AFU_INTERRUPT, args->irq)) {
-					printf("# Failed reading expected event\n");
-					ret |= ERR_EVENTFAIL;
-				}
-			}
-			do {
-				/* Make sure AFU is waiting on restart */
-				cxl_mmio_read64(afu_h, MEMCPY_PS_REG_STATUS,
-						&status);
-			} while (!(status & MEMCPY_PS_REG_STATUS_Stopped));
-			/* do restart */
-			cxl_mmio_write64(afu_h, MEMCPY_PS_REG_PCTRL,
-					 MEMCPY_PS_REG_PCTRL_Restart);
-		}
+		if (args->irq)
+			ret |= wait_afu_irq(afu_h, args->irq, i,
+					    process_handle_ioctl);
 
 		/* We have to do this even for the interrupt driven case because we need
 		 * to wait for this flag before setting the completion bit. */
-		gettimeofday(&timeout, NULL); /* reuse timeout */
-		temp.tv_sec = args->completion_timeout;
-		temp.tv_usec = 0;
-		timeradd(&timeout, &temp, &timeout);
-		for (;; gettimeofday(&temp, NULL)) {
-			if (timercmp(&temp, &timeout, >)) {
+		deadline = tb_deadline(args->completion_timeout * 1000000ULL);
+		for (;;) {
+			if (tb_expired(deadline)) {
 				printf("# Timeout polling for completion\n");
 				break;
 			}
 
 			if (queued_we->status) {
-				if (ret != MEMCPY_WE_STAT_COMPLETE)
-					decode_we_status(ret);
+				if (queued_we->status != MEMCPY_WE_STAT_COMPLETE) {
+					decode_we_status(args,
+							 queued_we->status);
+					ret |= ERR_WESTATUS;
+				}
 				break;
 			}
 		}
+		lat_hist_record(args->hist, tb_now() - tb);
 		if (args->atomic_cas_flag) {
 			ret |= be64toh((uintptr_t)dst) ? 0 : ERR_ATOMIC_CAS;
 		} else if (args->increment_flag) {
@@ -531,7 +982,7 @@ int test_afu_memcpy(char *src, char *dst, size_t size, int count,
 			ret |= be32toh(*(pid_t *)dst)
 			     - be32toh(*(pid_t *)src) == 1 ? 0 : ERR_INCR;
 		} else {
-			ret |= memcmp(dst, src, size) == 0 ? 0 : ERR_MEMCMP;
+			ret |= verify_copy(dst, src, size);
 		}
 		if (ret) {
 			printf("# Error on loop %d\n", i);
@@ -542,11 +993,9 @@ int test_afu_memcpy(char *src, char *dst, size_t size, int count,
                          * unmap/remap the destination buffer to force a TLBI
                          * and extra memory translation with each loop
                          */
-			munmap(dst, getpagesize());
-			dst = mmap(NULL, getpagesize(),
-				   PROT_READ | PROT_WRITE,
-				   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-			if (dst == MAP_FAILED) {
+			memcpy_free(dst, size);
+			dst = memcpy_alloc(size);
+			if (dst == NULL) {
 				fprintf(stderr,
 					"mmap failed for destination buffer\n");
 				goto err2;
@@ -560,11 +1009,18 @@ int test_afu_memcpy(char *src, char *dst, size_t size, int count,
 		}
 	}
 
-	gettimeofday(&end, NULL);
-	t = (end.tv_sec - start.tv_sec)*1000000 + end.tv_usec - start.tv_usec;
-	printf("# %d loops in %d uS (%0.2f uS per loop)\n", count, t, ((float) t)/count);
+	t = tb_to_us(tb_now() - start);
+	printf("# %d loops in %0.0f uS (%0.2f uS per loop)\n", count, t, t/count);
+	if (args->batch > 1) {
+		j = count * args->batch;
+		printf("# %d work elements in batches of %d (%0.2f uS per work element)\n",
+		       j, args->batch, t/j);
+	}
+	lat_hist_print(args->hist, "# ", tb_to_ns(1));
 
 err2:
+	free(batch_we);
+	free(batch_queued);
 	cxl_afu_free(afu_h);
 err1:
 	free(cxldev);
@@ -603,6 +1059,40 @@ static int get_caia_major(struct memcpy_test_args *args)
 	return 0;
 }
 
+/* Bytes copied by one loop of the test selected by args */
+static size_t bytes_per_loop(struct memcpy_test_args *args, int buflen)
+{
+	if (args->timebase_flag)
+		return 0;
+	if (args->large_size)
+		return args->large_size;
+	if (args->segments)
+		return (size_t)args->segments * buflen;
+	if (args->atomic_cas_flag)
+		return sizeof(__u64);
+	if (args->increment_flag)
+		return sizeof(pid_t);
+	return (size_t)buflen * args->batch;
+}
+
+static void report_process(struct memcpy_test_args *args,
+			   struct proc_stats *st, int buflen, int status)
+{
+	struct results_metrics m = {
+		.scope = "process",
+		.id = st->pid,
+		.ops = st->hist.count,
+		.bytes = st->hist.count * bytes_per_loop(args, buflen),
+		.time_us = tb_to_us(st->end - st->start),
+		.hist = &st->hist,
+		.ns_per_unit = tb_to_ns(1),
+		.error = status,
+	};
+
+	memcpy(m.status_errors, st->status_errors, sizeof(m.status_errors));
+	results_emit(&m);
+}
+
 /* kernel cxl driver dedicates one context to the vPHB */
 #define MAX_PROCESSES (MEMCPY_AFUD_NUM_OF_PROCESSES-1)
 
@@ -612,9 +1102,11 @@ int run_tests(void *argp)
 	int processes = args->processes;
 	int loops = args->loops;
 	int buflen = args->buflen;
-	int i, j;
+	int i, j, cpu, node, rc = 0;
 	char *src, *dst;
 	pid_t pid;
+	struct proc_stats *stats;
+	struct lat_hist total;
 
 	if (get_caia_major(args))
 		return 1;
@@ -634,42 +1126,116 @@ int run_tests(void *argp)
 		if (args->processes == 0)
 			processes--;
 	}
-	/* Allocate memory areas for afu to copy to/from */
 	if (args->caia_major == 2 && buflen > 128)
 		buflen = 128;	/* MemCpy AFU v2 restriction */
-	src = aligned_alloc(CACHELINESIZE, buflen);
-	dst = mmap(NULL, getpagesize(), PROT_READ | PROT_WRITE,
-		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (dst == MAP_FAILED) {
-		fprintf(stderr, "mmap failed for destination buffer\n");
-		return 2;
-	}
 	printf("# Starting %d processes doing %d %s loops\n", processes, loops,
 	       args->atomic_cas_flag ? "atomic compare and swap" :
 	       args->increment_flag ? "increment" : "memcpy");
 	printf("# Queue size: %dkB, Queue length: %d\n", QUEUE_SIZE/1024,
 	       memcpy_queue_length(QUEUE_SIZE));
-	printf("# src: %p dst: %p\n", src, dst);
+	printf("# Pages: %s\n", memcpy_pages_name());
+	printf("# Placement: %s\n", placement_name());
+	printf("# Pattern: %s\n", pattern_name(&args->pattern));
+
+	/* Each process fills its own statistics, merged once they exit */
+	stats = mmap(NULL, processes * sizeof(*stats), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		fprintf(stderr, "mmap failed for latency histograms\n");
+		return 2;
+	}
+	fflush(stdout);
 
 	for (i = 0; i < processes; i++) {
-		if (!fork()) {
+		lat_hist_init(&stats[i].hist);
+		pid = fork();
+		if (!pid) {
 			/* Child process */
+			args->index = i;
+			args->hist = &stats[i].hist;
+			args->status_errors = stats[i].status_errors;
+			if (placement_apply(i, &cpu, &node))
+				exit(2);
+			if (cpu >= 0)
+				printf("# PID %d on cpu %d node %d\n",
+				       getpid(), cpu, node);
+			/*
+			 * Memory areas for afu to copy to/from, allocated
+			 * here: a child faulting in hugetlbfs pages mapped
+			 * by its parent gets SIGBUS if the pool runs dry.
+			 */
+			src = memcpy_alloc(buflen);
+			dst = memcpy_alloc(buflen);
+			if (src == NULL || dst == NULL) {
+				fprintf(stderr, "mmap failed for %d byte"
+					" buffers\n", buflen);
+				exit(2);
+			}
+			stats[i].start = tb_now();
 			if (args->kernel_flag)
-				exit(test_afu_memcpy_kernel(src, dst, buflen,
-				     loops, args));
-			exit(test_afu_memcpy(src, dst, buflen, loops, args));
+				j = test_afu_memcpy_kernel(src, dst, buflen,
+							   loops, args);
+			else
+				j = test_afu_memcpy(src, dst, buflen, loops,
+						    args);
+			stats[i].end = tb_now();
+			exit(j);
 		}
+		stats[i].pid = pid;
 	}
 
 	for (i = 0; i < processes; i++) {
-		pid = wait(&j);
+		pid = waitpid(stats[i].pid, &j, 0);
 		if (pid && j) {
-			printf("# Error copying for PID = %d\n", pid);
-			return 1;
+			printf("# Error copying for PID = %d, process %d\n",
+			       pid, i);
+			rc = 1;
 		}
+		/* The exit code, or 128 + the signal, as shells do */
+		report_process(args, &stats[i], buflen,
+			       WIFEXITED(j) ? WEXITSTATUS(j) :
+			       128 + WTERMSIG(j));
 	}
 
-	return 0;
+	if (!rc && processes > 1) {
+		lat_hist_init(&total);
+		for (i = 0; i < processes; i++)
+			lat_hist_merge(&total, &stats[i].hist);
+		lat_hist_print(&total, "# all processes ",
+			       tb_to_ns(1));
+	}
+	munmap(stats, processes * sizeof(*stats));
+	return rc;
+}
+
+static void results_args(struct memcpy_test_args *args)
+{
+	results_config("test", "%s", args->zero_copy_flag ? "kernel_zero_copy" :
+		       args->kernel_flag ? "kernel" :
+		       args->timebase_flag ? "timebase" :
+		       args->window ? "window" :
+		       args->large_size ? "large" :
+		       args->segments ? "scatter-gather" :
+		       args->atomic_cas_flag ? "atomic_cas" :
+		       args->increment_flag ? "increment" : "memcpy");
+	results_config("processes", "%d", args->processes);
+	results_config("loops", "%d", args->loops);
+	results_config("buflen", "%d", args->buflen);
+	results_config("batch", "%d", args->batch);
+	results_config("window", "%d", args->window);
+	results_config("segments", "%d", args->segments);
+	results_config("large_size", "%zu", args->large_size);
+	results_config("src_offset", "%d", args->src_offset);
+	results_config("dst_offset", "%d", args->dst_offset);
+	results_config("irq", "%d", args->irq);
+	results_config("irq_count", "%d", args->irq_count);
+	results_config("stop", "%d", args->stop_flag);
+	results_config("prefault", "%d", args->prefault_flag);
+	results_config("realloc", "%d", args->realloc_flag);
+	results_config("completion_timeout", "%d", args->completion_timeout);
+	results_config("pages", "%s", memcpy_pages_name());
+	results_config("placement", "%s", placement_name());
+	results_config("pattern", "%s", pattern_type(&args->pattern));
 }
 
 static void usage()
@@ -678,10 +1244,30 @@ static void usage()
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "\t-A\t\tAtomic. Test atomic compare and swap.\n");
 	fprintf(stderr, "\t-a\t\tAdd 1. Test increment.\n");
+	fprintf(stderr,
+		"\t-b <batch>\tQueue this number of work elements per loop\n"
+		"\t\t\twith a single barrier (default 1).  With -K -Z,\n"
+		"\t\t\tcopy this number of buffers per ioctl.\n");
 	fprintf(stderr, "\t-c <card_num>\tUse this CAPI card (default 0).\n");
+	fprintf(stderr,
+		"\t-D <pattern>\tFill the source buffers with random[:seed]\n"
+		"\t\t\t(default), address[:seed] or const:<word> data.\n");
 	fprintf(stderr, "\t-e <timeout>\tEnd timeout.\n"
 			"\t\t\tSeconds to wait for the AFU to signal completion.\n");
+	fprintf(stderr,
+		"\t-F <file>\tAlso write the results to this file, as CSV\n"
+		"\t\t\tfor a .csv suffix, else JSON lines (- for stdout).\n");
+	fprintf(stderr,
+		"\t-g <segments>\tCopy this number of -s sized segments per\n"
+		"\t\t\tscatter-gather request, compare with one by one.\n");
 	fprintf(stderr, "\t-h\t\tDisplay this help text.\n");
+	fprintf(stderr,
+		"\t-H <pages>\tBack the queue and buffers with base (default),\n"
+		"\t\t\tthp, huge or hugetlbfs pages of a size such\n"
+		"\t\t\tas 2M, 16M or 1G.\n");
+	fprintf(stderr,
+		"\t-L <size>\tCopy this number of bytes, with a K, M or G\n"
+		"\t\t\tsuffix, split over work elements.\n");
 	fprintf(stderr,
 	        "\t-I <irq_count>\tDefine this number of interrupts (default 4).\n");
 	fprintf(stderr,
@@ -692,6 +1278,15 @@ static void usage()
 	        "\t-k\t\tUse the Stop_on_Invalid_Command and Restart logic.\n");
 	fprintf(stderr,
 	        "\t-l <loops>\tRun this number of memcpy loops (default 1).\n");
+	fprintf(stderr,
+		"\t-N <policy>\tPlace the processes and their memory: local\n"
+		"\t\t\t(to the card's NUMA node), interleave (over\n"
+		"\t\t\tthe nodes) or a CPU list such as 0-3,8.\n");
+	fprintf(stderr,
+		"\t-o <offset>\tOffset the -L source and destination (default 0).\n");
+	fprintf(stderr,
+		"\t-O <offset>\tOffset the -L destination only (default 0).\n"
+		"\t\t\tIf not a multiple of 128, the CPU does the copy.\n");
 	fprintf(stderr,
 	        "\t-P\t\tPrefault destination buffer (with module cxl-memcpy.ko).\n");
 	fprintf(stderr,
@@ -704,17 +1299,25 @@ static void usage()
 		"\t-s <bufsize>\tCopy this number of bytes (default 1024).\n"
 		"\t\t\tBuffer size limited to 128 for MemCpy 2.0 AFU for PSL9.\n");
 	fprintf(stderr, "\t-t\t\tTimebase. Test timebase sync.\n");
+	fprintf(stderr,
+		"\t-w <depth>\tKeep this number of copies in flight, over\n"
+		"\t\t\tdistinct buffers, and report throughput.\n");
+	fprintf(stderr,
+		"\t-Z\t\tWith -K, have the module copy between our buffers,\n"
+		"\t\t\tof any -s size, instead of through its own.\n");
 	exit(2);
 }
 
 int main(int argc, char *argv[])
 {
 	int c, rc;
-	char *name;
+	char *name, *end, *results = NULL, *pages = NULL, *pattern = "random";
 	struct memcpy_test_args args = {
 		.processes = 1,
 		.loops = 1,
 		.buflen = 1024,
+		.batch = 1,
+		.window = 0,
 		.irq = 0,
 		.irq_count = -1,
 		.stop_flag = 0,
@@ -722,6 +1325,7 @@ int main(int argc, char *argv[])
 		.increment_flag = 0,
 		.atomic_cas_flag = 0,
 		.kernel_flag = 0,
+		.zero_copy_flag = 0,
 		.prefault_flag = 0,
 		.realloc_flag = 0,
 		.card = 0,
@@ -730,7 +1334,7 @@ int main(int argc, char *argv[])
 	};
 
 	while (1) {
-		c = getopt(argc, argv, "+AahKktPp:l:rs:i:I:c:e:");
+		c = getopt(argc, argv, "+Aab:D:F:g:hH:KktN:Pp:l:L:o:O:rs:i:I:c:e:w:Z");
 		if (c < 0)
 			break;
 		switch (c) {
@@ -744,9 +1348,56 @@ int main(int argc, char *argv[])
 		case 'a':
 			args.increment_flag = 1;
 			break;
+		case 'b':
+			args.batch = atoi(optarg);
+			break;
+		case 'w':
+			args.window = atoi(optarg);
+			break;
+		case 'D':
+			pattern = optarg;
+			break;
+		case 'F':
+			results = optarg;
+			break;
+		case 'H':
+			pages = optarg;
+			break;
+		case 'N':
+			if (placement_parse(optarg)) {
+				fprintf(stderr, "Error: Invalid placement"
+					" '%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'g':
+			args.segments = atoi(optarg);
+			if (args.segments < 1) {
+				fprintf(stderr, "Error: -g must be at least 1\n");
+				exit(1);
+			}
+			break;
+		case 'L':
+			args.large_size = memcpy_parse_size(optarg, &end);
+			if (*end || !args.large_size) {
+				fprintf(stderr, "Error: Invalid size '%s'\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'o':
+			args.src_offset = atoi(optarg);
+			args.dst_offset += args.src_offset;
+			break;
+		case 'O':
+			args.dst_offset += atoi(optarg);
+			break;
 		case 'K':
 			args.kernel_flag = 1;
 			break;
+		case 'Z':
+			args.zero_copy_flag = 1;
+			break;
 		case 'P':
 			args.prefault_flag = 1;
 			break;
@@ -794,14 +1445,76 @@ int main(int argc, char *argv[])
 			"Error: Unexpected argument '%s'\n", argv[optind]);
 		usage();
 	}
+	if (args.zero_copy_flag && !args.kernel_flag) {
+		fprintf(stderr, "Error: -Z needs -K\n");
+		exit(1);
+	}
 	if (args.kernel_flag) {
 		if (args.irq || args.timebase_flag || args.stop_flag ||
-		    args.buflen != 1024 || args.irq_count != -1) {
+		    (args.buflen != 1024 && !args.zero_copy_flag) ||
+		    args.irq_count != -1 ||
+		    (args.batch != 1 && !args.zero_copy_flag)) {
+			fprintf(stderr,
+			"Flag -K is incompatible with -I -i -r -t, and -b -s without -Z\n");
+			exit(1);
+		}
+		if (args.batch > CXL_MEMCPY_BATCH_MAX) {
+			fprintf(stderr, "Error: -b must be at most %d with -K\n",
+				CXL_MEMCPY_BATCH_MAX);
+			exit(1);
+		}
+	}
+	/* The batch and its interrupt must fit in the queue */
+	if (args.batch < 1 ||
+	    args.batch + 1 >= memcpy_queue_length(QUEUE_SIZE)) {
+		fprintf(stderr, "Error: -b must be between 1 and %d\n",
+			memcpy_queue_length(QUEUE_SIZE) - 2);
+		exit(1);
+	}
+	if (args.window) {
+		if (args.window < 1 ||
+		    args.window > memcpy_queue_length(QUEUE_SIZE)) {
+			fprintf(stderr, "Error: -w must be between 1 and %d\n",
+				memcpy_queue_length(QUEUE_SIZE));
+			exit(1);
+		}
+		if (args.kernel_flag || args.batch != 1 || args.irq ||
+		    args.stop_flag || args.increment_flag ||
+		    args.atomic_cas_flag || args.realloc_flag ||
+		    args.timebase_flag || args.prefault_flag) {
 			fprintf(stderr,
-			"Flag -K is incompatible with -I -i -r -s -t\n");
+			"Flag -w is incompatible with -A -a -b -i -K -k -P -r -t\n");
 			exit(1);
 		}
 	}
+	if (args.large_size) {
+		if (args.window || args.kernel_flag || args.batch != 1 ||
+		    args.irq || args.stop_flag || args.increment_flag ||
+		    args.atomic_cas_flag || args.realloc_flag ||
+		    args.timebase_flag || args.prefault_flag) {
+			fprintf(stderr,
+			"Flag -L is incompatible with -A -a -b -i -K -k -P -r -t -w\n");
+			exit(1);
+		}
+	}
+	if (args.segments) {
+		if (args.window || args.large_size || args.kernel_flag ||
+		    args.batch != 1 || args.stop_flag ||
+		    args.increment_flag || args.atomic_cas_flag ||
+		    args.realloc_flag || args.timebase_flag ||
+		    args.prefault_flag) {
+			fprintf(stderr,
+			"Flag -g is incompatible with -A -a -b -K -k -L -P -r -t -w\n");
+			exit(1);
+		}
+	}
+	if (args.src_offset < 0 || args.dst_offset < 0 ||
+	    args.src_offset >= getpagesize() ||
+	    args.dst_offset >= getpagesize()) {
+		fprintf(stderr, "Error: -o and -O must be below %d\n",
+			getpagesize());
+		exit(1);
+	}
 	if (args.atomic_cas_flag && args.realloc_flag) {
                 fprintf(stderr, "Error: -A and -r are mutually exclusive\n");
                 exit(1);
@@ -810,10 +1523,27 @@ int main(int argc, char *argv[])
                 fprintf(stderr, "Error: -p0 and -I are mutually exclusive\n");
                 exit(1);
         }
+	if (pattern_parse(&args.pattern, pattern)) {
+		fprintf(stderr, "Error: Invalid pattern '%s'\n", pattern);
+		exit(1);
+	}
+	if (pages && memcpy_set_pages(pages)) {
+		fprintf(stderr, "Error: Invalid pages '%s'\n", pages);
+		exit(1);
+	}
+	if (placement_init(args.card))
+		exit(1);
+	if (results) {
+		if (results_open(results, "memcpy_afu_ctx"))
+			exit(1);
+		results_args(&args);
+		results_run(args.card);
+	}
 	get_name(&name, args.processes, args.loops);
 	printf("1..1\n");
 	printf("# test: %s\n", name);
 	rc = run_tests((void *) &args);
+	results_close(rc);
 	free(name);
 	return rc;
 }
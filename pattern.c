@@ -0,0 +1,149 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <endian.h>
+#include <time.h>
+
+#include "pattern.h"
+
+/*
+ * Four words at a time with the GCC vector extensions: AVX2 or VSX where
+ * the compiler may use them, scalar code otherwise.  On x86, both an AVX2
+ * and a baseline version are built, picked at load time.
+ */
+typedef __u64 pattern_v4 __attribute__((vector_size(32)));
+
+#if defined(__x86_64__)
+#define PATTERN_CLONES	__attribute__((target_clones("avx2", "default")))
+#else
+#define PATTERN_CLONES
+#endif
+
+/* pattern_mix() of each word, in place: no vector ABI concerns */
+static inline void pattern_mix_v4(pattern_v4 *v)
+{
+	pattern_v4 x = *v;
+
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	*v = x ^ (x >> 31);
+}
+
+PATTERN_CLONES
+static void fill_words(const struct pattern *p, __u64 key, char *buf,
+		       size_t nwords)
+{
+	pattern_v4 v, idx = { 0, 1, 2, 3 };
+	size_t i = 0;
+	__u64 w;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	switch (p->type) {
+	case PATTERN_RANDOM:
+		for (; i + 4 <= nwords; i += 4, idx += 4) {
+			v = key + idx * PATTERN_GOLDEN;
+			pattern_mix_v4(&v);
+			memcpy(buf + i * 8, &v, sizeof(v));
+		}
+		break;
+	case PATTERN_ADDRESS:
+		for (; i + 4 <= nwords; i += 4, idx += 4) {
+			v = key ^ (idx * 8);
+			memcpy(buf + i * 8, &v, sizeof(v));
+		}
+		break;
+	default:
+		v = (pattern_v4){ p->seed, p->seed, p->seed, p->seed };
+		for (; i + 4 <= nwords; i += 4)
+			memcpy(buf + i * 8, &v, sizeof(v));
+		break;
+	}
+#endif
+	for (; i < nwords; i++) {
+		w = htole64(pattern_word(p, key, i * 8));
+		memcpy(buf + i * 8, &w, sizeof(w));
+	}
+}
+
+void pattern_fill(const struct pattern *p, void *buf, size_t len,
+		  __u64 stream)
+{
+	__u64 key = pattern_key(p, stream), w;
+	size_t tail = len & 7;
+
+	fill_words(p, key, buf, len / 8);
+	if (tail) {
+		w = htole64(pattern_word(p, key, len - tail));
+		memcpy((char *)buf + len - tail, &w, tail);
+	}
+}
+
+/* "random[:<seed>]", "address[:<seed>]" or "const:<word>" */
+int pattern_parse(struct pattern *p, const char *spec)
+{
+	const char *arg = strchr(spec, ':');
+	size_t len = arg ? arg - spec : strlen(spec);
+	char *end;
+
+	if (len == 6 && !strncmp(spec, "random", len))
+		p->type = PATTERN_RANDOM;
+	else if (len == 7 && !strncmp(spec, "address", len))
+		p->type = PATTERN_ADDRESS;
+	else if (len == 5 && !strncmp(spec, "const", len) && arg)
+		p->type = PATTERN_CONST;
+	else
+		return -1;
+
+	if (arg) {
+		p->seed = strtoull(arg + 1, &end, 0);
+		if (end == arg + 1 || *end)
+			return -1;
+	} else {
+		/* Printed by the tests, to reproduce a run */
+		p->seed = pattern_mix(time(NULL) ^ ((__u64)getpid() << 32));
+	}
+	return 0;
+}
+
+static const char * const pattern_names[] = {
+	[PATTERN_RANDOM] = "random",
+	[PATTERN_ADDRESS] = "address",
+	[PATTERN_CONST] = "const",
+};
+
+/* The spec which reproduces the pattern, e.g. "random:0x1234" */
+const char *pattern_name(const struct pattern *p)
+{
+	static char name[32];
+
+	snprintf(name, sizeof(name), "%s:0x%llx", pattern_names[p->type],
+		 (unsigned long long)p->seed);
+	return name;
+}
+
+/* Just the kind of pattern, which unlike the seed is comparable across runs */
+const char *pattern_type(const struct pattern *p)
+{
+	return pattern_names[p->type];
+}
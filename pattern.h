@@ -0,0 +1,85 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PATTERN_H_
+#define _PATTERN_H_
+
+#include <stddef.h>
+#include <linux/types.h>
+
+/*
+ * Source data patterns, made of 64 bit words:
+ *
+ *  random	word i of a buffer is a hash of (seed, stream, i): a counter
+ *		based generator, so any word can be recomputed on its own,
+ *  address	word i is the byte offset of the word, xored with a tag
+ *		derived from (seed, stream), so that misplaced data tells
+ *		where it came from,
+ *  const	every word is the seed.
+ *
+ * The stream tells copies apart, e.g. a process or thread index and a loop
+ * index: a buffer is reproduced from the seed, printed by the tests, and
+ * its stream.  The words are stored little endian, so a buffer reads the
+ * same on any host.
+ */
+#define PATTERN_RANDOM		0
+#define PATTERN_ADDRESS		1
+#define PATTERN_CONST		2
+
+struct pattern {
+	int type;
+	__u64 seed;
+};
+
+/* The splitmix64 finalizer, a bijective 64 bit mix */
+static inline __u64 pattern_mix(__u64 x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+#define PATTERN_GOLDEN	0x9e3779b97f4a7c15ULL
+
+/* Per buffer key of the random and address patterns */
+static inline __u64 pattern_key(const struct pattern *p, __u64 stream)
+{
+	return pattern_mix(p->seed ^ pattern_mix(stream + PATTERN_GOLDEN));
+}
+
+/* The word at byte offset (a multiple of 8) of a buffer, host order */
+static inline __u64 pattern_word(const struct pattern *p, __u64 key,
+				 size_t offset)
+{
+	switch (p->type) {
+	case PATTERN_RANDOM:
+		return pattern_mix(key + (offset / 8) * PATTERN_GOLDEN);
+	case PATTERN_ADDRESS:
+		return key ^ offset;
+	default:
+		return p->seed;
+	}
+}
+
+int pattern_parse(struct pattern *p, const char *spec);
+void pattern_fill(const struct pattern *p, void *buf, size_t len,
+		  __u64 stream);
+const char *pattern_name(const struct pattern *p);
+const char *pattern_type(const struct pattern *p);
+
+#endif /* _PATTERN_H_ */
@@ -0,0 +1,315 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/syscall.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+
+#include <libcxl.h>
+#include "placement.h"
+
+#define NODE_DIR	"/sys/devices/system/node"
+#define MAX_NODES	1024
+#define MASK_BITS	(8 * sizeof(unsigned long))
+
+enum {
+	PLACE_NONE,
+	PLACE_LOCAL,
+	PLACE_INTERLEAVE,
+	PLACE_CPUS,
+};
+
+static struct {
+	int policy;
+	char *spec;
+	int card_node;
+	int cpus[CPU_SETSIZE];	/* in the order workers are placed on */
+	int ncpus;
+	int cpu_node[CPU_SETSIZE];
+	int nodes[MAX_NODES];	/* online nodes with CPUs */
+	int nnodes;
+	char name[128];
+} place = { .policy = PLACE_NONE, .card_node = -1 };
+
+/* Parses a "0-3,8" list into ids, returns their number or -1 */
+static int parse_list(const char *s, int *ids, int max)
+{
+	unsigned long first, last;
+	char *end;
+	int n = 0;
+
+	while (*s && *s != '\n') {
+		first = strtoul(s, &end, 10);
+		if (end == s)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			s = end + 1;
+			last = strtoul(s, &end, 10);
+			if (end == s || last < first)
+				return -1;
+		}
+		for (; first <= last; first++) {
+			if (n == max)
+				return -1;
+			ids[n++] = first;
+		}
+		s = end;
+		if (*s == ',')
+			s++;
+		else if (*s && *s != '\n')
+			return -1;
+	}
+	return n;
+}
+
+static int read_list(const char *path, int *ids, int max)
+{
+	char buf[4096];
+	FILE *f;
+	int n = -1;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	if (fgets(buf, sizeof(buf), f))
+		n = parse_list(buf, ids, max);
+	fclose(f);
+	return n;
+}
+
+int placement_parse(const char *spec)
+{
+	free(place.spec);
+	place.spec = strdup(spec);
+	if (!strcmp(spec, "local"))
+		place.policy = PLACE_LOCAL;
+	else if (!strcmp(spec, "interleave"))
+		place.policy = PLACE_INTERLEAVE;
+	else if (parse_list(spec, place.cpus, CPU_SETSIZE) > 0)
+		place.policy = PLACE_CPUS;
+	else
+		return -1;
+	return 0;
+}
+
+/* NUMA node of the card's PCI device, -1 if unknown */
+static int card_numa_node(int card)
+{
+	struct cxl_afu_h *afu;
+	char dev[32], *path, *file;
+	int node = -1;
+	FILE *f;
+
+	snprintf(dev, sizeof(dev), "afu%d.0", card);
+	cxl_for_each_afu(afu) {
+		if (strcmp(cxl_afu_dev_name(afu), dev))
+			continue;
+		if (cxl_afu_sysfs_pci(afu, &path) == 0) {
+			if (asprintf(&file, "%s/numa_node", path) >= 0) {
+				f = fopen(file, "r");
+				if (f) {
+					if (fscanf(f, "%d", &node) != 1)
+						node = -1;
+					fclose(f);
+				}
+				free(file);
+			}
+			free(path);
+		}
+		cxl_afu_free(afu);
+		break;
+	}
+	return node;
+}
+
+static int append_list(char *buf, size_t len, const int *ids, int n)
+{
+	int i, j, off = 0;
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && ids[j] == ids[j - 1] + 1; j++)
+			;
+		off += snprintf(buf + off, len - off, "%s%d", i ? "," : "",
+				ids[i]);
+		if (j - 1 > i)
+			off += snprintf(buf + off, len - off, "-%d",
+					ids[j - 1]);
+		if (off >= len)
+			return len - 1;
+	}
+	return off;
+}
+
+int placement_init(int card)
+{
+	int node_list[MAX_NODES], cpus[CPU_SETSIZE], next[MAX_NODES];
+	int n, i, j, k, local = -1;
+	char path[64];
+	size_t off;
+
+	if (place.policy == PLACE_NONE) {
+		snprintf(place.name, sizeof(place.name), "none");
+		return 0;
+	}
+
+	/* CPU to node map, and the nodes with CPUs */
+	for (i = 0; i < CPU_SETSIZE; i++)
+		place.cpu_node[i] = -1;
+	n = read_list(NODE_DIR "/online", node_list, MAX_NODES);
+	if (n <= 0) {
+		node_list[0] = 0;	/* kernel without NUMA */
+		n = 1;
+	}
+	for (i = 0; i < n; i++) {
+		/* Nodes and CPUs beyond the masks and cpu_node[] are ignored */
+		if (node_list[i] < 0 || node_list[i] >= MAX_NODES)
+			continue;
+		snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist",
+			 node_list[i]);
+		k = read_list(path, cpus, CPU_SETSIZE);
+		if (k <= 0)
+			continue;
+		for (j = 0; j < k; j++)
+			if (cpus[j] >= 0 && cpus[j] < CPU_SETSIZE)
+				place.cpu_node[cpus[j]] = node_list[i];
+		place.nodes[place.nnodes++] = node_list[i];
+	}
+	if (!place.nnodes) {
+		fprintf(stderr, "Unable to read the CPUs of the NUMA nodes\n");
+		return -1;
+	}
+
+	place.card_node = card_numa_node(card);
+	switch (place.policy) {
+	case PLACE_LOCAL:
+		for (i = 0; i < place.nnodes; i++)
+			if (place.nodes[i] == place.card_node)
+				local = place.card_node;
+		if (local < 0) {
+			local = place.nodes[0];
+			if (place.nnodes > 1)
+				fprintf(stderr, "Warning: NUMA node of card%d"
+					" unknown, using node %d\n", card,
+					local);
+		}
+		place.ncpus = 0;
+		for (i = 0; i < CPU_SETSIZE; i++)
+			if (place.cpu_node[i] == local)
+				place.cpus[place.ncpus++] = i;
+		off = snprintf(place.name, sizeof(place.name),
+			       "local node %d cpus ", local);
+		break;
+	case PLACE_INTERLEAVE:
+		/* Worker i on node i % nnodes, each node's CPUs in turn */
+		memset(next, 0, sizeof(next));
+		place.ncpus = 0;
+		do {
+			k = place.ncpus;
+			for (i = 0; i < place.nnodes; i++) {
+				for (j = next[i]; j < CPU_SETSIZE; j++)
+					if (place.cpu_node[j] == place.nodes[i])
+						break;
+				if (j < CPU_SETSIZE)
+					place.cpus[place.ncpus++] = j;
+				next[i] = j + 1;
+			}
+		} while (place.ncpus > k);
+		off = snprintf(place.name, sizeof(place.name),
+			       "interleave nodes ");
+		off += append_list(place.name + off,
+				   sizeof(place.name) - off, place.nodes,
+				   place.nnodes);
+		off += snprintf(place.name + off, sizeof(place.name) - off,
+				" cpus ");
+		break;
+	default:
+		place.ncpus = parse_list(place.spec, place.cpus, CPU_SETSIZE);
+		for (i = 0; i < place.ncpus; i++)
+			if (place.cpus[i] >= CPU_SETSIZE ||
+			    place.cpu_node[place.cpus[i]] < 0) {
+				fprintf(stderr, "CPU %d is not online\n",
+					place.cpus[i]);
+				return -1;
+			}
+		off = snprintf(place.name, sizeof(place.name), "cpus ");
+		break;
+	}
+	if (!place.ncpus) {
+		fprintf(stderr, "No CPU to place workers on\n");
+		return -1;
+	}
+	if (off < sizeof(place.name))
+		append_list(place.name + off, sizeof(place.name) - off,
+			    place.cpus, place.ncpus);
+	return 0;
+}
+
+/*
+ * Pins the calling thread for worker index, and binds or interleaves
+ * the memory it allocates from now on.  Returns the CPU and node.
+ */
+int placement_apply(int index, int *cpu, int *node)
+{
+	unsigned long mask[MAX_NODES / MASK_BITS];
+	cpu_set_t set;
+	int i, c, mode;
+
+	*cpu = -1;
+	*node = -1;
+	if (place.policy == PLACE_NONE)
+		return 0;
+
+	c = place.cpus[index % place.ncpus];
+	CPU_ZERO(&set);
+	CPU_SET(c, &set);
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		perror("sched_setaffinity");
+		return -1;
+	}
+
+	memset(mask, 0, sizeof(mask));
+	if (place.policy == PLACE_INTERLEAVE && place.nnodes > 1) {
+		mode = MPOL_INTERLEAVE;
+		for (i = 0; i < place.nnodes; i++)
+			mask[place.nodes[i] / MASK_BITS] |=
+				1UL << (place.nodes[i] % MASK_BITS);
+	} else {
+		mode = MPOL_BIND;
+		mask[place.cpu_node[c] / MASK_BITS] |=
+			1UL << (place.cpu_node[c] % MASK_BITS);
+	}
+	/* The kernel ignores the last bit of maxnode */
+	if (syscall(SYS_set_mempolicy, mode, mask, MAX_NODES + 1)) {
+		perror("set_mempolicy");
+		return -1;
+	}
+	*cpu = c;
+	*node = place.cpu_node[c];
+	return 0;
+}
+
+/* The policy and the CPUs it resolved to, e.g. "local node 0 cpus 0-7" */
+const char *placement_name(void)
+{
+	return place.name;
+}
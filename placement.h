@@ -0,0 +1,40 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _PLACEMENT_H_
+#define _PLACEMENT_H_
+
+/*
+ * Placement of the test processes and threads, and of their memory,
+ * relative to the NUMA node of the card:
+ *
+ *  local	CPUs and memory of the card's node,
+ *  interleave	workers spread over the nodes, memory interleaved,
+ *  <cpulist>	workers pinned to these CPUs in turn ("0-3,8"), memory
+ *		bound to the node of each CPU.
+ *
+ * placement_parse() selects the policy and placement_init() resolves it
+ * for a card.  Each worker then calls placement_apply() with its index
+ * before allocating its queue and buffers, which pins the calling thread
+ * and sets its memory policy.  Without a policy, all of these are no-ops.
+ */
+
+int placement_parse(const char *spec);
+int placement_init(int card);
+int placement_apply(int index, int *cpu, int *node);
+const char *placement_name(void);
+
+#endif /* _PLACEMENT_H_ */
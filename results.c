@@ -0,0 +1,360 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/utsname.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <libcxl.h>
+#include "results.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+static const char * const status_names[RESULTS_STATUS_BITS] = {
+	"undef_cmd", "proc_term", "inv_src", "psl_fault",
+	"derror", "aerror", "trans_fault",
+};
+
+static const char * const csv_header =
+	"record,tool,host,kernel,start,timestamp,card,caia_version,"
+	"psl_revision,base_image,image_loaded,config,scope,id,params,ops,"
+	"bytes,time_us,ops_per_s,mb_per_s,lat_min_us,lat_p50_us,lat_p90_us,"
+	"lat_p99_us,lat_p999_us,lat_max_us,err_undef_cmd,err_proc_term,"
+	"err_inv_src,err_psl_fault,err_derror,err_aerror,err_trans_fault,"
+	"error,status\n";
+
+static struct {
+	int fd;
+	int csv;
+	pid_t pid;		/* of the process which opened the file */
+	const char *tool;
+	char host[64];
+	char kernel[65];
+	char start[32];
+	char *config;		/* "key=value;..." */
+	char card[16];
+	char caia[16];
+	char psl_revision[16];
+	char base_image[16];
+	char image_loaded[16];
+} res = { .fd = -1 };
+
+static void timestamp(char *buf, size_t len)
+{
+	struct timespec ts;
+	struct tm tm;
+	size_t n;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	gmtime_r(&ts.tv_sec, &tm);
+	n = strftime(buf, len, "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(buf + n, len - n, ".%03ldZ", ts.tv_nsec / 1000000);
+}
+
+int results_open(const char *path, const char *tool)
+{
+	size_t len = strlen(path);
+
+	if (!strcmp(path, "-"))
+		res.fd = dup(STDOUT_FILENO);
+	else
+		res.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+			      O_CLOEXEC, 0644);
+	if (res.fd < 0) {
+		perror(path);
+		return -1;
+	}
+	res.csv = len > 4 && !strcmp(path + len - 4, ".csv");
+	res.pid = getpid();
+	res.tool = tool;
+	timestamp(res.start, sizeof(res.start));
+	if (res.csv && write(res.fd, csv_header, strlen(csv_header)) < 0)
+		perror(path);
+	return 0;
+}
+
+void results_config(const char *key, const char *fmt, ...)
+{
+	char *value, *config;
+	va_list ap;
+	int rc;
+
+	if (res.fd < 0)
+		return;
+	va_start(ap, fmt);
+	rc = vasprintf(&value, fmt, ap);
+	va_end(ap);
+	if (rc < 0)
+		return;
+	if (asprintf(&config, "%s%s%s=%s", res.config ? : "",
+		     res.config ? ";" : "", key, value) >= 0) {
+		free(res.config);
+		res.config = config;
+	}
+	free(value);
+}
+
+static void json_str(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; s && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/* "key=value;..." as a JSON object, numbers unquoted */
+static void json_kv(FILE *f, const char *kv)
+{
+	char *copy = strdup(kv ? : ""), *save, *item, *value, *end;
+	int first = 1;
+
+	fputc('{', f);
+	for (item = strtok_r(copy, ";", &save); item;
+	     item = strtok_r(NULL, ";", &save)) {
+		value = strchr(item, '=');
+		if (value)
+			*value++ = '\0';
+		fprintf(f, "%s", first ? "" : ", ");
+		json_str(f, item);
+		fprintf(f, ": ");
+		if (value && *value && (strtod(value, &end), !*end))
+			fprintf(f, "%s", value);
+		else
+			json_str(f, value);
+		first = 0;
+	}
+	fputc('}', f);
+	free(copy);
+}
+
+static void csv_str(FILE *f, const char *s)
+{
+	if (s == NULL)
+		s = "";
+	if (!strpbrk(s, ",\"\n")) {
+		fprintf(f, "%s,", s);
+		return;
+	}
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"')
+			fputc('"', f);
+		fputc(*s, f);
+	}
+	fprintf(f, "\",");
+}
+
+/* Fields common to all records */
+static void common(FILE *f, const char *record)
+{
+	char now[32];
+
+	timestamp(now, sizeof(now));
+	if (res.csv) {
+		csv_str(f, record);
+		csv_str(f, res.tool);
+		csv_str(f, res.host);
+		csv_str(f, res.kernel);
+		csv_str(f, res.start);
+		csv_str(f, now);
+		csv_str(f, res.card);
+		csv_str(f, res.caia);
+		csv_str(f, res.psl_revision);
+		csv_str(f, res.base_image);
+		csv_str(f, res.image_loaded);
+		csv_str(f, res.config);
+		return;
+	}
+	fprintf(f, "{\"record\": \"%s\", \"tool\": ", record);
+	json_str(f, res.tool);
+	fprintf(f, ", \"host\": ");
+	json_str(f, res.host);
+	fprintf(f, ", \"start\": \"%s\", \"timestamp\": \"%s\"",
+		res.start, now);
+}
+
+/* Writes out a record built in a memory stream, in one go */
+static void flush_record(FILE *f, char **buf, size_t *len)
+{
+	fclose(f);
+	if (write(res.fd, *buf, *len) < 0)
+		perror("write results");
+	free(*buf);
+}
+
+void results_run(int card)
+{
+	struct cxl_adapter_h *adapter;
+	enum cxl_image image;
+	struct utsname uts;
+	long major, minor;
+	char *buf;
+	size_t len;
+	FILE *f;
+
+	if (res.fd < 0)
+		return;
+	gethostname(res.host, sizeof(res.host) - 1);
+	if (!uname(&uts))
+		snprintf(res.kernel, sizeof(res.kernel), "%s", uts.release);
+
+	snprintf(res.card, sizeof(res.card), "card%d", card);
+	cxl_for_each_adapter(adapter) {
+		if (strcmp(cxl_adapter_dev_name(adapter), res.card))
+			continue;
+		if (!cxl_get_caia_version(adapter, &major, &minor))
+			snprintf(res.caia, sizeof(res.caia), "%ld.%ld",
+				 major, minor);
+		if (!cxl_get_psl_revision(adapter, &major))
+			snprintf(res.psl_revision, sizeof(res.psl_revision),
+				 "%ld", major);
+		if (!cxl_get_base_image(adapter, &major))
+			snprintf(res.base_image, sizeof(res.base_image),
+				 "%ld", major);
+		if (!cxl_get_image_loaded(adapter, &image))
+			snprintf(res.image_loaded, sizeof(res.image_loaded),
+				 "%s", image == CXL_IMAGE_USER ?
+				 "user" : "factory");
+		cxl_adapter_free(adapter);
+		break;
+	}
+
+	/* CSV rows carry all this already */
+	if (res.csv)
+		return;
+	f = open_memstream(&buf, &len);
+	if (f == NULL)
+		return;
+	common(f, "run");
+	fprintf(f, ", \"kernel\": ");
+	json_str(f, res.kernel);
+	fprintf(f, ", \"card\": ");
+	json_str(f, res.card);
+	fprintf(f, ", \"caia_version\": ");
+	json_str(f, res.caia);
+	fprintf(f, ", \"psl_revision\": ");
+	json_str(f, res.psl_revision);
+	fprintf(f, ", \"base_image\": ");
+	json_str(f, res.base_image);
+	fprintf(f, ", \"image_loaded\": ");
+	json_str(f, res.image_loaded);
+	fprintf(f, ", \"config\": ");
+	json_kv(f, res.config);
+	fprintf(f, "}\n");
+	flush_record(f, &buf, &len);
+}
+
+void results_emit(const struct results_metrics *m)
+{
+	static const char * const lat_names[] = {
+		"min", "p50", "p90", "p99", "p99.9", "max"
+	};
+	double lat[6] = { 0 }, us = m->ns_per_unit / 1000;
+	double t = m->time_us;
+	char *buf;
+	size_t len;
+	FILE *f;
+	int i;
+
+	if (res.fd < 0)
+		return;
+	if (m->hist && m->hist->count) {
+		lat[0] = m->hist->min * us;
+		lat[1] = lat_hist_percentile(m->hist, 50) * us;
+		lat[2] = lat_hist_percentile(m->hist, 90) * us;
+		lat[3] = lat_hist_percentile(m->hist, 99) * us;
+		lat[4] = lat_hist_percentile(m->hist, 99.9) * us;
+		lat[5] = m->hist->max * us;
+	}
+
+	f = open_memstream(&buf, &len);
+	if (f == NULL)
+		return;
+	common(f, "metrics");
+	if (res.csv) {
+		csv_str(f, m->scope);
+		fprintf(f, "%ld,", m->id);
+		csv_str(f, m->params);
+		fprintf(f, "%llu,%llu,%.3f,%.3f,%.3f,",
+			(unsigned long long)m->ops,
+			(unsigned long long)m->bytes, t,
+			t ? m->ops * 1000000.0 / t : 0, t ? m->bytes / t : 0);
+		for (i = 0; i < ARRAY_SIZE(lat_names); i++)
+			fprintf(f, "%.3f,", lat[i]);
+		for (i = 0; i < RESULTS_STATUS_BITS; i++)
+			fprintf(f, "%llu,",
+				(unsigned long long)m->status_errors[i]);
+		fprintf(f, "%d,\n", m->error);
+	} else {
+		fprintf(f, ", \"scope\": ");
+		json_str(f, m->scope);
+		fprintf(f, ", \"id\": %ld, \"params\": ", m->id);
+		json_kv(f, m->params);
+		fprintf(f, ", \"ops\": %llu, \"bytes\": %llu, \"time_us\": %.3f,"
+			" \"ops_per_s\": %.3f, \"mb_per_s\": %.3f",
+			(unsigned long long)m->ops,
+			(unsigned long long)m->bytes, t,
+			t ? m->ops * 1000000.0 / t : 0, t ? m->bytes / t : 0);
+		fprintf(f, ", \"latency_us\": {");
+		for (i = 0; i < ARRAY_SIZE(lat_names); i++)
+			fprintf(f, "%s\"%s\": %.3f", i ? ", " : "",
+				lat_names[i], lat[i]);
+		fprintf(f, "}, \"status_errors\": {");
+		for (i = 0; i < RESULTS_STATUS_BITS; i++)
+			fprintf(f, "%s\"%s\": %llu", i ? ", " : "",
+				status_names[i],
+				(unsigned long long)m->status_errors[i]);
+		fprintf(f, "}, \"error\": %d}\n", m->error);
+	}
+	flush_record(f, &buf, &len);
+}
+
+void results_close(int status)
+{
+	char *buf;
+	size_t len;
+	FILE *f;
+
+	/* Forked children inherit the file, only its opener closes it */
+	if (res.fd < 0 || getpid() != res.pid)
+		return;
+	f = open_memstream(&buf, &len);
+	if (f) {
+		common(f, "result");
+		if (res.csv)
+			fprintf(f, ",,,,,,,,,,,,,,,,,,,,,,%d\n", status);
+		else
+			fprintf(f, ", \"status\": %d}\n", status);
+		flush_record(f, &buf, &len);
+	}
+	close(res.fd);
+	res.fd = -1;
+	free(res.config);
+	res.config = NULL;
+}
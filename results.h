@@ -0,0 +1,69 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RESULTS_H_
+#define _RESULTS_H_
+
+#include <linux/types.h>
+#include "latency.h"
+
+/*
+ * Machine readable results, next to the text output of the tests.
+ *
+ * results_open() picks the format from the file name: CSV for a ".csv"
+ * suffix, else JSON with one object per line ("-" is stdout).  A JSON file
+ * holds a "run" record with the host and card identity and the run
+ * configuration, "metrics" records, and a "result" record with the exit
+ * status.  A CSV file holds one row per metrics record, and one for the
+ * result, each repeating the identity and configuration columns.
+ *
+ * Each record is written with a single write() to a file opened with
+ * O_APPEND, so forked processes and threads may emit records concurrently.
+ */
+
+/* The MEMCPY_WE_STAT_* error bits, counted per bit */
+#define RESULTS_STATUS_BITS	7
+
+struct results_metrics {
+	const char *scope;	/* "process", "thread", "aggregate", ... */
+	long id;
+	const char *params;	/* "key=value;..." specific to the record */
+	__u64 ops;
+	__u64 bytes;
+	double time_us;
+	const struct lat_hist *hist;	/* NULL for no latency */
+	double ns_per_unit;		/* of hist values */
+	__u64 status_errors[RESULTS_STATUS_BITS];
+	int error;		/* non zero if this part failed */
+};
+
+static inline void results_count_status(__u64 *status_errors, int status)
+{
+	int i;
+
+	for (i = 0; i < RESULTS_STATUS_BITS; i++)
+		if (status & (1 << i))
+			status_errors[i]++;
+}
+
+int results_open(const char *path, const char *tool);
+void results_config(const char *key, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void results_run(int card);
+void results_emit(const struct results_metrics *m);
+void results_close(int status);
+
+#endif /* _RESULTS_H_ */
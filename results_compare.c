@@ -0,0 +1,573 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Performance regression gate: compares the -F results (see results.h) of
+ * a baseline and a candidate run, configuration by configuration.
+ *
+ * The metrics records of a configuration (same tool, run configuration,
+ * scope and parameters) are its samples: one per process, thread or
+ * benchmark point, over as many runs as given.  For each metric, Welch's
+ * t-test gives a confidence interval of the difference between the
+ * candidate and baseline means, reported relative to the baseline mean.
+ * A metric regresses when the whole interval is on the bad side of zero
+ * and the estimated change is worse than the threshold.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <math.h>
+
+#define MAX_FILES	16
+
+enum metric {
+	METRIC_OPS,
+	METRIC_P50,
+	METRIC_P99,
+	NR_METRICS,
+};
+
+static const struct {
+	const char *name;
+	const char *csv;	/* CSV column */
+	const char *json;	/* JSON field, latencies in "latency_us" */
+	int higher_is_better;
+} metrics[NR_METRICS] = {
+	[METRIC_OPS] = { "ops/s", "ops_per_s", "ops_per_s", 1 },
+	[METRIC_P50] = { "p50 uS", "lat_p50_us", "p50", 0 },
+	[METRIC_P99] = { "p99 uS", "lat_p99_us", "p99", 0 },
+};
+
+struct samples {
+	double *v;
+	int n;
+	int size;
+};
+
+/* All samples of one configuration, [0] baseline, [1] candidate */
+struct config {
+	char *key;
+	struct samples s[2][NR_METRICS];
+	int errors[2];		/* records of failed runs */
+};
+
+static struct config *configs;
+static int nconfigs;
+static double threshold = 5;	/* percent */
+static double confidence = 95;	/* percent */
+
+static void add_sample(struct samples *s, double v)
+{
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 16;
+		s->v = realloc(s->v, s->size * sizeof(*s->v));
+		if (s->v == NULL) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	s->v[s->n++] = v;
+}
+
+static struct config *find_config(const char *key)
+{
+	int i;
+
+	for (i = 0; i < nconfigs; i++)
+		if (!strcmp(configs[i].key, key))
+			return &configs[i];
+	configs = realloc(configs, (nconfigs + 1) * sizeof(*configs));
+	if (configs == NULL) {
+		perror("realloc");
+		exit(2);
+	}
+	memset(&configs[nconfigs], 0, sizeof(*configs));
+	configs[nconfigs].key = strdup(key);
+	return &configs[nconfigs++];
+}
+
+static void add_record(int side, const char *tool, const char *config,
+		       const char *scope, const char *params,
+		       const double *values, int error)
+{
+	struct config *c;
+	char *key;
+	int i;
+
+	if (asprintf(&key, "%s %s %s%s%s", tool, scope, config,
+		     *params ? ";" : "", params) < 0) {
+		perror("asprintf");
+		exit(2);
+	}
+	c = find_config(key);
+	free(key);
+	if (error) {
+		c->errors[side]++;
+		return;
+	}
+	for (i = 0; i < NR_METRICS; i++)
+		add_sample(&c->s[side][i], values[i]);
+}
+
+/*
+ * CSV: splits a line into fields in place, honouring quotes, returns the
+ * number of fields.
+ */
+static int csv_split(char *line, char **fields, int max)
+{
+	char *r = line, *w = line;
+	int n = 0, quoted = 0;
+
+	fields[n++] = w;
+	for (; *r && *r != '\n'; r++) {
+		if (quoted) {
+			if (*r == '"' && r[1] == '"')
+				*w++ = *r++;
+			else if (*r == '"')
+				quoted = 0;
+			else
+				*w++ = *r;
+		} else if (*r == '"') {
+			quoted = 1;
+		} else if (*r == ',') {
+			*w++ = '\0';
+			if (n == max)
+				break;
+			fields[n++] = w;
+		} else {
+			*w++ = *r;
+		}
+	}
+	*w = '\0';
+	return n;
+}
+
+static int csv_column(char **header, int n, const char *name)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (!strcmp(header[i], name))
+			return i;
+	return -1;
+}
+
+enum { COL_RECORD, COL_TOOL, COL_CONFIG, COL_SCOPE, COL_PARAMS, COL_ERROR,
+       NR_COLS };
+static const char * const csv_cols[NR_COLS] = {
+	"record", "tool", "config", "scope", "params", "error",
+};
+
+static int read_csv(FILE *f, int side, const char *path)
+{
+	char *line = NULL, *header = NULL, *hf[64], *fields[64];
+	int col[NR_COLS], mcol[NR_METRICS], nh = 0, n, i;
+	double values[NR_METRICS];
+	size_t len = 0;
+
+	while (getline(&line, &len, f) > 0) {
+		if (!strncmp(line, "record,", 7)) {
+			/* Header, maybe again in concatenated files */
+			free(header);
+			header = strdup(line);
+			nh = csv_split(header, hf, 64);
+			for (i = 0; i < NR_COLS; i++)
+				col[i] = csv_column(hf, nh, csv_cols[i]);
+			for (i = 0; i < NR_METRICS; i++)
+				mcol[i] = csv_column(hf, nh, metrics[i].csv);
+			for (i = 0; i < NR_COLS; i++)
+				if (col[i] < 0)
+					goto bad;
+			for (i = 0; i < NR_METRICS; i++)
+				if (mcol[i] < 0)
+					goto bad;
+			continue;
+		}
+		if (!nh)
+			goto bad;
+		n = csv_split(line, fields, 64);
+		if (n != nh)
+			goto bad;
+		if (strcmp(fields[col[COL_RECORD]], "metrics"))
+			continue;
+		for (i = 0; i < NR_METRICS; i++)
+			values[i] = atof(fields[mcol[i]]);
+		add_record(side, fields[col[COL_TOOL]],
+			   fields[col[COL_CONFIG]], fields[col[COL_SCOPE]],
+			   fields[col[COL_PARAMS]], values,
+			   atoi(fields[col[COL_ERROR]]));
+	}
+	free(line);
+	free(header);
+	return 0;
+bad:
+	fprintf(stderr, "%s: not a results CSV file\n", path);
+	free(line);
+	free(header);
+	return -1;
+}
+
+/*
+ * JSON: the records written by results.c, one per line.  Finds the value
+ * of "name" in obj, returns a pointer to it or NULL.
+ */
+static const char *json_find(const char *obj, const char *name)
+{
+	char *pattern;
+	const char *p;
+
+	if (asprintf(&pattern, "\"%s\": ", name) < 0)
+		return NULL;
+	p = strstr(obj, pattern);
+	if (p)
+		p += strlen(pattern);
+	free(pattern);
+	return p;
+}
+
+/* A string value, or a flat object turned into "key=value;..." */
+static char *json_string(const char *obj, const char *name)
+{
+	const char *p = json_find(obj, name), *end;
+	char *s, *w;
+	int in_str = 0;
+
+	if (p == NULL)
+		return strdup("");
+	if (*p == '"') {
+		end = strchr(p + 1, '"');
+		return strndup(p + 1, end ? end - p - 1 : 0);
+	}
+	if (*p != '{')
+		return strdup("");
+	s = w = malloc(strlen(p) + 1);
+	for (p++; *p && (in_str || *p != '}'); p++) {
+		if (*p == '"')
+			in_str = !in_str;
+		else if (!in_str && *p == ':')
+			*w++ = '=';
+		else if (!in_str && *p == ',')
+			*w++ = ';';
+		else if (in_str || *p != ' ')
+			*w++ = *p;
+	}
+	*w = '\0';
+	return s;
+}
+
+static double json_number(const char *obj, const char *name)
+{
+	const char *p = json_find(obj, name);
+
+	return p ? atof(p) : 0;
+}
+
+static int read_json(FILE *f, int side, const char *path)
+{
+	char *line = NULL, *config = strdup(""), *tool, *scope, *params;
+	double values[NR_METRICS];
+	const char *lat;
+	size_t len = 0;
+	int i;
+
+	while (getline(&line, &len, f) > 0) {
+		if (strncmp(line, "{\"record\": ", 11)) {
+			fprintf(stderr, "%s: not a results JSON file\n", path);
+			free(line);
+			free(config);
+			return -1;
+		}
+		if (!strncmp(line + 11, "\"run\"", 5)) {
+			free(config);
+			config = json_string(line, "config");
+			continue;
+		}
+		if (strncmp(line + 11, "\"metrics\"", 9))
+			continue;
+		lat = json_find(line, "latency_us");
+		for (i = 0; i < NR_METRICS; i++)
+			values[i] = json_number(i == METRIC_OPS || !lat ?
+						line : lat, metrics[i].json);
+		tool = json_string(line, "tool");
+		scope = json_string(line, "scope");
+		params = json_string(line, "params");
+		add_record(side, tool, config, scope, params, values,
+			   json_number(line, "error") != 0);
+		free(tool);
+		free(scope);
+		free(params);
+	}
+	free(line);
+	free(config);
+	return 0;
+}
+
+static int read_results(const char *path, int side)
+{
+	size_t len = strlen(path);
+	FILE *f;
+	int rc;
+
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	if (len > 4 && !strcmp(path + len - 4, ".csv"))
+		rc = read_csv(f, side, path);
+	else
+		rc = read_json(f, side, path);
+	if (f != stdin)
+		fclose(f);
+	return rc;
+}
+
+/* Regularized incomplete beta function I_x(a, b), by continued fraction */
+static double betacf(double a, double b, double x)
+{
+	double c = 1, d = 1 - (a + b) * x / (a + 1), h, num;
+	int m;
+
+	if (fabs(d) < 1e-300)
+		d = 1e-300;
+	d = 1 / d;
+	h = d;
+	for (m = 1; m <= 300; m++) {
+		num = m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+		d = 1 + num * d;
+		c = 1 + num / c;
+		d = 1 / (fabs(d) < 1e-300 ? 1e-300 : d);
+		c = fabs(c) < 1e-300 ? 1e-300 : c;
+		h *= d * c;
+		num = -(a + m) * (a + b + m) * x /
+			((a + 2 * m) * (a + 2 * m + 1));
+		d = 1 + num * d;
+		c = 1 + num / c;
+		d = 1 / (fabs(d) < 1e-300 ? 1e-300 : d);
+		c = fabs(c) < 1e-300 ? 1e-300 : c;
+		h *= d * c;
+		if (fabs(d * c - 1) < 1e-12)
+			break;
+	}
+	return h;
+}
+
+static double ibeta(double a, double b, double x)
+{
+	double front;
+
+	if (x <= 0)
+		return 0;
+	if (x >= 1)
+		return 1;
+	front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) +
+		    a * log(x) + b * log(1 - x));
+	if (x < (a + 1) / (a + b + 2))
+		return front * betacf(a, b, x) / a;
+	return 1 - front * betacf(b, a, 1 - x) / b;
+}
+
+/* Student's t distribution: P(T <= t) with df degrees of freedom */
+static double t_cdf(double t, double df)
+{
+	double tail = 0.5 * ibeta(df / 2, 0.5, df / (df + t * t));
+
+	return t > 0 ? 1 - tail : tail;
+}
+
+/* Quantile of Student's t distribution, by bisection */
+static double t_quantile(double p, double df)
+{
+	double lo = 0, hi = 1e3, mid;
+	int i;
+
+	for (i = 0; i < 200; i++) {
+		mid = (lo + hi) / 2;
+		if (t_cdf(mid, df) < p)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (lo + hi) / 2;
+}
+
+static void mean_var(struct samples *s, double *mean, double *var)
+{
+	double sum = 0, sq = 0;
+	int i;
+
+	for (i = 0; i < s->n; i++)
+		sum += s->v[i];
+	*mean = sum / s->n;
+	for (i = 0; i < s->n; i++)
+		sq += (s->v[i] - *mean) * (s->v[i] - *mean);
+	*var = s->n > 1 ? sq / (s->n - 1) : 0;
+}
+
+/* Compares one metric of a configuration, returns 1 on a regression */
+static int compare(struct config *c, enum metric m)
+{
+	struct samples *b = &c->s[0][m], *k = &c->s[1][m];
+	double mb, vb, mk, vk, se, df, q, lo, hi, change;
+	const char *verdict;
+	int over, bad;
+
+	mean_var(b, &mb, &vb);
+	mean_var(k, &mk, &vk);
+	/* Latencies are 0 in records which do not measure them */
+	if (mb == 0 && mk == 0)
+		return 0;
+	printf("    %-7s %12.2f (%3d) %12.2f (%3d)", metrics[m].name,
+	       mb, b->n, mk, k->n);
+	if (b->n < 2 || k->n < 2 || mb == 0) {
+		printf("  not enough samples\n");
+		return 0;
+	}
+
+	change = (mk - mb) / mb * 100;
+	if (metrics[m].higher_is_better)
+		over = change < -threshold;
+	else
+		over = change > threshold;
+	se = sqrt(vb / b->n + vk / k->n);
+	/*
+	 * No spread on either side, e.g. percentiles quantized to the same
+	 * histogram bucket in every run: there is no noise to tell the
+	 * change apart from, judge it against the threshold alone.
+	 */
+	if (se == 0) {
+		if (over)
+			verdict = "REGRESSION";
+		else if (mk == mb)
+			verdict = "same";
+		else
+			verdict = (mk > mb) == metrics[m].higher_is_better ?
+				"better" : "worse";
+		printf(" %+8.2f%% %22s %s\n", change, "no variance", verdict);
+		return over;
+	}
+	df = se * se * se * se /
+		(vb * vb / ((double)b->n * b->n * (b->n - 1)) +
+		 vk * vk / ((double)k->n * k->n * (k->n - 1)));
+	q = t_quantile(1 - (1 - confidence / 100) / 2, df);
+	lo = (mk - mb - q * se) / mb * 100;
+	hi = (mk - mb + q * se) / mb * 100;
+
+	/* Significantly worse, and by more than the threshold */
+	bad = over && (metrics[m].higher_is_better ? hi < 0 : lo > 0);
+	if (bad)
+		verdict = "REGRESSION";
+	else if (lo > 0 || hi < 0)
+		verdict = (lo > 0) == metrics[m].higher_is_better ?
+			"better" : "worse";
+	else
+		verdict = "same";
+	printf(" %+8.2f%% [%+8.2f%%, %+8.2f%%] %s\n", change, lo, hi,
+	       verdict);
+	return bad;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: results_compare [options] -b <baseline> -c <candidate>\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr,
+		"\t-b <file>\tBaseline results, written with -F. Repeat\n"
+		"\t\t\tfor several runs.\n");
+	fprintf(stderr,
+		"\t-c <file>\tCandidate results, written with -F. Repeat\n"
+		"\t\t\tfor several runs.\n");
+	fprintf(stderr, "\t-h\t\tDisplay this help text.\n");
+	fprintf(stderr,
+		"\t-l <percent>\tConfidence level (default 95).\n");
+	fprintf(stderr,
+		"\t-t <percent>\tRegression threshold (default 5).\n");
+	fprintf(stderr,
+		"Exits with 1 if any metric regressed or the candidate\n"
+		"failed or missed a configuration, 2 on errors.\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *files[2][MAX_FILES];
+	int nfiles[2] = { 0, 0 }, side, i, m, c, regressions = 0, failures = 0;
+	struct config *cfg;
+
+	while ((c = getopt(argc, argv, "b:c:hl:t:")) != -1) {
+		switch (c) {
+		case 'b':
+		case 'c':
+			side = c == 'c';
+			if (nfiles[side] == MAX_FILES)
+				usage();
+			files[side][nfiles[side]++] = optarg;
+			break;
+		case 'l':
+			confidence = atof(optarg);
+			if (confidence <= 0 || confidence >= 100)
+				usage();
+			break;
+		case 't':
+			threshold = atof(optarg);
+			if (threshold < 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argv[optind] || !nfiles[0] || !nfiles[1])
+		usage();
+
+	for (side = 0; side < 2; side++)
+		for (i = 0; i < nfiles[side]; i++)
+			if (read_results(files[side][i], side))
+				return 2;
+
+	printf("# %.0f%% confidence interval of the change of the mean,"
+	       " threshold %.1f%%\n", confidence, threshold);
+	printf("#   %-7s %12s (%3s) %12s (%3s) %9s %22s\n", "metric",
+	       "baseline", "n", "candidate", "n", "change", "interval");
+	for (i = 0; i < nconfigs; i++) {
+		cfg = &configs[i];
+		printf("%s\n", cfg->key);
+		for (side = 0; side < 2; side++)
+			if (cfg->errors[side])
+				printf("    %d failed record(s) in the %s\n",
+				       cfg->errors[side],
+				       side ? "candidate" : "baseline");
+		/* The candidate must not fail or lose what the baseline ran */
+		if (cfg->errors[1] || (cfg->s[0][0].n && !cfg->s[1][0].n))
+			failures++;
+		if (!cfg->s[0][0].n || !cfg->s[1][0].n) {
+			if (cfg->s[0][0].n || cfg->s[1][0].n)
+				printf("    only in the %s\n", cfg->s[0][0].n ?
+				       "baseline" : "candidate");
+			continue;
+		}
+		for (m = 0; m < NR_METRICS; m++)
+			regressions += compare(cfg, m);
+	}
+	printf("# %d regression(s), %d failed or missing configuration(s)\n",
+	       regressions, failures);
+	return regressions || failures ? 1 : 0;
+}
@@ -0,0 +1,722 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * libcxl stand-in backed by the software memcpy AFU.
+ *
+ * The simulated system has a single card (card0) with a single AFU
+ * (afu0.0) in AFU directed mode.  Device paths are only parsed, nothing
+ * is opened: /dev/cxl/afu0.0m and /dev/cxl/afu0.0s give a master and a
+ * slave context.  Each context owns a pipe whose read end is returned by
+ * cxl_afu_fd(), so that AFU interrupts can be waited for with select() or
+ * poll() and read with cxl_read_event().
+ */
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "libcxl.h"
+#include "memcpy_afu_sim.h"
+
+#define SIM_CARD	0
+#define SIM_AFU		0
+
+#define SIM_IRQS_MIN	4
+#define SIM_IRQS_HW_MAX	35
+#define SIM_MMIO_SIZE	0x4000000
+#define SIM_PP_MMIO_OFF	0
+#define SIM_PP_MMIO_LEN	MEMCPY_AFU_PSA_REGS_SIZE
+
+/* Context view of a handle obtained by enumeration */
+#define SIM_VIEW_AFU	-1
+
+struct cxl_adapter_h {
+	int card;
+	char *dev_name;
+};
+
+struct cxl_afu_h {
+	int card;
+	int view;
+	char *dev_name;
+	int fd;			/* read end of the event pipe */
+	int event_fd;		/* write end, given to the AFU model */
+	int pe;
+	int attached;
+	int mapped;
+	struct memcpy_afu_sim sim;
+};
+
+/* sysfs attributes of the AFU and its context bookkeeping */
+static struct {
+	pthread_mutex_t lock;
+	long irqs_max;
+	long mode;
+	enum cxl_prefault_mode prefault_mode;
+	int contexts;
+	int next_pe;
+} sim_afu = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.irqs_max = SIM_IRQS_HW_MAX,
+	.mode = CXL_MODE_DIRECTED,
+	.prefault_mode = CXL_PREFAULT_MODE_NONE,
+	.contexts = 0,
+	.next_pe = 0,
+};
+
+static const char view_suffix[] = {
+	[CXL_VIEW_DEDICATED] = 'd',
+	[CXL_VIEW_MASTER] = 'm',
+	[CXL_VIEW_SLAVE] = 's',
+};
+
+/*
+ * Adapter Enumeration
+ */
+struct cxl_adapter_h *cxl_adapter_next(struct cxl_adapter_h *adapter)
+{
+	errno = 0;
+	if (adapter) {
+		cxl_adapter_free(adapter);
+		return NULL;
+	}
+	adapter = calloc(1, sizeof(*adapter));
+	if (!adapter)
+		return NULL;
+	adapter->card = SIM_CARD;
+	if (asprintf(&adapter->dev_name, "card%d", adapter->card) < 0) {
+		free(adapter);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return adapter;
+}
+
+char *cxl_adapter_dev_name(struct cxl_adapter_h *adapter)
+{
+	return adapter->dev_name;
+}
+
+void cxl_adapter_free(struct cxl_adapter_h *adapter)
+{
+	if (!adapter)
+		return;
+	free(adapter->dev_name);
+	free(adapter);
+}
+
+/*
+ * AFU Enumeration
+ */
+static struct cxl_afu_h *sim_afu_alloc(int card, int view)
+{
+	struct cxl_afu_h *afu;
+	int rc;
+
+	afu = calloc(1, sizeof(*afu));
+	if (!afu)
+		return NULL;
+	afu->card = card;
+	afu->view = view;
+	afu->fd = -1;
+	afu->event_fd = -1;
+	afu->pe = -1;
+	if (view == SIM_VIEW_AFU)
+		rc = asprintf(&afu->dev_name, "afu%d.%d", card, SIM_AFU);
+	else
+		rc = asprintf(&afu->dev_name, "afu%d.%d%c", card, SIM_AFU,
+			      view_suffix[view]);
+	if (rc < 0) {
+		free(afu);
+		errno = ENOMEM;
+		return NULL;
+	}
+	return afu;
+}
+
+struct cxl_afu_h *cxl_adapter_afu_next(struct cxl_adapter_h *adapter,
+				       struct cxl_afu_h *afu)
+{
+	errno = 0;
+	if (afu) {
+		cxl_afu_free(afu);
+		return NULL;
+	}
+	return sim_afu_alloc(adapter->card, SIM_VIEW_AFU);
+}
+
+struct cxl_afu_h *cxl_afu_next(struct cxl_afu_h *afu)
+{
+	errno = 0;
+	if (afu) {
+		cxl_afu_free(afu);
+		return NULL;
+	}
+	return sim_afu_alloc(SIM_CARD, SIM_VIEW_AFU);
+}
+
+char *cxl_afu_dev_name(struct cxl_afu_h *afu)
+{
+	return afu->dev_name;
+}
+
+/*
+ * Open AFU
+ */
+static struct cxl_afu_h *sim_afu_open(int card, int view)
+{
+	struct cxl_afu_h *afu;
+	int fds[2];
+
+	if (view == CXL_VIEW_DEDICATED && sim_afu.mode != CXL_MODE_DEDICATED) {
+		errno = ENODEV;
+		return NULL;
+	}
+	afu = sim_afu_alloc(card, view);
+	if (!afu)
+		return NULL;
+	if (view == SIM_VIEW_AFU)
+		return afu;
+
+	if (pipe2(fds, O_CLOEXEC)) {
+		cxl_afu_free(afu);
+		return NULL;
+	}
+	afu->fd = fds[0];
+	afu->event_fd = fds[1];
+
+	/* The process element is allocated when the context is opened */
+	pthread_mutex_lock(&sim_afu.lock);
+	afu->pe = sim_afu.next_pe++ % MEMCPY_AFUD_NUM_OF_PROCESSES;
+	sim_afu.contexts++;
+	pthread_mutex_unlock(&sim_afu.lock);
+	return afu;
+}
+
+/* Parse a device name such as "afu0.0s" */
+static struct cxl_afu_h *sim_afu_open_name(const char *name)
+{
+	int card, afu_index, view, n = 0;
+	char suffix = 0;
+
+	if (sscanf(name, "afu%d.%d%n%c", &card, &afu_index, &n, &suffix) < 2 ||
+	    card != SIM_CARD || afu_index != SIM_AFU) {
+		errno = ENODEV;
+		return NULL;
+	}
+	switch (suffix) {
+	case 0:
+		view = SIM_VIEW_AFU;
+		break;
+	case 'd':
+		view = CXL_VIEW_DEDICATED;
+		break;
+	case 'm':
+		view = CXL_VIEW_MASTER;
+		break;
+	case 's':
+		view = CXL_VIEW_SLAVE;
+		break;
+	default:
+		errno = ENODEV;
+		return NULL;
+	}
+	if (suffix && name[n + 1]) {
+		errno = ENODEV;
+		return NULL;
+	}
+	return sim_afu_open(card, view);
+}
+
+static struct cxl_afu_h *sim_afu_open_path(const char *path)
+{
+	char target[PATH_MAX];
+	const char *name;
+	ssize_t len;
+
+	/* Follow a symbolic link to a device node, even a dangling one */
+	len = readlink(path, target, sizeof(target) - 1);
+	if (len > 0) {
+		target[len] = 0;
+		path = target;
+	}
+	name = strrchr(path, '/');
+	return sim_afu_open_name(name ? name + 1 : path);
+}
+
+struct cxl_afu_h *cxl_afu_open_dev(char *path)
+{
+	if (!path) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return sim_afu_open_path(path);
+}
+
+struct cxl_afu_h *cxl_afu_open_h(struct cxl_afu_h *afu, enum cxl_views view)
+{
+	if (!afu || view < CXL_VIEW_DEDICATED || view > CXL_VIEW_SLAVE) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return sim_afu_open(afu->card, view);
+}
+
+struct cxl_afu_h *cxl_afu_fd_to_h(int fd)
+{
+	struct cxl_afu_h *afu;
+	char path[32], target[PATH_MAX];
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	len = readlink(path, target, sizeof(target) - 1);
+	if (len < 0)
+		return NULL;
+	target[len] = 0;
+	afu = sim_afu_open_path(target);
+	if (afu)
+		close(fd);
+	return afu;
+}
+
+void cxl_afu_free(struct cxl_afu_h *afu)
+{
+	if (!afu)
+		return;
+	memcpy_afu_sim_stop(&afu->sim);
+	if (afu->fd >= 0) {
+		close(afu->fd);
+		close(afu->event_fd);
+		pthread_mutex_lock(&sim_afu.lock);
+		sim_afu.contexts--;
+		pthread_mutex_unlock(&sim_afu.lock);
+	}
+	free(afu->dev_name);
+	free(afu);
+}
+
+int cxl_afu_opened(struct cxl_afu_h *afu)
+{
+	if (!afu) {
+		errno = EINVAL;
+		return -1;
+	}
+	return afu->fd >= 0;
+}
+
+/*
+ * Attach AFU context to this process
+ */
+struct cxl_ioctl_start_work *cxl_work_alloc(void)
+{
+	return calloc(1, sizeof(struct cxl_ioctl_start_work));
+}
+
+int cxl_work_free(struct cxl_ioctl_start_work *work)
+{
+	if (!work) {
+		errno = EINVAL;
+		return -1;
+	}
+	free(work);
+	return 0;
+}
+
+int cxl_work_get_amr(struct cxl_ioctl_start_work *work, __u64 *valp)
+{
+	*valp = work->amr;
+	return 0;
+}
+
+int cxl_work_get_num_irqs(struct cxl_ioctl_start_work *work, __s16 *valp)
+{
+	*valp = work->num_interrupts;
+	return 0;
+}
+
+int cxl_work_get_wed(struct cxl_ioctl_start_work *work, __u64 *valp)
+{
+	*valp = work->work_element_descriptor;
+	return 0;
+}
+
+int cxl_work_set_amr(struct cxl_ioctl_start_work *work, __u64 amr)
+{
+	work->amr = amr;
+	work->flags |= CXL_START_WORK_AMR;
+	return 0;
+}
+
+int cxl_work_set_num_irqs(struct cxl_ioctl_start_work *work, __s16 num_irqs)
+{
+	work->num_interrupts = num_irqs;
+	work->flags |= CXL_START_WORK_NUM_IRQS;
+	return 0;
+}
+
+int cxl_work_set_wed(struct cxl_ioctl_start_work *work, __u64 wed)
+{
+	work->work_element_descriptor = wed;
+	return 0;
+}
+
+int cxl_afu_attach_work(struct cxl_afu_h *afu,
+			struct cxl_ioctl_start_work *work)
+{
+	long num_irqs = SIM_IRQS_MIN;
+
+	if (!afu || !work || afu->fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (afu->attached) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (work->flags & CXL_START_WORK_NUM_IRQS) {
+		num_irqs = work->num_interrupts;
+		if (num_irqs < SIM_IRQS_MIN || num_irqs > sim_afu.irqs_max) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	if (memcpy_afu_sim_start(&afu->sim, afu->pe,
+				 work->work_element_descriptor, num_irqs,
+				 afu->event_fd))
+		return -1;
+	afu->attached = 1;
+	return 0;
+}
+
+int cxl_afu_attach(struct cxl_afu_h *afu, __u64 wed)
+{
+	struct cxl_ioctl_start_work work;
+
+	memset(&work, 0, sizeof(work));
+	work.work_element_descriptor = wed;
+	return cxl_afu_attach_work(afu, &work);
+}
+
+int cxl_afu_get_process_element(struct cxl_afu_h *afu)
+{
+	if (!afu || afu->fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	return afu->pe;
+}
+
+int cxl_afu_fd(struct cxl_afu_h *afu)
+{
+	if (!afu) {
+		errno = EINVAL;
+		return -1;
+	}
+	return afu->fd;
+}
+
+int cxl_afu_sysfs_pci(struct cxl_afu_h *afu, char **pathp)
+{
+	if (asprintf(pathp, CXL_SYSFS_CLASS "/card%d/device", afu->card) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Adapter attributes
+ */
+int cxl_get_base_image(struct cxl_adapter_h *adapter, long *valp)
+{
+	*valp = 0;
+	return 0;
+}
+
+int cxl_get_caia_version(struct cxl_adapter_h *adapter, long *majorp,
+			 long *minorp)
+{
+	*majorp = memcpy_afu_sim_caia_major();
+	*minorp = 0;
+	return 0;
+}
+
+int cxl_get_image_loaded(struct cxl_adapter_h *adapter, enum cxl_image *valp)
+{
+	*valp = CXL_IMAGE_USER;
+	return 0;
+}
+
+int cxl_get_psl_revision(struct cxl_adapter_h *adapter, long *valp)
+{
+	*valp = 0;
+	return 0;
+}
+
+int cxl_get_psl_timebase_synced(struct cxl_adapter_h *adapter, long *valp)
+{
+	*valp = 1;
+	return 0;
+}
+
+int cxl_get_tunneled_ops_supported(struct cxl_adapter_h *adapter, long *valp)
+{
+	*valp = memcpy_afu_sim_caia_major() == 2;
+	return 0;
+}
+
+/*
+ * AFU attributes
+ */
+int cxl_get_api_version(struct cxl_afu_h *afu, long *valp)
+{
+	*valp = CXL_KERNEL_API_VERSION;
+	return 0;
+}
+
+int cxl_get_api_version_compatible(struct cxl_afu_h *afu, long *valp)
+{
+	*valp = CXL_KERNEL_API_VERSION;
+	return 0;
+}
+
+int cxl_get_irqs_max(struct cxl_afu_h *afu, long *valp)
+{
+	*valp = sim_afu.irqs_max;
+	return 0;
+}
+
+int cxl_get_irqs_min(struct cxl_afu_h *afu, long *valp)
+{
+	*valp = SIM_IRQS_MIN;
+	return 0;
+}
+
+int cxl_get_mmio_size(struct cxl_afu_h *afu, long *valp)
+{
+	*valp = afu->view == CXL_VIEW_SLAVE ? SIM_PP_MMIO_LEN : SIM_MMIO_SIZE;
+	return 0;
+}
+
+int cxl_get_mode(struct cxl_afu_h *afu, long *valp)
+{
+	*valp = sim_afu.mode;
+	return 0;
+}
+
+int cxl_get_modes_supported(struct cxl_afu_h *afu, long *valp)
+{
+	*valp = CXL_MODE_DIRECTED;
+	return 0;
+}
+
+int cxl_get_prefault_mode(struct cxl_afu_h *afu, enum cxl_prefault_mode *valp)
+{
+	*valp = sim_afu.prefault_mode;
+	return 0;
+}
+
+int cxl_get_pp_mmio_len(struct cxl_afu_h *afu, long *valp)
+{
+	*valp = SIM_PP_MMIO_LEN;
+	return 0;
+}
+
+int cxl_get_pp_mmio_off(struct cxl_afu_h *afu, long *valp)
+{
+	*valp = SIM_PP_MMIO_OFF;
+	return 0;
+}
+
+int cxl_set_irqs_max(struct cxl_afu_h *afu, long value)
+{
+	if (value < SIM_IRQS_MIN || value > SIM_IRQS_HW_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	sim_afu.irqs_max = value;
+	return 0;
+}
+
+int cxl_set_mode(struct cxl_afu_h *afu, long value)
+{
+	int busy;
+
+	pthread_mutex_lock(&sim_afu.lock);
+	busy = sim_afu.contexts;
+	pthread_mutex_unlock(&sim_afu.lock);
+	if (busy) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (value != CXL_MODE_DIRECTED) {
+		errno = EINVAL;
+		return -1;
+	}
+	sim_afu.mode = value;
+	return 0;
+}
+
+int cxl_set_prefault_mode(struct cxl_afu_h *afu, enum cxl_prefault_mode value)
+{
+	switch (value) {
+	case CXL_PREFAULT_MODE_NONE:
+	case CXL_PREFAULT_MODE_WED:
+	case CXL_PREFAULT_MODE_ALL:
+		sim_afu.prefault_mode = value;
+		return 0;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Events
+ */
+int cxl_event_pending(struct cxl_afu_h *afu)
+{
+	struct pollfd fds = {
+		.fd = afu->fd,
+		.events = POLLIN,
+	};
+
+	return poll(&fds, 1, 0);
+}
+
+int cxl_read_event(struct cxl_afu_h *afu, struct cxl_event *event)
+{
+	ssize_t size;
+
+	if (!afu || afu->fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	do {
+		size = read(afu->fd, event, sizeof(*event));
+	} while (size < 0 && errno == EINTR);
+	if (size != sizeof(*event)) {
+		if (size >= 0)
+			errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+int cxl_read_expected_event(struct cxl_afu_h *afu, struct cxl_event *event,
+			    __u32 type, __u16 irq)
+{
+	int rc;
+
+	if ((rc = cxl_read_event(afu, event)))
+		return rc;
+	if (event->header.type != type)
+		return -1;
+	if (type == CXL_EVENT_AFU_INTERRUPT && event->irq.irq != irq)
+		return -1;
+	return 0;
+}
+
+/*
+ * MMIO
+ */
+int cxl_mmio_map(struct cxl_afu_h *afu, __u32 flags)
+{
+	if (!afu || !afu->attached || (flags & ~CXL_MMIO_FLAGS)) {
+		errno = EINVAL;
+		return -1;
+	}
+	afu->mapped = 1;
+	return 0;
+}
+
+int cxl_mmio_unmap(struct cxl_afu_h *afu)
+{
+	if (!afu || !afu->mapped) {
+		errno = EINVAL;
+		return -1;
+	}
+	afu->mapped = 0;
+	return 0;
+}
+
+static int sim_mmio_check(struct cxl_afu_h *afu, __u64 offset, size_t size)
+{
+	long mmio_size;
+
+	if (!afu || !afu->mapped) {
+		errno = EINVAL;
+		return -1;
+	}
+	cxl_get_mmio_size(afu, &mmio_size);
+	if ((offset & (size - 1)) || offset + size > mmio_size) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int cxl_mmio_write64(struct cxl_afu_h *afu, __u64 offset, __u64 data)
+{
+	if (sim_mmio_check(afu, offset, sizeof(data)))
+		return -1;
+	if (afu->view == CXL_VIEW_MASTER)
+		return memcpy_afu_sim_global_write64(offset, data);
+	return memcpy_afu_sim_write64(&afu->sim, offset, data);
+}
+
+int cxl_mmio_read64(struct cxl_afu_h *afu, __u64 offset, __u64 *data)
+{
+	if (sim_mmio_check(afu, offset, sizeof(*data)))
+		return -1;
+	if (afu->view == CXL_VIEW_MASTER)
+		return memcpy_afu_sim_global_read64(offset, data);
+	return memcpy_afu_sim_read64(&afu->sim, offset, data);
+}
+
+int cxl_mmio_write32(struct cxl_afu_h *afu, __u64 offset, __u32 data)
+{
+	__u64 reg;
+
+	if (sim_mmio_check(afu, offset, sizeof(data)) ||
+	    cxl_mmio_read64(afu, offset & ~7ULL, &reg))
+		return -1;
+	if (offset & 4)
+		reg = (reg & 0xffffffff00000000ULL) | data;
+	else
+		reg = (reg & 0xffffffffULL) | ((__u64)data << 32);
+	return cxl_mmio_write64(afu, offset & ~7ULL, reg);
+}
+
+int cxl_mmio_read32(struct cxl_afu_h *afu, __u64 offset, __u32 *data)
+{
+	__u64 reg;
+
+	if (sim_mmio_check(afu, offset, sizeof(*data)) ||
+	    cxl_mmio_read64(afu, offset & ~7ULL, &reg))
+		return -1;
+	*data = (offset & 4) ? reg & 0xffffffff : reg >> 32;
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * libcxl stand-in used when building with SIM=y.
+ *
+ * Declares the subset of the libcxl API used by the tests.  The calls are
+ * served by a software model of the memcpy AFU (memcpy_afu_sim.c) instead
+ * of the cxl kernel driver, so the tests run on hosts without a CAPI card.
+ */
+
+#ifndef _LIBCXL_H
+#define _LIBCXL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <linux/types.h>
+#include <misc/cxl.h>
+
+#define CXL_KERNEL_API_VERSION 1
+
+#define CXL_SYSFS_CLASS "/sys/class/cxl"
+#define CXL_DEV_DIR "/dev/cxl"
+
+#ifndef CXL_MODE_TIME_SLICED
+#define CXL_MODE_TIME_SLICED 0x4
+#endif
+
+/*
+ * Opaque types
+ */
+struct cxl_adapter_h;
+struct cxl_afu_h;
+
+/*
+ * Adapter Enumeration
+ */
+struct cxl_adapter_h *cxl_adapter_next(struct cxl_adapter_h *adapter);
+char *cxl_adapter_dev_name(struct cxl_adapter_h *adapter);
+void cxl_adapter_free(struct cxl_adapter_h *adapter);
+#define cxl_for_each_adapter(adapter) \
+	for (adapter = cxl_adapter_next(NULL); adapter; \
+	     adapter = cxl_adapter_next(adapter))
+
+/*
+ * AFU Enumeration
+ */
+struct cxl_afu_h *cxl_adapter_afu_next(struct cxl_adapter_h *adapter,
+				       struct cxl_afu_h *afu);
+struct cxl_afu_h *cxl_afu_next(struct cxl_afu_h *afu);
+char *cxl_afu_dev_name(struct cxl_afu_h *afu);
+#define cxl_for_each_adapter_afu(adapter, afu) \
+	for (afu = cxl_adapter_afu_next(adapter, NULL); afu; \
+	     afu = cxl_adapter_afu_next(adapter, afu))
+#define cxl_for_each_afu(afu) \
+	for (afu = cxl_afu_next(NULL); afu; afu = cxl_afu_next(afu))
+
+enum cxl_views {
+	CXL_VIEW_DEDICATED = 0,
+	CXL_VIEW_MASTER,
+	CXL_VIEW_SLAVE
+};
+
+/*
+ * Open AFU - either by path, by AFU being enumerated, or tie into an AFU file
+ * descriptor that has already been opened.
+ */
+struct cxl_afu_h *cxl_afu_open_dev(char *path);
+struct cxl_afu_h *cxl_afu_open_h(struct cxl_afu_h *afu, enum cxl_views view);
+struct cxl_afu_h *cxl_afu_fd_to_h(int fd);
+void cxl_afu_free(struct cxl_afu_h *afu);
+int cxl_afu_opened(struct cxl_afu_h *afu);
+
+/*
+ * Attach AFU context to this process
+ */
+struct cxl_ioctl_start_work *cxl_work_alloc(void);
+int cxl_work_free(struct cxl_ioctl_start_work *work);
+int cxl_work_get_amr(struct cxl_ioctl_start_work *work, __u64 *valp);
+int cxl_work_get_num_irqs(struct cxl_ioctl_start_work *work, __s16 *valp);
+int cxl_work_get_wed(struct cxl_ioctl_start_work *work, __u64 *valp);
+int cxl_work_set_amr(struct cxl_ioctl_start_work *work, __u64 amr);
+int cxl_work_set_num_irqs(struct cxl_ioctl_start_work *work, __s16 num_irqs);
+int cxl_work_set_wed(struct cxl_ioctl_start_work *work, __u64 wed);
+
+int cxl_afu_attach(struct cxl_afu_h *afu, __u64 wed);
+int cxl_afu_attach_work(struct cxl_afu_h *afu,
+			struct cxl_ioctl_start_work *work);
+
+/*
+ * Get AFU process element
+ */
+int cxl_afu_get_process_element(struct cxl_afu_h *afu);
+
+/*
+ * Returns the file descriptor for the open AFU to use with event loops.
+ * Returns -1 if the AFU is not open.
+ */
+int cxl_afu_fd(struct cxl_afu_h *afu);
+
+/*
+ * sysfs helpers
+ */
+int cxl_afu_sysfs_pci(struct cxl_afu_h *afu, char **pathp);
+
+/* Adapter attribute getters */
+enum cxl_image {
+	CXL_IMAGE_FACTORY = 0,
+	CXL_IMAGE_USER
+};
+int cxl_get_base_image(struct cxl_adapter_h *adapter, long *valp);
+int cxl_get_caia_version(struct cxl_adapter_h *adapter, long *majorp,
+			 long *minorp);
+int cxl_get_image_loaded(struct cxl_adapter_h *adapter, enum cxl_image *valp);
+int cxl_get_psl_revision(struct cxl_adapter_h *adapter, long *valp);
+int cxl_get_psl_timebase_synced(struct cxl_adapter_h *adapter, long *valp);
+int cxl_get_tunneled_ops_supported(struct cxl_adapter_h *adapter, long *valp);
+
+/* AFU attribute getters */
+enum cxl_prefault_mode {
+	CXL_PREFAULT_MODE_NONE = 0,
+	CXL_PREFAULT_MODE_WED,
+	CXL_PREFAULT_MODE_ALL,
+};
+int cxl_get_api_version(struct cxl_afu_h *afu, long *valp);
+int cxl_get_api_version_compatible(struct cxl_afu_h *afu, long *valp);
+int cxl_get_irqs_max(struct cxl_afu_h *afu, long *valp);
+int cxl_get_irqs_min(struct cxl_afu_h *afu, long *valp);
+int cxl_get_mmio_size(struct cxl_afu_h *afu, long *valp);
+int cxl_get_mode(struct cxl_afu_h *afu, long *valp);
+int cxl_get_modes_supported(struct cxl_afu_h *afu, long *valp);
+int cxl_get_prefault_mode(struct cxl_afu_h *afu, enum cxl_prefault_mode *valp);
+int cxl_get_pp_mmio_len(struct cxl_afu_h *afu, long *valp);
+int cxl_get_pp_mmio_off(struct cxl_afu_h *afu, long *valp);
+
+/* AFU attribute setters */
+int cxl_set_irqs_max(struct cxl_afu_h *afu, long value);
+int cxl_set_mode(struct cxl_afu_h *afu, long value);
+int cxl_set_prefault_mode(struct cxl_afu_h *afu, enum cxl_prefault_mode value);
+
+/*
+ * Events
+ */
+int cxl_event_pending(struct cxl_afu_h *afu);
+int cxl_read_event(struct cxl_afu_h *afu, struct cxl_event *event);
+/*
+ * Read an event, check that it has the given type (and for AFU interrupts,
+ * the given IRQ number).  Returns 0 on a match, -1 otherwise.
+ */
+int cxl_read_expected_event(struct cxl_afu_h *afu, struct cxl_event *event,
+			    __u32 type, __u16 irq);
+
+/*
+ * MMIO functions
+ */
+#define CXL_MMIO_BIG_ENDIAN 0x1
+#define CXL_MMIO_LITTLE_ENDIAN 0x2
+#define CXL_MMIO_HOST_ENDIAN 0x3
+#define CXL_MMIO_ENDIAN_MASK 0x3
+#define CXL_MMIO_FLAGS 0x3
+int cxl_mmio_map(struct cxl_afu_h *afu, __u32 flags);
+int cxl_mmio_unmap(struct cxl_afu_h *afu);
+int cxl_mmio_write64(struct cxl_afu_h *afu, __u64 offset, __u64 data);
+int cxl_mmio_read64(struct cxl_afu_h *afu, __u64 offset, __u64 *data);
+int cxl_mmio_write32(struct cxl_afu_h *afu, __u64 offset, __u32 data);
+int cxl_mmio_read32(struct cxl_afu_h *afu, __u64 offset, __u32 *data);
+
+#endif /* _LIBCXL_H */
@@ -0,0 +1,353 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+#include <misc/cxl.h>
+
+#include "memcpy_afu.h"
+#include "timebase.h"
+#include "memcpy_afu_sim.h"
+
+#define CACHELINESIZE	128
+
+/* Number of empty polls of the queue before the AFU thread backs off */
+#define IDLE_SPINS	256
+#define IDLE_YIELDS	4096
+
+static const struct timespec idle_sleep = {
+	.tv_sec = 0,
+	.tv_nsec = 10000 /* 10 usec */
+};
+
+/* AFU global registers */
+static __u64 afu_cfg;
+
+long memcpy_afu_sim_caia_major(void)
+{
+	static long caia_major;
+	char *caia;
+
+	if (!caia_major) {
+		caia = getenv(MEMCPY_AFU_SIM_CAIA_ENV);
+		caia_major = (caia && atol(caia) > 0) ? atol(caia) : 1;
+	}
+	return caia_major;
+}
+
+/* Same clock as the tests, so -t compares like with like */
+__u64 memcpy_afu_sim_timebase(void)
+{
+	return tb_now();
+}
+
+static __u8 sim_copy(struct memcpy_work_element *we)
+{
+	void *src = (void *)(uintptr_t)be64toh(we->src);
+	void *dst = (void *)(uintptr_t)be64toh(we->dst);
+	size_t length = be16toh(we->length);
+
+	if (!src || !dst)
+		return MEMCPY_WE_STAT_TRANS_FAULT;
+	/* The AFU only issues cacheline aligned reads and writes */
+	if (((uintptr_t)src | (uintptr_t)dst) & (CACHELINESIZE - 1))
+		return MEMCPY_WE_STAT_AERROR;
+	if (memcpy_afu_sim_caia_major() == 2 && length > CACHELINESIZE)
+		return MEMCPY_WE_STAT_AERROR;	/* MemCpy AFU v2 restriction */
+	memcpy(dst, src, length);
+	return 0;
+}
+
+/* Big endian increment of a 1 to 8 byte integer */
+static __u8 sim_incr(struct memcpy_work_element *we)
+{
+	__u8 *src = (__u8 *)(uintptr_t)be64toh(we->src);
+	__u8 *dst = (__u8 *)(uintptr_t)be64toh(we->dst);
+	size_t i, length = be16toh(we->length);
+	__u64 val = 0;
+
+	if (!src || !dst)
+		return MEMCPY_WE_STAT_TRANS_FAULT;
+	if (length == 0 || length > sizeof(val))
+		return MEMCPY_WE_STAT_UNDEF_CMD;
+	for (i = 0; i < length; i++)
+		val = (val << 8) | src[i];
+	val++;
+	for (i = length; i > 0; i--, val >>= 8)
+		dst[i - 1] = val & 0xff;
+	return 0;
+}
+
+/* Operands are compared and stored as raw big endian doublewords */
+static __u8 sim_atomic(struct memcpy_work_element *we)
+{
+	__u64 *dst = (__u64 *)(uintptr_t)be64toh(we->dst);
+	__u64 expected, desired = we->src;
+
+	if (!dst)
+		return MEMCPY_WE_STAT_TRANS_FAULT;
+	if ((uintptr_t)dst & (sizeof(*dst) - 1))
+		return MEMCPY_WE_STAT_AERROR;
+
+	switch (we->cmd_extra) {
+	case MEMCPY_WE_CMD_EXTRA_CAS_EQUAL_8:
+		expected = we->atomic_op1;
+		__atomic_compare_exchange_n(dst, &expected, desired, 0,
+					    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		return 0;
+	case MEMCPY_WE_CMD_EXTRA_CAS_NOT_EQUAL_8:
+		expected = __atomic_load_n(dst, __ATOMIC_SEQ_CST);
+		while (expected != we->atomic_op1 &&
+		       !__atomic_compare_exchange_n(dst, &expected, desired, 0,
+						    __ATOMIC_SEQ_CST,
+						    __ATOMIC_SEQ_CST))
+			;
+		return 0;
+	}
+	return MEMCPY_WE_STAT_UNDEF_CMD;
+}
+
+static void sim_raise_irq(struct memcpy_afu_sim *sim, __u16 irq)
+{
+	struct cxl_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.header.type = CXL_EVENT_AFU_INTERRUPT;
+	event.header.size = sizeof(event.header) + sizeof(event.irq);
+	event.header.process_element = sim->pe;
+	event.irq.irq = irq;
+	/* One fixed size record per event, written atomically to the pipe */
+	if (write(sim->event_fd, &event, sizeof(event)) != sizeof(event))
+		return;	/* event lost, as with an overflowing kernel queue */
+}
+
+static void sim_stop(struct memcpy_afu_sim *sim)
+{
+	pthread_mutex_lock(&sim->lock);
+	sim->stopped = 1;
+	pthread_mutex_unlock(&sim->lock);
+}
+
+/*
+ * Stop_on_Invalid_Command: park until restarted.  The element is checked
+ * again under the lock so that a restart issued just after the element was
+ * made valid cannot be missed.
+ */
+static void sim_stop_on_invalid(struct memcpy_afu_sim *sim,
+				struct memcpy_work_element *we)
+{
+	__u8 cmd;
+
+	pthread_mutex_lock(&sim->lock);
+	cmd = __atomic_load_n(&we->cmd, __ATOMIC_ACQUIRE);
+	if (!(cmd & MEMCPY_WE_CMD_VALID) ||
+	    (cmd & MEMCPY_WE_CMD_WRAP) != sim->wrap)
+		sim->stopped = 1;
+	pthread_mutex_unlock(&sim->lock);
+}
+
+static void *sim_thread(void *arg)
+{
+	struct memcpy_afu_sim *sim = arg;
+	struct memcpy_work_element *we;
+	unsigned long idle = 0;
+	__u8 cmd, status;
+	__u16 irq;
+
+	while (__atomic_load_n(&sim->running, __ATOMIC_ACQUIRE)) {
+		if (__atomic_load_n(&sim->stopped, __ATOMIC_ACQUIRE)) {
+			pthread_mutex_lock(&sim->lock);
+			while (sim->stopped && sim->running)
+				pthread_cond_wait(&sim->cond, &sim->lock);
+			pthread_mutex_unlock(&sim->lock);
+			continue;
+		}
+
+		we = &sim->queue[sim->next];
+		cmd = __atomic_load_n(&we->cmd, __ATOMIC_ACQUIRE);
+		if (!(cmd & MEMCPY_WE_CMD_VALID) ||
+		    (cmd & MEMCPY_WE_CMD_WRAP) != sim->wrap) {
+			if (__atomic_load_n(&afu_cfg, __ATOMIC_RELAXED) &
+			    MEMCPY_AFU_PSA_REG_CFG_Stop_on_Inv_Cmd) {
+				sim_stop_on_invalid(sim, we);
+				continue;
+			}
+			if (++idle < IDLE_SPINS)
+				cpu_relax();
+			else if (idle < IDLE_YIELDS)
+				sched_yield();
+			else
+				nanosleep(&idle_sleep, NULL);
+			continue;
+		}
+		idle = 0;
+
+		irq = 0;
+		switch (cmd & 0x3f) {
+		case MEMCPY_WE_CMD_COPY:
+			status = sim_copy(we);
+			break;
+		case MEMCPY_WE_CMD_IRQ:
+			irq = be16toh(we->length);
+			if (irq == 0 || irq > sim->num_irqs) {
+				status = MEMCPY_WE_STAT_INV_SRC;
+				irq = 0;
+			} else {
+				status = 0;
+			}
+			break;
+		case MEMCPY_WE_CMD_INCR:
+			status = sim_incr(we);
+			break;
+		case MEMCPY_WE_CMD_ATOMIC:
+			status = sim_atomic(we);
+			break;
+		default:
+			status = MEMCPY_WE_STAT_UNDEF_CMD;
+			break;
+		}
+
+		if (++sim->next == sim->length) {
+			sim->next = 0;
+			sim->wrap ^= MEMCPY_WE_CMD_WRAP;
+		}
+
+		/*
+		 * The AFU stops after sending an interrupt and waits for the
+		 * process to be restarted through the Process Control Register.
+		 */
+		if (irq)
+			sim_stop(sim);
+		__atomic_store_n(&we->status, MEMCPY_WE_STAT_COMPLETE | status,
+				 __ATOMIC_RELEASE);
+		if (irq)
+			sim_raise_irq(sim, irq);
+	}
+	return NULL;
+}
+
+int memcpy_afu_sim_start(struct memcpy_afu_sim *sim, int pe, __u64 wed,
+			 int num_irqs, int event_fd)
+{
+	int rc;
+
+	memset(sim, 0, sizeof(*sim));
+	sim->pe = pe;
+	sim->wed = wed;
+	sim->num_irqs = num_irqs;
+	sim->event_fd = event_fd;
+	sim->queue = (struct memcpy_work_element *)(uintptr_t)
+		(wed & 0xfffffffffffff000ULL);
+	sim->length = (wed & 0xfffULL) * CACHELINESIZE /
+		sizeof(struct memcpy_work_element);
+	pthread_mutex_init(&sim->lock, NULL);
+	pthread_cond_init(&sim->cond, NULL);
+
+	/* A context without a queue (e.g. the master) only exposes its PSA */
+	if (!sim->queue || !sim->length)
+		return 0;
+
+	sim->running = 1;
+	rc = pthread_create(&sim->thread, NULL, sim_thread, sim);
+	if (rc) {
+		sim->running = 0;
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+void memcpy_afu_sim_stop(struct memcpy_afu_sim *sim)
+{
+	if (!sim->running)
+		return;
+	pthread_mutex_lock(&sim->lock);
+	__atomic_store_n(&sim->running, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&sim->cond);
+	pthread_mutex_unlock(&sim->lock);
+	pthread_join(sim->thread, NULL);
+}
+
+int memcpy_afu_sim_read64(struct memcpy_afu_sim *sim, __u64 offset,
+			  __u64 *data)
+{
+	switch (offset) {
+	case MEMCPY_PS_REG_WED:
+		*data = sim->wed;
+		break;
+	case MEMCPY_PS_REG_PH:
+		*data = (__u64)sim->pe << 48;
+		break;
+	case MEMCPY_PS_REG_STATUS:
+		*data = __atomic_load_n(&sim->stopped, __ATOMIC_ACQUIRE) ?
+			MEMCPY_PS_REG_STATUS_Stopped : 0;
+		break;
+	case MEMCPY_PS_REG_TB:
+		*data = __atomic_load_n(&sim->tb, __ATOMIC_ACQUIRE);
+		break;
+	default:
+		*data = 0;
+		break;
+	}
+	return 0;
+}
+
+int memcpy_afu_sim_write64(struct memcpy_afu_sim *sim, __u64 offset,
+			   __u64 data)
+{
+	switch (offset) {
+	case MEMCPY_PS_REG_PCTRL:
+		if (!(data & MEMCPY_PS_REG_PCTRL_Restart))
+			break;
+		pthread_mutex_lock(&sim->lock);
+		sim->stopped = 0;
+		pthread_cond_broadcast(&sim->cond);
+		pthread_mutex_unlock(&sim->lock);
+		break;
+	case MEMCPY_PS_REG_TB:
+		/* Any write requests an update of the AFU timebase */
+		__atomic_store_n(&sim->tb, memcpy_afu_sim_timebase(),
+				 __ATOMIC_RELEASE);
+		break;
+	}
+	return 0;
+}
+
+int memcpy_afu_sim_global_read64(__u64 offset, __u64 *data)
+{
+	if (offset == MEMCPY_AFU_PSA_REG_CFG)
+		*data = __atomic_load_n(&afu_cfg, __ATOMIC_RELAXED);
+	else
+		*data = 0;
+	return 0;
+}
+
+int memcpy_afu_sim_global_write64(__u64 offset, __u64 data)
+{
+	if (offset == MEMCPY_AFU_PSA_REG_CFG)
+		__atomic_store_n(&afu_cfg, data, __ATOMIC_RELAXED);
+	return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MEMCPY_AFU_SIM_H_
+#define _MEMCPY_AFU_SIM_H_
+
+#include <pthread.h>
+#include <linux/types.h>
+#include "memcpy_afu_defs.h"
+
+/*
+ * Software model of one memcpy AFU process context.
+ *
+ * Once started, a thread walks the work element queue pointed at by the
+ * WED exactly like the AFU does: it waits for the element at the head of
+ * the queue to become valid (with the expected wrap bit), executes it,
+ * writes back its status and moves on, toggling its wrap state at the end
+ * of the queue.
+ */
+struct memcpy_afu_sim {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running;
+	int stopped;		/* Process Status Register "Stopped" bit */
+	int pe;
+	int num_irqs;
+	int event_fd;		/* where AFU interrupt events are written */
+	__u64 wed;
+	__u64 tb;		/* Timebase register, latched on write */
+	struct memcpy_work_element *queue;
+	int length;
+	int next;
+	__u8 wrap;
+};
+
+/* Environment variable selecting the emulated CAIA major version */
+#define MEMCPY_AFU_SIM_CAIA_ENV	"CXL_SIM_CAIA"
+
+long memcpy_afu_sim_caia_major(void);
+__u64 memcpy_afu_sim_timebase(void);
+
+int memcpy_afu_sim_start(struct memcpy_afu_sim *sim, int pe, __u64 wed,
+			 int num_irqs, int event_fd);
+void memcpy_afu_sim_stop(struct memcpy_afu_sim *sim);
+
+/* Per-process problem state registers */
+int memcpy_afu_sim_read64(struct memcpy_afu_sim *sim, __u64 offset,
+			  __u64 *data);
+int memcpy_afu_sim_write64(struct memcpy_afu_sim *sim, __u64 offset,
+			   __u64 data);
+
+/* AFU global registers, as seen through the master context */
+int memcpy_afu_sim_global_read64(__u64 offset, __u64 *data);
+int memcpy_afu_sim_global_write64(__u64 offset, __u64 data);
+
+#endif /* _MEMCPY_AFU_SIM_H_ */
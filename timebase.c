@@ -0,0 +1,62 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "timebase.h"
+
+#if defined(__powerpc__)
+#define CFG_TB_TICKS_PER_SEC 0x38
+
+static __u64 read_tb_ticks_per_sec(void)
+{
+	int fd;
+	__u64 tb_ticks_per_sec;
+
+	if ((fd = open("/proc/powerpc/systemcfg", O_RDONLY)) == -1) {
+		perror("Unable to open /proc/powerpc/systemcfg");
+		exit(1);
+	}
+	if (lseek(fd, CFG_TB_TICKS_PER_SEC, SEEK_SET) == -1) {
+		perror("lseek");
+		exit(1);
+	}
+	if (read(fd, &tb_ticks_per_sec, sizeof(tb_ticks_per_sec)) == -1) {
+		perror("read");
+		exit(1);
+	}
+	close(fd);
+	return tb_ticks_per_sec;
+}
+#else
+/* No timebase register: tb_now() counts nanoseconds */
+static __u64 read_tb_ticks_per_sec(void)
+{
+	return 1000000000ULL;
+}
+#endif
+
+__u64 tb_ticks_per_sec(void)
+{
+	static __u64 ticks_per_sec;
+
+	if (!ticks_per_sec)
+		ticks_per_sec = read_tb_ticks_per_sec();
+	return ticks_per_sec;
+}
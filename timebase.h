@@ -0,0 +1,76 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _TIMEBASE_H_
+#define _TIMEBASE_H_
+
+#include <time.h>
+#include <linux/types.h>
+
+/*
+ * Time stamps for the hot loops: the timebase register on POWER,
+ * CLOCK_MONOTONIC_RAW nanoseconds elsewhere.  Times stay in ticks and are
+ * only converted when reported; deadlines are tick counts compared to
+ * tb_now(), so checking one costs a timebase read.
+ */
+#if defined(__powerpc__)
+#define SPRN_TBRL 0x10C
+static inline __u64 tb_now(void)
+{
+	unsigned long rval;
+
+	__asm__ __volatile__ ("mfspr %0,%1" : "=r" (rval) : "i" (SPRN_TBRL));
+	return rval;
+}
+#else
+static inline __u64 tb_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+__u64 tb_ticks_per_sec(void);
+
+static inline double tb_to_ns(__u64 ticks)
+{
+	return ticks * 1e9 / tb_ticks_per_sec();
+}
+
+static inline double tb_to_us(__u64 ticks)
+{
+	return ticks * 1e6 / tb_ticks_per_sec();
+}
+
+static inline __u64 tb_from_ns(__u64 ns)
+{
+	return ns * tb_ticks_per_sec() / 1000000000;
+}
+
+/* Tick count at which usecs from now have elapsed */
+static inline __u64 tb_deadline(__u64 usecs)
+{
+	return tb_now() + usecs * tb_ticks_per_sec() / 1000000;
+}
+
+static inline int tb_expired(__u64 deadline)
+{
+	return (__s64)(tb_now() - deadline) > 0;
+}
+
+#endif /* _TIMEBASE_H_ */
@@ -0,0 +1,219 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <linux/types.h>
+
+#include "verify.h"
+
+#define BITS_PER_LONG	(8 * sizeof(unsigned long))
+
+/* As in pattern.c: AVX2 or VSX where the compiler may use them */
+typedef __u64 verify_v4 __attribute__((vector_size(32)));
+
+#if defined(__x86_64__)
+#define VERIFY_CLONES	__attribute__((target_clones("avx2", "default")))
+#else
+#define VERIFY_CLONES
+#endif
+
+/* Lines checked at once, before looking for the bad one */
+#define VERIFY_BLOCK	8
+
+/* Ors the differences of a line into *d, in place as for pattern_mix_v4() */
+static inline void xor_line(verify_v4 *d, const char *dst, const char *src)
+{
+	verify_v4 a, b;
+	int i;
+
+	for (i = 0; i < VERIFY_LINE; i += sizeof(a)) {
+		memcpy(&a, dst + i, sizeof(a));
+		memcpy(&b, src + i, sizeof(b));
+		*d |= a ^ b;
+	}
+}
+
+/* The first of lines [from, nlines) which differs, nlines if none */
+VERIFY_CLONES
+static size_t next_bad_line(const char *dst, const char *src, size_t from,
+			    size_t nlines)
+{
+	verify_v4 d;
+	size_t off;
+	int i;
+
+	for (; from + VERIFY_BLOCK <= nlines; from += VERIFY_BLOCK) {
+		off = from << VERIFY_LINE_SHIFT;
+		d = (verify_v4){ 0, 0, 0, 0 };
+		for (i = 0; i < VERIFY_BLOCK; i++, off += VERIFY_LINE)
+			xor_line(&d, dst + off, src + off);
+		if (d[0] | d[1] | d[2] | d[3])
+			break;
+	}
+	for (; from < nlines; from++) {
+		off = from << VERIFY_LINE_SHIFT;
+		d = (verify_v4){ 0, 0, 0, 0 };
+		xor_line(&d, dst + off, src + off);
+		if (d[0] | d[1] | d[2] | d[3])
+			break;
+	}
+	return from;
+}
+
+/* Only for bad lines: no need to be fast */
+static int classify_line(struct verify_result *res, const char *dst,
+			 const char *src, size_t off, size_t n, size_t len)
+{
+	size_t i, w;
+	long d;
+
+	for (i = 0; i < n && !dst[off + i]; i++)
+		;
+	if (i == n)
+		return VERIFY_ZERO;
+
+	for (i = 0; i < n; i += 8) {
+		w = n - i < 8 ? n - i : 8;
+		if (!memcmp(dst + off + i, src + off + i, w))
+			return VERIFY_PARTIAL;
+	}
+
+	for (d = -(long)VERIFY_SHIFT_MAX; d <= (long)VERIFY_SHIFT_MAX; d += 8) {
+		if (!d || (long)off + d < 0 || off + d + n > len)
+			continue;
+		if (!memcmp(dst + off, src + off + d, n)) {
+			if (!res->kinds[VERIFY_SHIFTED])
+				res->shift = d;
+			return VERIFY_SHIFTED;
+		}
+	}
+	return VERIFY_STALE;
+}
+
+/*
+ * Returns the number of bad lines, 0 if dst matches src.  The bitmap is
+ * only allocated when there are bad lines, release it with verify_free().
+ */
+size_t verify_buffers(struct verify_result *res, const void *dst,
+		      const void *src, size_t len)
+{
+	const char *d = dst, *s = src;
+	size_t full = len >> VERIFY_LINE_SHIFT, line, off, n, i;
+
+	memset(res, 0, sizeof(*res));
+	res->lines = (len + VERIFY_LINE - 1) >> VERIFY_LINE_SHIFT;
+
+	for (line = 0; line < res->lines; line++) {
+		if (line < full)
+			line = next_bad_line(d, s, line, full);
+		if (line == full && (line == res->lines ||
+				     !memcmp(d + (full << VERIFY_LINE_SHIFT),
+					     s + (full << VERIFY_LINE_SHIFT),
+					     len - (full << VERIFY_LINE_SHIFT))))
+			break;
+
+		off = line << VERIFY_LINE_SHIFT;
+		n = len - off < VERIFY_LINE ? len - off : VERIFY_LINE;
+		if (!res->bitmap)
+			res->bitmap = calloc((res->lines + BITS_PER_LONG - 1) /
+					     BITS_PER_LONG, sizeof(long));
+		if (res->bitmap)
+			res->bitmap[line / BITS_PER_LONG] |=
+				1UL << (line % BITS_PER_LONG);
+		for (i = 0; d[off + i] == s[off + i]; i++)
+			;
+		if (!res->bad_lines)
+			res->first = off + i;
+		for (i = n - 1; d[off + i] == s[off + i]; i--)
+			;
+		res->last = off + i;
+		if (res->bad_lines < VERIFY_CLASSIFY_MAX)
+			res->kinds[classify_line(res, d, s, off, n, len)]++;
+		else
+			res->unclassified++;
+		res->bad_lines++;
+	}
+	return res->bad_lines;
+}
+
+/*
+ * Prints e.g.
+ *  <prefix>3 of 8 lines bad, bytes 128-511: 2 zero, 1 shifted (by -8)
+ *  <prefix>bad lines: 1-2,5
+ */
+void verify_print(const char *prefix, const struct verify_result *res)
+{
+	static const char * const kind_names[] = {
+		[VERIFY_ZERO] = "zero",
+		[VERIFY_PARTIAL] = "partial",
+		[VERIFY_SHIFTED] = "shifted",
+		[VERIFY_STALE] = "stale",
+	};
+	size_t line, end, ranges = 0;
+	const char *sep = ": ";
+	int k;
+
+#define BAD(l)	(res->bitmap[(l) / BITS_PER_LONG] & \
+		 (1UL << ((l) % BITS_PER_LONG)))
+
+	if (!res->bad_lines)
+		return;
+	printf("%s%zu of %zu lines bad, bytes %zu-%zu", prefix,
+	       res->bad_lines, res->lines, res->first, res->last);
+	for (k = 0; k < VERIFY_KINDS; k++) {
+		if (!res->kinds[k])
+			continue;
+		printf("%s%zu %s", sep, res->kinds[k], kind_names[k]);
+		if (k == VERIFY_SHIFTED)
+			printf(" (by %+ld)", res->shift);
+		sep = ", ";
+	}
+	if (res->unclassified)
+		printf("%s%zu unclassified", sep, res->unclassified);
+	printf("\n");
+
+	if (!res->bitmap)
+		return;
+	printf("%sbad lines:", prefix);
+	sep = " ";
+	for (line = 0; line < res->lines; line = end) {
+		for (; line < res->lines && !BAD(line); line++)
+			;
+		if (line == res->lines)
+			break;
+		for (end = line + 1; end < res->lines && BAD(end); end++)
+			;
+		if (++ranges > 16) {
+			printf(",...");
+			break;
+		}
+		if (end - line > 1)
+			printf("%s%zu-%zu", sep, line, end - 1);
+		else
+			printf("%s%zu", sep, line);
+		sep = ",";
+	}
+	printf("\n");
+#undef BAD
+}
+
+void verify_free(struct verify_result *res)
+{
+	free(res->bitmap);
+	res->bitmap = NULL;
+}
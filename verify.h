@@ -0,0 +1,62 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include <stddef.h>
+
+/*
+ * Compares a copy with its source in 128 byte lines, the unit the AFU
+ * reads and writes, counted from the start of the buffers.  Each bad
+ * line is classified as:
+ *
+ *  zero	all zero: the line was never written,
+ *  partial	some of its 8 byte words are right,
+ *  shifted	a line of the source, from up to VERIFY_SHIFT_MAX bytes
+ *		before or after: a wrong address or offset,
+ *  stale	something else: data of an older copy or of another buffer.
+ *
+ * Classifying a line takes up to a memcmp() per possible shift, so only
+ * the first VERIFY_CLASSIFY_MAX bad lines are, the others just counted.
+ */
+#define VERIFY_LINE_SHIFT	7
+#define VERIFY_LINE		(1UL << VERIFY_LINE_SHIFT)
+#define VERIFY_SHIFT_MAX	(4 * VERIFY_LINE)
+#define VERIFY_CLASSIFY_MAX	64
+
+#define VERIFY_ZERO		0
+#define VERIFY_PARTIAL		1
+#define VERIFY_SHIFTED		2
+#define VERIFY_STALE		3
+#define VERIFY_KINDS		4
+
+struct verify_result {
+	size_t lines;			/* lines in the buffers */
+	size_t bad_lines;
+	size_t first, last;		/* offsets of the first and last bad byte */
+	size_t kinds[VERIFY_KINDS];	/* bad lines of each kind */
+	size_t unclassified;		/* bad lines past VERIFY_CLASSIFY_MAX */
+	long shift;			/* of the first shifted line, in bytes */
+	unsigned long *bitmap;		/* bad lines, NULL if none */
+};
+
+size_t verify_buffers(struct verify_result *res, const void *dst,
+		      const void *src, size_t len);
+void verify_print(const char *prefix, const struct verify_result *res);
+void verify_free(struct verify_result *res);
+
+#endif /* _VERIFY_H_ */